@@ -0,0 +1,39 @@
+#ifndef __CPU_IRQ_H
+#define __CPU_IRQ_H
+
+#include <types.h>
+#include <cpu/percpu.h>
+
+#define RFLAGS_IF (1ul << 9)
+
+// Interrupt nesting depth of each CPU, maintained by root_isr_handler.
+extern u32_t __irq_depth[MAX_CPUS];
+
+// Whether the current CPU is running an interrupt or exception handler.
+static inline u8_t in_interrupt() {
+    return __irq_depth[cpu_id()] != 0;
+}
+
+// Disable interrupts on the current CPU. Returns the previous RFLAGS, to be passed to irq_restore.
+// The test suites run in user mode where cli faults, so there it does nothing.
+static inline u64_t irq_save() {
+#ifdef TESTSUITE
+    return 0;
+#else
+    u64_t rflags;
+    asm volatile("pushfq; popq %0; cli" : "=r" (rflags) : : "memory");
+
+    return rflags;
+#endif
+}
+
+// Re-enable interrupts if they were enabled when the matching irq_save was called.
+static inline void irq_restore(u64_t rflags) {
+#ifndef TESTSUITE
+    if (rflags & RFLAGS_IF) {
+        asm volatile("sti" : : : "memory");
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __CPU_PERCPU_H
+#define __CPU_PERCPU_H
+
+#include <types.h>
+
+// Upper bound on the number of CPUs per-CPU data is laid out for.
+#define MAX_CPUS 16
+
+// Number of CPUs which run kernel code. The application processors are never started, only the BSP runs.
+// Code which shares state between CPUs without a lock relies on this and static asserts it.
+#define NUM_ONLINE_CPUS 1
+
+_Static_assert(NUM_ONLINE_CPUS <= MAX_CPUS, "per-CPU arrays must cover every online CPU");
+
+// Index of the CPU executing the caller, used to index per-CPU arrays. Always the BSP while NUM_ONLINE_CPUS is 1.
+static inline u32_t cpu_id() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __CPU_TSC_H
+#define __CPU_TSC_H
+
+#include <types.h>
+
+// Read the time stamp counter. This isn't serializing so it's only meant for coarse cycle measurements.
+static inline u64_t rdtsc() {
+    u32_t low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+
+    return ((u64_t)high << 32) | low;
+}
+
+#endif
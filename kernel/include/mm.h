@@ -2,6 +2,7 @@
 #define _MM_ADDR_TYPES_H
 
 #include <types.h>
+#include <cpu/irq.h>
 
 typedef void * virt_addr_t;
 typedef size_t phys_addr_t;
@@ -14,6 +15,16 @@ typedef size_t phys_addr_t;
 
 #define KERNEL_VMA 0xFFFFFFFF80000000
 
+// Allocation flags of the slab, magazine and kmalloc layers. MM_ATOMIC allocations never grow an allocator, map
+// memory or run shrinkers. They're served from memory which is already free or from reserve pools, which makes them
+// safe and bounded in interrupt handlers. Allocations made from an interrupt handler are always atomic.
+#define MM_NORMAL 0
+#define MM_ATOMIC 1
+
+static inline u8_t mm_atomic(u8_t flags) {
+    return (flags & MM_ATOMIC) || in_interrupt();
+}
+
 // The first 2GB of physical memory is mapped into the high 2GB of the address space
 // like in Linux. This macro DRYs up the conversion from an address to this physical
 // address for kernel functions.
@@ -109,11 +120,11 @@ static inline virt_addr_t kphys_addr_for_entry(pt_entry_t entry) {
 }
 
 static inline phys_addr_t phys_addr_for_kphys(virt_addr_t kphys_addr) {
-    if (kphys_addr < (virt_addr_t)KERNEL_VMA) {
+    if (kphys_addr < KPHYS_ADDR(0)) {
         return NULL;
     }
 
-    return (size_t)kphys_addr - (size_t)KERNEL_VMA;
+    return (size_t)kphys_addr - (size_t)KPHYS_ADDR(0);
 }
 
 static inline phys_addr_t phys_addr_for_entry(pt_entry_t entry) {
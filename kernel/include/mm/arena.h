@@ -0,0 +1,53 @@
+#ifndef __MM_ARENA_H
+#define __MM_ARENA_H
+
+#include <mm.h>
+
+// Arenas bump allocate short lived objects out of page backed chunks. Objects aren't freed one by one, instead
+// arena_push marks a scope and arena_pop releases everything allocated since in one go. Scopes must be popped
+// in the reverse order they were pushed, which nested interrupt handlers naturally do.
+
+// Pages per chunk. Allocations which don't fit a chunk of this size get a chunk of their own.
+#define ARENA_CHUNK_PAGES 4
+
+typedef struct __arena_chunk {
+    // The chunk allocated before this one.
+    struct __arena_chunk *prev;
+    size_t pages;
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *chunk;
+    u8_t *cursor;
+    u8_t *end;
+
+    // The last chunk released by arena_pop, kept around so that scopes which keep crossing the same chunk boundary
+    // don't go back to the page allocator each time.
+    arena_chunk_t *spare;
+} arena_t;
+
+// Position of an arena to pop back to.
+typedef struct {
+    arena_chunk_t *chunk;
+    u8_t *cursor;
+} arena_scope_t;
+
+// Initialize an empty arena, chunks are allocated on first use. A zeroed arena_t is empty as well.
+void arena_init(arena_t *arena);
+
+// Allocate size bytes aligned to align, which must be a power of 2. Returns NULL if out of memory.
+void *arena_alloc(arena_t *arena, size_t size, size_t align);
+
+// Mark the current position of the arena.
+static inline arena_scope_t arena_push(arena_t *arena) {
+    arena_scope_t scope = { arena->chunk, arena->cursor };
+    return scope;
+}
+
+// Release everything allocated since scope was pushed.
+void arena_pop(arena_t *arena, arena_scope_t scope);
+
+// Give every chunk of the arena back to the page allocator.
+void arena_release(arena_t *arena);
+
+#endif
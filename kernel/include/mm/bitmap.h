@@ -4,14 +4,123 @@
 #include <mm.h>
 #include <types.h>
 
+// Bitmaps are stored as an array of 64 bit words so scans and range operations can work a word at a time.
+#define BMP_WORD_ORDER 6
+#define BMP_WORD_BITS  (1 << BMP_WORD_ORDER)
+#define BMP_WORD_MASK  (BMP_WORD_BITS - 1)
+
+// Returned by the search functions when no bit matches.
+#define BMP_NOT_FOUND 0xFFFFFFFFFFFFFFFF
+
 typedef struct __bitmap {
-    u8_t *base;
-    size_t size_bytes;
+    u64_t *base;
+    size_t size_bits;
+    size_t size_words;
 } bitmap_t;
 
-void bmp_init(bitmap_t *bmp, u8_t *base, size_t size_bits);
-u8_t bmp_get_bit(const bitmap_t *bmp, const size_t index);
-u8_t bmp_set_bit(bitmap_t *bmp, const size_t index, u8_t value);
-u8_t bmp_toggle_bit(bitmap_t *bmp, const size_t index);
+// Number of words needed to back a bitmap of size_bits.
+static inline size_t bmp_size_words(size_t size_bits) {
+    return (size_bits + BMP_WORD_MASK) >> BMP_WORD_ORDER;
+}
+
+void bmp_init(bitmap_t *bmp, u64_t *base, size_t size_bits);
+
+static inline u8_t bmp_get_bit(const bitmap_t *bmp, const size_t index) {
+    if (index >= bmp->size_bits) {
+        return 0;
+    }
+
+    return (bmp->base[index >> BMP_WORD_ORDER] >> (index & BMP_WORD_MASK)) & 0x1;
+}
+
+// Returns 1 if the bit was set and 0 if the index is out of bounds.
+static inline u8_t bmp_set_bit(bitmap_t *bmp, const size_t index, u8_t value) {
+    if (index >= bmp->size_bits) {
+        return 0;
+    }
+
+    const u64_t bit_mask = 1ul << (index & BMP_WORD_MASK);
+
+    if (value > 0) {
+        bmp->base[index >> BMP_WORD_ORDER] |= bit_mask;
+    } else {
+        bmp->base[index >> BMP_WORD_ORDER] &= ~bit_mask;
+    }
+
+    return 1;
+}
+
+// Returns the new value of the bit.
+static inline u8_t bmp_toggle_bit(bitmap_t *bmp, const size_t index) {
+    if (index >= bmp->size_bits) {
+        return 0;
+    }
+
+    u64_t *word = &bmp->base[index >> BMP_WORD_ORDER];
+    *word ^= 1ul << (index & BMP_WORD_MASK);
+
+    return (*word >> (index & BMP_WORD_MASK)) & 0x1;
+}
+
+// Searches return the index of the first matching bit at or after start, or BMP_NOT_FOUND.
+size_t bmp_find_next_set(const bitmap_t *bmp, size_t start);
+size_t bmp_find_next_zero(const bitmap_t *bmp, size_t start);
+
+static inline size_t bmp_find_first_set(const bitmap_t *bmp) {
+    return bmp_find_next_set(bmp, 0);
+}
+
+static inline size_t bmp_find_first_zero(const bitmap_t *bmp) {
+    return bmp_find_next_zero(bmp, 0);
+}
+
+// Index of the last set bit in the bitmap, or BMP_NOT_FOUND.
+size_t bmp_find_last_set(const bitmap_t *bmp);
+
+// Set or clear count bits starting at start. The range is clipped to the size of the bitmap.
+void bmp_set_range(bitmap_t *bmp, size_t start, size_t count);
+void bmp_clear_range(bitmap_t *bmp, size_t start, size_t count);
+
+// Number of set bits in the bitmap.
+size_t bmp_popcount(const bitmap_t *bmp);
+
+// Up to 4 summary levels covers 64^4 leaf words, that's 4TB worth of pages when tracking 4KB pages.
+#define SBMP_MAX_LEVELS 4
+
+// A bitmap where set bits are in use, with a hierarchy of summary bitmaps on top to find clear (free) bits quickly.
+// Bit i of summary level 0 is set if word i of the leaf has a clear bit. Bit i of summary level n is set if word i of
+// level n - 1 is non zero. The last summary level fits in a single word, so finding a free bit takes one word read
+// per level.
+typedef struct {
+    bitmap_t leaf;
+    bitmap_t summary[SBMP_MAX_LEVELS];
+    u8_t num_levels;
+} summary_bitmap_t;
+
+// Number of words needed to back a summary bitmap of size_bits, including the summary levels.
+size_t sbmp_size_words(size_t size_bits);
+
+// Largest bitmap which fits in SBMP_MAX_LEVELS summary levels.
+#define SBMP_MAX_BITS (1ul << (BMP_WORD_ORDER * (SBMP_MAX_LEVELS + 1)))
+
+// Initializes the summary bitmap with every bit clear. Returns -1 without touching sbmp if size_bits is larger than
+// SBMP_MAX_BITS, 0 otherwise.
+int sbmp_init(summary_bitmap_t *sbmp, u64_t *base, size_t size_bits);
+
+static inline u8_t sbmp_get_bit(const summary_bitmap_t *sbmp, const size_t index) {
+    return bmp_get_bit(&sbmp->leaf, index);
+}
+
+void sbmp_set_bit(summary_bitmap_t *sbmp, const size_t index, u8_t value);
+
+void sbmp_set_range(summary_bitmap_t *sbmp, size_t start, size_t count);
+void sbmp_clear_range(summary_bitmap_t *sbmp, size_t start, size_t count);
+
+// Index of the first clear bit at or after start, or BMP_NOT_FOUND.
+size_t sbmp_find_next_zero(const summary_bitmap_t *sbmp, size_t start);
+
+static inline size_t sbmp_find_first_zero(const summary_bitmap_t *sbmp) {
+    return sbmp_find_next_zero(sbmp, 0);
+}
 
 #endif
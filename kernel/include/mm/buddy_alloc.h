@@ -3,67 +3,60 @@
 
 #include <mm.h>
 #include <mm/bitmap.h>
-#include <mm/slab.h>
+#include <mm/page.h>
 #include <types.h>
 #include <utility/math.h>
 
-#define MAX_ORDER 7
+#define MAX_ORDER 18
 #define PAGE_OFFSET_OOB 0xFFFFFFFFFFFFFFFF
 
 // Number of bits in the bitmap needed to represent the state of pairs of buddies in a block of
 // MAX_ORDER + 1. 2^(N+1) - 1
-#define MAX_BLOCK_BITS ((1 << (MAX_ORDER + 1)) - 1)
+#define MAX_BLOCK_BITS ((1ul << (MAX_ORDER + 1)) - 1)
 
-#define FREELIST_PRESENT 0x1
-
-// Free list nodes will be allocated by a SLAB allocator.
+// Event counters of a buddy allocator, counted in blocks.
 typedef struct {
-    // The next entry is referred to as an offset between the virtual address of the current freelist entry and the next entry.
-    // We only need signed 32 bits as freelist entries are allocated in a 1GB region of virtual memory.
-    s32_t next_entry;
-    
-    // Page offset is the number of pages from base_addr of the allocator that this free list node represents
-    u64_t page_offset : 24;
-    u8_t flags;
-} freelist_entry_t;
+    u64_t allocs;
+    u64_t frees;
+    // Number of times a block was broken into two buddies, and number of times two buddies were merged.
+    u64_t splits;
+    u64_t coalesces;
+    // Allocations which couldn't be satisfied. A short bulk allocation counts as a single failure.
+    u64_t failures;
+} buddy_stats_t;
 
 typedef struct buddy_allocator {
     // Maps bits corresponding to a pair of buddies. Each pair has a single bit.
     // The bit is 1 if only one of the buddies is allocated, and 0 if both are allocated or free.
     bitmap_t buddy_state_map;
 
-    // SLAB Allocator Cache for the freelist.
-    kmem_cache_t freelist_cache;
-
-    // We maintain a single free list for all orders
-    freelist_entry_t *freelists[MAX_ORDER + 1];
+    // Heads of the freelists of each order. Free blocks are linked through the buddy_free_info of their base page
+    // so the allocator never has to allocate memory to track free blocks.
+    page_info_t *freelists[MAX_ORDER + 1];
 
+    // Page offsets are relative to base_addr, which is start_addr aligned down to a MAX_ORDER block.
+    // Only memory between start_addr and end_addr is managed by the allocator.
     phys_addr_t base_addr;
+    phys_addr_t start_addr;
     phys_addr_t end_addr;
 
     size_t free_space_bytes;
     size_t allocated_bytes;
-} buddy_allocator_t;
 
-// The size estimate that occurs when preallocing will occur in two stages.
-// We'd like to allocate the bitmap and buddy_allocator_t structs separately
-// and the freelist pool separately.
-typedef struct {
-    u16_t bitmap_and_struct_pages;
-    u16_t freelist_pool_slabs;
-} buddy_prealloc_vector;
-
-// Memory pool for internal buddy allocator structures
-typedef struct {
-    virt_addr_t bitmap_and_struct_pool;
-    virt_addr_t freelist_pool;
-    u16_t freelist_pool_slabs;
-} buddy_memory_pool;
+    // Length of each freelist.
+    size_t free_blocks[MAX_ORDER + 1];
+    buddy_stats_t stats;
+} buddy_allocator_t;
 
 static inline size_t page_offset_of(phys_addr_t address) {
     return address >> PAGE_ORDER;
 }
 
+// Page offset of the block whose base page is described by page.
+static inline size_t buddy_block_offset(const buddy_allocator_t *allocator, const page_info_t *page) {
+    return page_offset_of(page_address_from_info(page) - allocator->base_addr);
+}
+
 // Determines the index in the bitmap representing the state of a pair of buddies
 // at the provided page offset and order.
 // Any address within a block of size order + 1 is acceptable, whether its
@@ -81,7 +74,7 @@ static inline size_t buddy_bmp_index_of(size_t page_offset, u8_t order) {
     // the orderth bit. Doing this provides us with a unique index for any given pair of buddies
     // at a specified order. If the order specified is 0 and the page_offset is 0 then the final
     // index will be 1. We want it 0 indexed so we subtract by 1 afterwards.
-    size_t bit_offset = (max_block_remainder & ~MASK_FOR_FIRST_N_BITS(order)) | (1 << order);
+    size_t bit_offset = (max_block_remainder & ~MASK_FOR_FIRST_N_BITS(order)) | (1ul << order);
 
     // The offset of our MAX_ORDER + 1 block times the number of bits needed to represent
     // each "super block" gives us the number of bits needed to represent all previous pairs of 
@@ -92,24 +85,32 @@ static inline size_t buddy_bmp_index_of(size_t page_offset, u8_t order) {
 
 size_t buddy_bmp_size_bits(size_t num_pages);
 
-buddy_prealloc_vector buddy_estimate_pool_size(size_t num_pages);
+// Number of pages needed for the state bitmap of an allocator managing start_addr to end_addr.
+size_t buddy_bitmap_pages(phys_addr_t start_addr, phys_addr_t end_addr);
 
-// Initialize the buddy allocator. 
-void buddy_init(buddy_allocator_t *allocator, buddy_memory_pool pool, phys_addr_t start_addr, phys_addr_t end_addr);
-
-// Extends the freelist cache by a number of slabs. It doesn't actually perform the allocation, it's the responsibility
-// of the caller to assert that the virtual memory has been mapped correctly.
-void buddy_freelist_pool_expand(buddy_allocator_t *allocator, void *slab);
+// Initialize the buddy allocator to manage the usable memory between start_addr and end_addr.
+// The state bitmap is stored in bitmap_pool which should be at least buddy_bitmap_pages long.
+// The global page map must be initialized since free blocks are tracked through their page info.
+void buddy_init(buddy_allocator_t *allocator, void *bitmap_pool, phys_addr_t start_addr, phys_addr_t end_addr);
 
 // Allocator a block of the specified order. The caller should remember what order the block is
-// in order to free the block correctly. Returns the base address of the block.
+// in order to free the block correctly. Returns the base address of the block, or NULL if no block
+// of that order is available.
 phys_addr_t buddy_alloc_block(buddy_allocator_t *allocator, u8_t order);
 
+// Allocate up to count blocks of the specified order into blocks in a single pass over the freelists.
+// Free blocks of a larger order which fit entirely in the batch are carved up without being split level by level.
+// Returns the number of blocks allocated, which is less than count if the allocator ran out of memory.
+size_t buddy_alloc_bulk(buddy_allocator_t *allocator, u8_t order, phys_addr_t *blocks, size_t count);
+
 // Free a block given the base of the block and the order of the block.
 void buddy_free_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t order);
 
+// Free count blocks of the same order.
+void buddy_free_bulk(buddy_allocator_t *allocator, const phys_addr_t *blocks, size_t count, u8_t order);
+
 // Shrinks an allocated block of a given order to a target number of pages. 
 // Num pages should be strictly less than 2^(block_order). 
-void buddy_shrink_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t block_order, u8_t num_pages);
+void buddy_shrink_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t block_order, size_t num_pages);
 
 #endif
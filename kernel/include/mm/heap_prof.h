@@ -0,0 +1,69 @@
+#ifndef __MM_HEAP_PROF_H
+#define __MM_HEAP_PROF_H
+
+#include <types.h>
+#include <mm.h>
+
+// Set to 0 to compile out the heap profiler hooks in kmalloc and the slab caches.
+#define MM_HEAP_PROFILE 1
+
+// The profiler attributes allocations to the return address of the kmalloc or slab_alloc call which made them.
+// Call sites live in a small open addressed hash, sampled allocations which are still live in a larger one so that
+// frees can be charged back to the right site. Both sizes are powers of 2.
+#define HEAP_PROF_SITES 64
+#define HEAP_PROF_LIVE  1024
+
+typedef struct {
+    void *site;
+    u64_t live_bytes;
+    u64_t peak_bytes;
+    u64_t allocs;
+    u64_t frees;
+} heap_prof_site_t;
+
+// Sampling period in bytes, 0 while the profiler is stopped.
+extern u32_t heap_prof_sample_bytes;
+
+// Start profiling, sampling an allocation roughly every sample_bytes allocated bytes. Allocations of at least
+// sample_bytes are always sampled. Every sample stands for the larger of its size and sample_bytes, so the
+// counters estimate the real usage of each site. A period of 1 records every allocation exactly.
+void heap_prof_start(u32_t sample_bytes);
+
+// Stop profiling and forget every site.
+void heap_prof_stop();
+
+void __heap_prof_alloc(void *ptr, size_t size, void *site);
+void __heap_prof_free(void *ptr);
+
+static inline u8_t heap_prof_enabled() {
+#if MM_HEAP_PROFILE
+    return unlikely(heap_prof_sample_bytes != 0);
+#else
+    return 0;
+#endif
+}
+
+// Record the allocation of size bytes at ptr by the call site.
+static inline void heap_prof_alloc(void *ptr, size_t size, void *site) {
+    if (heap_prof_enabled() && ptr != NULL) {
+        __heap_prof_alloc(ptr, size, site);
+    }
+}
+
+// Record a free, which only does something if the allocation was sampled.
+static inline void heap_prof_free(void *ptr) {
+    if (heap_prof_enabled()) {
+        __heap_prof_free(ptr);
+    }
+}
+
+// Copy up to max sites into sites, ordered by live bytes with the largest first. Returns the number of sites copied.
+size_t heap_prof_sites(heap_prof_site_t *sites, size_t max);
+
+// Samples which were dropped because the site or live allocation hash was full.
+u64_t heap_prof_dropped();
+
+// Print the sites ordered by live bytes.
+void heap_prof_dump();
+
+#endif
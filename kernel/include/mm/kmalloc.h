@@ -6,19 +6,86 @@
 
 #define MAX_KMALLOC_SIZE 2040
 
-// The KMalloc API is used for allocating objects of size up to approximately a half page. Any larger allocations should be serviced
-// using a different method.
+// Set to 1 to keep the slab headers of the kmalloc caches in the global page map (see SLAB_CACHE_OFF_SLAB). kfree then
+// finds the cache of an object through the dense page map instead of reading the start of its slab.
+#define KMALLOC_OFF_SLAB 0
+
+// The KMalloc API serves objects of size up to MAX_KMALLOC_SIZE from slab caches. Larger allocations get their own
+// buddy block when one is available, or virtually contiguous memory from the vmalloc zone otherwise. Either way the
+// allocation starts with a KMALLOC_LARGE_HEADER byte header recording its size, so kfree works on any pointer.
+#define KMALLOC_LARGE_HEADER 64
+
+// Cache ID in the header of large allocations.
+#define KMALLOC_LARGE_ID 0xFFFC
 
 // These are sizes which have very low fragmentation when used with slab allocation given that the slab header is 24 bytes,
-// and these sizes are aligned by 8.
-static u16_t kmalloc_sizes[] = { 8, 16, 24, 48, 96, 120, 240, 480, 1016, 2040 };
+// and these sizes are aligned by 8. Listed as X(index, size, previous size, arg) so the tables below are generated
+// at compile time.
+#define KMALLOC_SIZE_CLASSES(X, arg) \
+    X(0, 8, 0, arg) X(1, 16, 8, arg) X(2, 24, 16, arg) X(3, 48, 24, arg) X(4, 96, 48, arg) \
+    X(5, 120, 96, arg) X(6, 240, 120, arg) X(7, 480, 240, arg) X(8, 1016, 480, arg) X(9, 2040, 1016, arg)
+
+#define KMALLOC_NUM_SIZES 10
+
+// The size class of a size up to MAX_KMALLOC_SIZE is the number of classes smaller than it. For a constant size this
+// folds down to a constant.
+#define __KMALLOC_SMALLER_THAN(idx, class_size, prev_size, size) + ((size) > (class_size))
+#define KMALLOC_SIZE_CLASS(size) (0 KMALLOC_SIZE_CLASSES(__KMALLOC_SMALLER_THAN, size))
+
+extern const u16_t kmalloc_sizes[KMALLOC_NUM_SIZES];
+
+// Maps from all possible values of (alloc_size + 7) / 8 to the size class for that alloc size.
+extern const u8_t __cache_idx_map[MAX_KMALLOC_SIZE / 8 + 1];
 
 // Initialize the caches for objects of each malloc size. Called in the mm_init process.
 void kmalloc_init();
 
-// KMalloc takes a request of size < max_kmalloc_size and returns a newly allocated object, or NULL if OOM.
-void *kmalloc(u16_t size);
+// Allocate from the cache of a size class. Used by kmalloc when the class is known at compile time.
+void *__kmalloc_class(u8_t size_class);
+
+// kmalloc for sizes which aren't known at compile time.
+void *__kmalloc(size_t size);
+
+// KMalloc returns a newly allocated object of at least size bytes, or NULL if OOM. Constant sizes such as
+// kmalloc(sizeof(T)) resolve their cache at compile time.
+static inline __attribute__((always_inline)) void *kmalloc(size_t size) {
+    if (__builtin_constant_p(size) && size <= MAX_KMALLOC_SIZE) {
+        return __kmalloc_class(KMALLOC_SIZE_CLASS(size));
+    }
+
+    return __kmalloc(size);
+}
+
+// kmalloc with MM_* flags. Atomic allocations are served from the magazines, free slab objects or the emergency pool
+// of the size class (see kmalloc_set_pool), and are always NULL above MAX_KMALLOC_SIZE. kmalloc called from an
+// interrupt handler behaves the same way.
+void *kmalloc_flags(size_t size, u8_t flags);
+
+// Set aside num_objects objects of the size class of size for atomic allocations once the class runs out of free
+// objects. Must not be called from an interrupt handler.
+void kmalloc_set_pool(size_t size, u16_t num_objects);
 
 void kfree(void *ptr);
 
+// Resize an allocation to new_size bytes, keeping its contents up to the smaller of the two sizes. The allocation stays
+// in place whenever it fits the object's size class or backing pages, page backed allocations give back pages they no
+// longer need. A NULL ptr allocates and a new_size of 0 frees. Returns NULL if OOM, in which case ptr is untouched.
+void *krealloc(void *ptr, size_t new_size);
+
+// The number of usable bytes in an allocation, which can be more than was requested.
+size_t ksize(void *ptr);
+
+// Allocate up to count objects of the same size into objs straight from the slab cache, bypassing the per-CPU
+// magazines. Returns the number of objects allocated.
+size_t kmalloc_bulk(u16_t size, void **objs, size_t count);
+
+// Free count objects. Runs of objects from the same cache go back to their slabs together.
+void kfree_bulk(void **objs, size_t count);
+
+// Return the objects held in the per-CPU magazines of every kmalloc cache to their slabs.
+void kmalloc_flush();
+
+// The cache backing kmalloc_sizes[cache_idx], or NULL if cache_idx is out of range.
+kmem_cache_t *kmalloc_cache(u16_t cache_idx);
+
 #endif
@@ -0,0 +1,77 @@
+#ifndef __MM_MAGAZINE_H
+#define __MM_MAGAZINE_H
+
+#include <mm.h>
+#include <mm/slab.h>
+#include <cpu/percpu.h>
+#include <types.h>
+
+// Per-CPU magazine layer on top of an object cache (Bonwick & Adams, "Magazines and Vmem").
+// Each CPU holds a loaded and a previous magazine of object pointers. Allocations and frees are served from
+// these without touching the cache, and only when both are exhausted (or both full) is a magazine exchanged with
+// the shared depot. The slab lists are only touched in batches to fill or empty whole magazines.
+
+// Number of objects held per magazine, chosen so that a magazine is 128 bytes.
+#define MAG_ROUNDS 14
+
+// Maximum number of full magazines kept in the depot, anything beyond that is flushed back to the slabs.
+#define MAG_DEPOT_MAX_FULL 8
+
+// Cache id of the slabs which magazines are allocated from, chosen so that kfree never mistakes one for a kmalloc cache.
+#define MAG_CACHE_ID 0xFFFE
+
+typedef struct __magazine {
+    // Link in the depot.
+    struct __magazine *next;
+    u64_t rounds;
+    void *objs[MAG_ROUNDS];
+} magazine_t;
+
+typedef struct {
+    magazine_t *loaded;
+    magazine_t *previous;
+} mag_cpu_t;
+
+// Shared by all CPUs. It takes no lock since only NUM_ONLINE_CPUS (1) CPU runs kernel code, which magazine.c asserts.
+typedef struct {
+    magazine_t *full;
+    magazine_t *empty;
+    u16_t full_count;
+    u16_t empty_count;
+} mag_depot_t;
+
+typedef struct {
+    kmem_cache_t *cache;
+    mag_cpu_t cpus[MAX_CPUS];
+    mag_depot_t depot;
+} mag_cache_t;
+
+// Set up the cache which magazines are allocated from. Must be called before any mag_cache_init.
+void magazine_init();
+
+// Put a magazine layer on top of an object cache. Magazines are allocated lazily on first use.
+void mag_cache_init(mag_cache_t *mc, kmem_cache_t *cache);
+
+// Allocate an object, only going to the depot and slab lists if the current CPU's magazines are empty.
+// Returns NULL if the object cache is out of memory.
+void *mag_alloc(mag_cache_t *mc);
+
+// Allocate an object with MM_* flags. Atomic allocations only swap in magazines which are already loaded or full in
+// the depot, and otherwise go to the slab lists with slab_alloc_flags.
+void *mag_alloc_flags(mag_cache_t *mc, u8_t flags);
+
+// Free an object to the current CPU's magazines. Interrupts are disabled while the magazines are touched.
+void mag_free(mag_cache_t *mc, void *ptr);
+
+// Return every object held in magazines (of all CPUs and the depot) to the slab lists, and free the magazines.
+void mag_cache_flush(mag_cache_t *mc);
+
+// Return the objects of the depot's full magazines to the slab lists, and free the depot's magazines. The CPUs'
+// magazines are left alone, so unlike mag_cache_flush this is safe while an allocation on the cache is running,
+// e.g. from a shrinker. Returns the number of objects returned to the slab lists.
+size_t mag_cache_drain_depot(mag_cache_t *mc);
+
+// Number of free objects currently held by the magazine layer.
+size_t mag_cache_objects(const mag_cache_t *mc);
+
+#endif
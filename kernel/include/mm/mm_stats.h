@@ -0,0 +1,69 @@
+#ifndef __MM_STATS_H
+#define __MM_STATS_H
+
+#include <types.h>
+#include <cpu/tsc.h>
+
+// Set to 0 to compile out the rdtsc calls around the allocation entry points.
+#define MM_STATS_LATENCY 1
+
+// Allocation paths with a latency histogram.
+#define MM_LAT_PHYS_ALLOC      0
+#define MM_LAT_SLAB_ALLOC      1
+#define MM_LAT_KMALLOC         2
+#define MM_LAT_VM_ALLOC_BLOCK  3
+#define MM_LAT_TLSF_ALLOC      4
+#define MM_LAT_NUM             5
+
+// Bucket i counts the calls which took between 2^i and 2^(i + 1) - 1 cycles, the last bucket also takes
+// everything slower than that.
+#define MM_LAT_BUCKETS 32
+
+typedef struct {
+    u64_t samples;
+    u64_t total_cycles;
+    u64_t max_cycles;
+    u64_t buckets[MM_LAT_BUCKETS];
+} mm_latency_hist_t;
+
+extern mm_latency_hist_t mm_latency_hists[MM_LAT_NUM];
+
+// Histogram bucket for a call which took the provided number of cycles.
+static inline u8_t mm_latency_bucket(u64_t cycles) {
+    if (cycles == 0) {
+        return 0;
+    }
+
+    u8_t bucket = 63 - __builtin_clzl(cycles);
+    return bucket < MM_LAT_BUCKETS ? bucket : MM_LAT_BUCKETS - 1;
+}
+
+// Record a call into the histogram of the given path. Used by mm_stats_end.
+void mm_latency_record(u8_t hist, u64_t cycles);
+
+// Take the start timestamp of a call to an instrumented path.
+static inline u64_t mm_stats_begin() {
+#if MM_STATS_LATENCY
+    return rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Record the time since start into the histogram of the given path.
+static inline void mm_stats_end(u8_t hist, u64_t start) {
+#if MM_STATS_LATENCY
+    mm_latency_record(hist, rdtsc() - start);
+#endif
+}
+
+const mm_latency_hist_t *mm_latency_hist(u8_t hist);
+
+// Clears the latency histograms. Allocator counters live in the allocators themselves and aren't affected.
+void mm_stats_reset_latency();
+
+// Print the per-order free block counts and counters of every zone, the counters of the kmalloc caches,
+// the latency histograms and the heap profile if the profiler is running.
+void mm_stats_dump();
+
+#endif
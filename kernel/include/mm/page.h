@@ -9,6 +9,11 @@
 #define PAGE_READONLY (1 << 2)
 #define PAGE_BUDDY    (1 << 3)
 #define PAGE_FREELIST (1 << 4)
+#define PAGE_BUDDY_FREE (1 << 5)
+// First page of an off-slab slab, its slab_header is in use.
+#define PAGE_SLAB       (1 << 6)
+// Any other page of an off-slab slab, slab_head points to the first page.
+#define PAGE_SLAB_TAIL  (1 << 7)
 
 // Every Physical Page in the System has a corresponding page info structure
 // managed by the kernel. This is used for reference counting and allocation tracking.
@@ -18,9 +23,12 @@ typedef struct __page {
     u16_t refcount;
 
     union {
-        // Slab header if this page is a slab page.
+        // Slab header if this page is the first page of an off-slab slab (see SLAB_CACHE_OFF_SLAB).
         slab_header_t slab_header;
 
+        // The first page of the slab if this page is any other page of an off-slab slab.
+        struct __page *slab_head;
+
         // Used for keeping tabs on blocks that have been allocated by a buddy allocator.
         struct __buddy_alloc_info {
             // Pointer to the base page of the block.
@@ -28,8 +36,21 @@ typedef struct __page {
             // A larger block may have one of its pages freed, but the whole block isnt ready to be freed unless
             // free_count = 0 in the parent block. This is ignored for non-base blocks.
             u16_t free_count;
+            // Order of the block, only valid in the base page. Once the block is shrunk this is the order of its
+            // largest power of 2 part.
+            u8_t order;
+            // Number of pages in the block, only valid in the base page. 2^order unless the block was shrunk.
+            u32_t num_pages;
         } buddy_alloc_info;
 
+        // Used by the buddy allocator for the base page of a free block (flagged PAGE_BUDDY_FREE). Links the block into
+        // the doubly linked freelist of its order, so a buddy can be unlinked in constant time from its page offset.
+        struct __buddy_free_info {
+            struct __page *next;
+            struct __page *prev;
+            u8_t order;
+        } buddy_free_info;
+
         // Used for keeping tabs on blocks that are allocated in the general region (0x1000 -> 4MB) and between the end of the kernel
         // and the beginning of the highmem buddy allocator. This is just a simple freelist allocator that can return one page at a time.
         struct __freelist_info {
@@ -52,6 +73,17 @@ static inline phys_addr_t page_address_from_info(const page_info_t *page) {
     return (page - global_page_map) << PAGE_ORDER;
 }
 
+// The header of the off-slab slab containing an object, see SLAB_CACHE_OFF_SLAB. Only touches the global page map.
+static inline slab_header_t *off_slab_header(void *ptr) {
+    page_info_t *page = page_info(phys_addr_for_kphys(ptr));
+
+    if (page->flags & PAGE_SLAB_TAIL) {
+        page = page->slab_head;
+    }
+
+    return &page->slab_header;
+}
+
 // Update the page flags by ORing the current flags with the provided flags atomically.
 void set_page_flags_atomic(page_info_t *page, const u16_t flags);
 
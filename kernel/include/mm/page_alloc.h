@@ -2,23 +2,92 @@
 #define __MM_PAGE_ALLOC_H
 
 #include <mm.h>
+#include <mm/buddy_alloc.h>
+#include <mm/pcp.h>
+#include <cpu/percpu.h>
 
 #define PFA_GENERAL 0x0
 #define PFA_DMA     0x1
+// Don't run shrinkers and allow the general zone to go below its min watermark. Implied in interrupt handlers.
+#define PFA_ATOMIC  0x2
 
 // DMA zone stretches from 4MB to 16MB
 #define DMA_ZONE_BEGIN 0x400000
 #define DMA_ZONE_END   0x1000000
 
-// Initialize the page frame allocator(s). This function is assumed to be called after init_global_page_map
+// The general zone covers everything above the DMA zone.
+#define PFA_ZONE_DMA     0
+#define PFA_ZONE_GENERAL 1
+#define PFA_NUM_ZONES    2
+
+// The low watermark of a zone is 1/64th of the pages it manages, the high watermark is twice that and the min
+// watermark half of it.
+#define PFA_WATERMARK_LOW_SHIFT 6
+
+// Maximum number of shrinkers which can be registered with pfa_register_shrinker.
+#define PFA_MAX_SHRINKERS 4
+
+// Gives memory cached by a higher level allocator back to the page frame allocator. Returns the number of pages released.
+typedef size_t (*pfa_shrinker_t)();
+
+typedef struct {
+    buddy_allocator_t buddy;
+    pcp_cache_t pcp[MAX_CPUS];
+
+    // Physical range managed by the zone. The range is empty if there's no usable memory in the zone.
+    phys_addr_t start_addr;
+    phys_addr_t end_addr;
+
+    // Watermarks on the number of free pages in the buddy allocator of the zone. The zone comes under pressure
+    // when it drops below the low watermark and recovers once it climbs back above the high watermark. The pages
+    // below the min watermark are an emergency reserve only PFA_ATOMIC allocations may use.
+    size_t watermark_min;
+    size_t watermark_low;
+    size_t watermark_high;
+    u8_t under_pressure;
+} pfa_zone_t;
+
+// Sets up the single page freelist for low memory. Called right after init_global_page_map.
+void page_alloc_init();
+
+// Initialize the buddy allocators for each zone. This function is assumed to be called after init_global_page_map
+// since free blocks are tracked through the global page map.
 void pfa_init();
 
+pfa_zone_t *pfa_zone(u8_t zone_idx);
+
 // Allocate and free a single page from the general reserved region.
 phys_addr_t pfa_alloc_page();
 
-// Allocate a block of pages from the buddy allocator for either DMA or GENERAL use
+// Allocate a block of pages from the buddy allocator for either DMA or GENERAL use.
+// PFA_DMA allocations are only served from the DMA zone. General allocations are served from the general zone
+// and only spill into the DMA zone while the general zone is under pressure (or can't fit the block), and even
+// then never take the DMA zone below its high watermark. Only PFA_ATOMIC allocations take the general zone below
+// its min watermark, and they leave running the shrinkers to the next allocation which isn't atomic.
+// Returns NULL if no block could be allocated.
 phys_addr_t pfa_alloc_block(u8_t order, u8_t flags);
 
+// Allocate up to count blocks of the same order into blocks, following the zone policy of pfa_alloc_block.
+// Batches bypass the per-CPU caches. Returns the number of blocks allocated.
+size_t pfa_alloc_bulk(u8_t order, u8_t flags, phys_addr_t *blocks, size_t count);
+
+// Free count blocks of the provided order, which may come from different zones.
+void pfa_free_bulk(const phys_addr_t *blocks, size_t count, u8_t order);
+
+// Register a shrinker, unless it's already registered. Shrinkers run when the general zone comes under pressure and before a general allocation fails.
+// They may free pages but must not allocate any.
+void pfa_register_shrinker(pfa_shrinker_t shrinker);
+
+// Run every registered shrinker. Returns the number of pages released.
+size_t pfa_shrink();
+
+// Free a block whose order is known by the caller, this doesn't rely on the order recorded by pfa_alloc_block.
+void pfa_free_sized_block(phys_addr_t block_base, u8_t order);
+
+// Shrinks an allocated block to num_pages, see buddy_shrink_block. The new size is recorded in the base page so that
+// _pfa_free_block frees all of the shrunk block.
+void pfa_shrink_block(phys_addr_t block_base, u8_t order, size_t num_pages);
+
 // These functions should not be called externally, use drop_page_reference defined in page.h instead to free a page.
 // These functions will be called if refcount = 0 in the drop reference routine.
 void _pfa_free_page(phys_addr_t addr);
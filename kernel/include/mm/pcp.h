@@ -0,0 +1,50 @@
+#ifndef __MM_PCP_H
+#define __MM_PCP_H
+
+#include <mm.h>
+#include <mm/buddy_alloc.h>
+#include <types.h>
+
+// Per-CPU page frame caches for small blocks. Blocks held by a cache are allocated from the point of view
+// of the buddy allocator, so a single page alloc/free pair only touches the cache and the buddy's bitmap and
+// freelists are updated in batches.
+
+// Highest block order cached.
+#define PCP_MAX_ORDER 1
+
+// Maximum number of blocks held per order, must be a power of 2.
+#define PCP_HIGH 64
+
+// Number of blocks moved between the cache and the buddy allocator when the cache runs empty or full.
+#define PCP_BATCH 16
+
+// Blocks are kept in a ring so that recently freed (cache hot) blocks can be handed out first from the hot end
+// while cold blocks are added and drained from the other end.
+typedef struct {
+    phys_addr_t blocks[PCP_HIGH];
+
+    // Index of the coldest block in the ring.
+    u16_t cold;
+    u16_t count;
+} pcp_list_t;
+
+typedef struct {
+    buddy_allocator_t *allocator;
+    pcp_list_t lists[PCP_MAX_ORDER + 1];
+} pcp_cache_t;
+
+void pcp_init(pcp_cache_t *pcp, buddy_allocator_t *allocator);
+
+// Allocate a block of order <= PCP_MAX_ORDER, refilling the cache from the buddy allocator if it is empty.
+// Returns NULL if the buddy allocator is out of blocks of that order.
+phys_addr_t pcp_alloc_block(pcp_cache_t *pcp, u8_t order);
+
+// Return a block of order <= PCP_MAX_ORDER to the cache. Blocks freed hot are the next to be allocated,
+// blocks freed cold (ie: not recently touched by this CPU) are the first to be drained back to the buddy allocator.
+void pcp_free_block(pcp_cache_t *pcp, phys_addr_t block_base, u8_t order);
+void pcp_free_block_cold(pcp_cache_t *pcp, phys_addr_t block_base, u8_t order);
+
+// Return every cached block to the buddy allocator.
+void pcp_drain(pcp_cache_t *pcp);
+
+#endif
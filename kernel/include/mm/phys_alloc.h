@@ -4,24 +4,23 @@
 #include <mm/boot_mmap.h>
 #include <mm/buddy_alloc.h>
 
-// We use entry 511 of the PML4T and the first branch of the PDPT.
-// This address space is reserved for the allocator's internal virtual structures.
-#define FREELIST_POOL_VM_BASE 0xFFFFFF8000000000
-
-buddy_allocator_t *get_allocator();
+// Allocate a physical block of size num_pages from the general zone of the page frame allocator.
+// Returns NULL if num_pages > 2^MAX_ORDER or no block is available. The caller
+// should remember the size of the allocation for freeing the memory later on.
+// Blocks of 1 or 2 pages are served from the current CPU's page cache.
+phys_addr_t phys_alloc(size_t num_pages);
 
-// Initializes the physical page allocator
-void phys_alloc_init();
+// Allocate up to count blocks of 2^order pages from the general zone into blocks.
+// Returns the number of blocks allocated, which is less than count when memory runs out.
+size_t phys_alloc_bulk(u8_t order, phys_addr_t *blocks, size_t count);
 
-// Allocate a physical block of size num_pages. 
-// Returns NULL if num_pages > 2^MAX_ORDER. The caller
-// should remember the size of the allocation for freeing the memory later on.
-phys_addr_t phys_alloc(u8_t num_pages);
+// Free count blocks of 2^order pages allocated by phys_alloc_bulk.
+void phys_free_bulk(const phys_addr_t *blocks, size_t count, u8_t order);
 
-// Free a physical block of size num_pages.
-void phys_free(phys_addr_t block_addr, u8_t num_pages);
+// Free a physical block of size num_pages. Blocks of 1 or 2 pages go back to the current CPU's page cache.
+void phys_free(phys_addr_t block_addr, size_t num_pages);
 
 // Shrinks a physical block to target_size.
-void phys_block_shrink(phys_addr_t block_addr, u8_t block_size, u8_t target_size);
+void phys_block_shrink(phys_addr_t block_addr, size_t block_size, size_t target_size);
 
 #endif
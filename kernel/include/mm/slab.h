@@ -6,8 +6,40 @@
 #include <utility/math.h>
 
 
+// Range of slab orders a cache can pick from. Every slab sits at the base of its own SLAB_MAX_ORDER block in the
+// slab zone, with only the first 2^slab_order pages of the block backed by memory. This way the slab of any object is
+// found by aligning down to the block size, whatever the order of its cache.
 #define SLAB_ORDER 1
-#define OBJS_PER_SLAB(type) ((sizeof(slab_t) - sizeof(slab_header_t)) / sizeof(type))
+#define SLAB_MAX_ORDER 2
+
+// A cache uses the smallest slab order which fits at least SLAB_MIN_OBJECTS objects and wastes at most
+// 1/SLAB_WASTE_FRACTION of the slab. If no order does, the one wasting the smallest fraction is used.
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_WASTE_FRACTION 16
+
+#define SLAB_BYTES(order) (1ul << ((order) + PAGE_ORDER))
+#define SLAB_BLOCK_BYTES SLAB_BYTES(SLAB_MAX_ORDER)
+
+// Granularity of slab colours. Slabs are offset by multiples of a cache line so that the same object in
+// different slabs doesn't land in the same cache set.
+#define SLAB_COLOUR_ALIGN 64
+
+#define OBJS_PER_SLAB(type) ((SLAB_BYTES(SLAB_ORDER) - sizeof(slab_header_t)) / sizeof(type))
+
+// Default watermarks on the number of free slabs of a cache. Once a free pushes a cache above its high watermark,
+// free slabs are returned to the system until the cache is back down to its low watermark.
+#define SLAB_FREE_LOW  1
+#define SLAB_FREE_HIGH 4
+
+// Cache ID of the caches created by kmem_cache_create.
+#define KMEM_CACHE_ID 0xFFFD
+
+// Cache flags
+
+// Keep slab headers in the global page map rather than at the start of each slab. Slabs of such a cache are physical
+// blocks accessed through the kernel's physical mapping, so the header of an object is found from the page info of
+// its page without touching the slab itself, and the objects get the whole slab.
+#define SLAB_CACHE_OFF_SLAB 1
 
 typedef struct __slab_object {
     union {
@@ -23,12 +55,13 @@ typedef struct __slab_object {
 } slab_object_t;
 
 
-typedef struct {
-    // The next slab
-    struct __slab *prev, *next;
+typedef struct __slab_header {
+    // Neighbours of the slab in its list
+    struct __slab_header *prev, *next;
     
-    // The first free object
-    u16_t first_free_idx;
+    // Byte offset of the first free object from the start of the slab's object area. Storing an offset
+    // rather than an index means that converting to and from object pointers never needs to divide by the cell size.
+    u16_t first_free_offset;
     
     // Number of free objects
     u16_t free_count;
@@ -38,57 +71,154 @@ typedef struct {
     // wherever.
     u16_t cache_id;
 
-    // Since most allocated objects need to be 8 byte aligned anyways we can reserve 32 bits for future purposes at the end of the struct
-    // to have it be a multiple of 8. 
-    u16_t reserved;
+    // Byte offset of the first object in the slab's object area, see kmem_cache_t.colour_next.
+    u16_t colour;
 } slab_header_t;
 
 
 typedef struct __slab {
     slab_header_t header;
-    u8_t __slab_data[(1 << (12 + SLAB_ORDER)) - sizeof(slab_header_t)];
+
+    // Objects take up the rest of the slab, whose size depends on the slab order of the cache.
+    u8_t __slab_data[];
 } slab_t;
 
 
+// Event counters of an object cache.
+typedef struct {
+    u64_t allocs;
+    u64_t frees;
+    // Number of slabs the cache had to allocate to grow.
+    u64_t grows;
+    // Allocations which failed because no slab could be allocated.
+    u64_t failures;
+    // Number of free slabs given back to the system.
+    u64_t shrinks;
+    // Atomic allocations served from the emergency pool.
+    u64_t pool_allocs;
+} slab_stats_t;
+
+
+// Object constructor, see kmem_cache_create.
+typedef void (*slab_ctor_t)(void *obj);
+
+
 typedef struct __kmem_slab_cache {
+    // Name shown by slab_info_dump, may be NULL.
+    const char *name;
+
+    // Runs on every object of a slab when the slab is created. Objects are expected to be back in their constructed
+    // state when they're freed, so their freelist link is kept after the object (at free_offset) instead of in it.
+    slab_ctor_t ctor;
+    u16_t free_offset;
+
+    // Number of kmem_cache_create calls which were given this cache instead of a new one.
+    u16_t aliases;
+
     u16_t align_padding;
+    u16_t obj_align;
     u16_t obj_size;
     u16_t obj_cell_size; // obj_size + align_padding
     u16_t total_free_slabs;
     u16_t total_partial_slabs;
     u16_t total_full_slabs;
+    u16_t free_slabs_low;
+    u16_t free_slabs_high;
     u32_t allocated_objects;
     u32_t total_free_objects;
     u16_t objs_per_slab;
+    u8_t slab_order;
+    u8_t flags;
     u16_t cache_id;
     u16_t vmzone;
 
     // How many bytes is wasted for header info + extra padding per slab (not including internal padding for alignment).
     u16_t slab_overhead;
 
-    slab_t *free_slabs;
-    slab_t *partial_slabs;
-    slab_t *full_slabs;
+    // The padding at the end of a slab is used to shift its objects by a colour offset, which cycles through
+    // colour_count multiples of colour_align as slabs are created.
+    u16_t colour_align;
+    u16_t colour_count;
+    u16_t colour_next;
+    // Offset of the first object of a colour 0 slab, padding the header to the alignment of the objects.
+    u16_t colour_base;
+
+    slab_header_t *free_slabs;
+    slab_header_t *partial_slabs;
+    slab_header_t *full_slabs;
+
+    // Emergency pool of objects set aside for atomic allocations once the slabs run out, linked through their
+    // freelist links. Refilled up to pool_target by normal allocations.
+    slab_object_t *pool;
+    u16_t pool_count;
+    u16_t pool_target;
+
+    slab_stats_t stats;
+
+    // Next cache visited by slab_reap, only set once the cache is registered with slab_cache_register.
+    struct __kmem_slab_cache *next_cache;
 } kmem_cache_t;
 
-// Initialize an object cache
-void slab_cache_init(kmem_cache_t *cache, u16_t obj_size, u16_t obj_align, u16_t cache_id, u16_t vmzone);
+// Initialize an object cache, flags is a combination of the SLAB_CACHE_* flags.
+void slab_cache_init(kmem_cache_t *cache, u16_t obj_size, u16_t obj_align, u16_t cache_id, u16_t vmzone, u8_t flags);
 
 // Reserve enough slabs up front for the provided number of objects.
 void slab_cache_reserve(kmem_cache_t *cache, u16_t num_objects);
 
-// Given preallocated memory, initialize @num_slabs slab(s).
+// Given preallocated memory, initialize @num_slabs slab(s). The memory should consist of num_slabs SLAB_BLOCK_BYTES
+// aligned blocks of the slab VM zone, since free slabs may be given back to it. Not supported for SLAB_CACHE_OFF_SLAB
+// caches.
 void slab_cache_prealloc(kmem_cache_t *cache, void *pages, u8_t num_slabs);
 
-// Allocate an object.
+// Give free slabs back to the system until at most keep_slabs are left. Returns the number of pages released.
+size_t slab_cache_shrink(kmem_cache_t *cache, u16_t keep_slabs);
+
+// Add a cache to the caches reaped by slab_reap, unless it's already there. Registered caches must live for the
+// lifetime of the kernel.
+void slab_cache_register(kmem_cache_t *cache);
+
+// Give every free slab of the registered caches back to the system. Returns the number of pages released.
+size_t slab_reap();
+
+// Create a registered cache for objects of a fixed type, or hand out an existing cache with the same object layout if
+// there is no constructor. The constructor, if any, runs once per object when its slab is created rather than on every
+// allocation. Objects are allocated with slab_alloc and freed with slab_free. align is rounded up to a power of 2 of at
+// least 8 bytes. Returns NULL if out of memory.
+kmem_cache_t *kmem_cache_create(const char *name, u16_t size, u16_t align, slab_ctor_t ctor);
+
+// Print a table of the objects, slabs and wasted memory of every registered cache.
+void slab_info_dump();
+
+// Set aside an emergency pool of objects for atomic allocations (see MM_ATOMIC). Objects in the pool count as
+// allocated. Must not be called from an interrupt handler.
+void slab_cache_set_pool(kmem_cache_t *cache, u16_t num_objects);
+
+// Allocate an object. Returns NULL if the cache needs to grow and no slab could be allocated.
 void *slab_alloc(kmem_cache_t *cache);
 
-// Free an object.
+// Allocate an object with MM_* flags. Atomic allocations take a free object from the slabs of the cache, or from its
+// emergency pool if there is none, without ever growing the cache. Returns NULL if both are exhausted.
+void *slab_alloc_flags(kmem_cache_t *cache, u8_t flags);
+
+// Allocate up to count objects into objs, taking as many as possible from each slab at once. Returns the number of
+// objects allocated, which is less than count if the cache couldn't grow.
+size_t slab_alloc_bulk(kmem_cache_t *cache, void **objs, size_t count);
+
+// Free an object. Frees in interrupt handlers leave giving free slabs back to the system to a later free.
 void *slab_free(kmem_cache_t *cache, void *ptr);
 
+// Free count objects. Consecutive objects from the same slab are returned to it together, so callers should keep
+// objects of a slab next to each other where they can (as slab_alloc_bulk hands them out).
+void slab_free_bulk(kmem_cache_t *cache, void **objs, size_t count);
+
+// The slab containing an object allocated from any cache which keeps its headers on slab. See off_slab_header in
+// mm/page.h for SLAB_CACHE_OFF_SLAB caches.
+static inline slab_t *slab_of(void *ptr) {
+    return aligndown(ptr, SLAB_MAX_ORDER + PAGE_ORDER);
+}
+
 static inline u16_t cache_id_for_alloc(void *ptr) {
-    slab_t *slab = aligndown(ptr, SLAB_ORDER + PAGE_ORDER);
-    return slab->header.cache_id;
+    return slab_of(ptr)->header.cache_id;
 }
 
 #endif
@@ -0,0 +1,80 @@
+#ifndef __MM_TLSF_H
+#define __MM_TLSF_H
+
+#include <types.h>
+#include <mm.h>
+
+// Two level segregated fit allocator. Free blocks are kept in lists indexed by the power of 2 range of their size
+// (first level) and a linear subdivision of that range (second level). A bitmap per level finds a list with a large
+// enough block in a couple of bit scans, and freed blocks merge with their physical neighbours right away, so
+// tlsf_alloc and tlsf_free run in constant time whatever the size or the state of the pool.
+//
+// The pool is mapped up front so that allocations never touch the page allocator or the page tables, which makes
+// the allocator suitable for interrupt handlers and other paths which need a bounded worst case.
+
+// Allocations are aligned to and rounded up to 2^TLSF_ALIGN_ORDER bytes.
+#define TLSF_ALIGN_ORDER 4
+#define TLSF_ALIGN       (1ul << TLSF_ALIGN_ORDER)
+
+// Second level lists per first level range.
+#define TLSF_SL_ORDER 5
+#define TLSF_SL_COUNT (1 << TLSF_SL_ORDER)
+
+// Blocks smaller than this all live in the first range, split into second level lists TLSF_ALIGN bytes apart.
+#define TLSF_SMALL_BLOCK (1ul << (TLSF_SL_ORDER + TLSF_ALIGN_ORDER))
+
+// Blocks are smaller than 2^TLSF_FL_MAX_ORDER bytes.
+#define TLSF_FL_MAX_ORDER 32
+#define TLSF_FL_COUNT     (TLSF_FL_MAX_ORDER - TLSF_SL_ORDER - TLSF_ALIGN_ORDER + 1)
+
+// Largest size tlsf_alloc can serve.
+#define TLSF_MAX_ALLOC ((1ul << (TLSF_FL_MAX_ORDER - 1)) - TLSF_ALIGN)
+
+typedef struct __tlsf_block {
+    // The block right before this one in memory, NULL for the first block of the pool.
+    struct __tlsf_block *prev_phys;
+    // Bytes after the header, the low bit is set while the block is free.
+    size_t size;
+
+    // Free list links, only valid while the block is free. Otherwise they're the first bytes of the allocation.
+    struct __tlsf_block *next_free;
+    struct __tlsf_block *prev_free;
+} tlsf_block_t;
+
+// Bytes between a block and the memory it hands out.
+#define TLSF_BLOCK_HEADER __builtin_offsetof(tlsf_block_t, next_free)
+
+typedef struct {
+    u32_t fl_bitmap;
+    u32_t sl_bitmap[TLSF_FL_COUNT];
+    tlsf_block_t *free[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+    void *pool;
+    size_t pool_pages;
+
+    size_t used_bytes;
+    u64_t allocs;
+    u64_t frees;
+    u64_t failures;
+} tlsf_t;
+
+// Manage bytes of memory at mem, which must stay mapped for as long as the allocator is used.
+// Returns -1 if the memory is too small to hold a block.
+int tlsf_init(tlsf_t *tlsf, void *mem, size_t bytes);
+
+// Manage a pool of pages carved out of the vmalloc zone. Returns -1 if the pool couldn't be allocated.
+int tlsf_create(tlsf_t *tlsf, size_t pages);
+
+// Give the pool of tlsf_create back to the vmalloc zone. Any allocations still live become invalid.
+void tlsf_destroy(tlsf_t *tlsf);
+
+// Allocate size bytes. Returns NULL if size is 0 or no free block is large enough.
+void *tlsf_alloc(tlsf_t *tlsf, size_t size);
+
+// Free an allocation of tlsf_alloc, ptr may be NULL.
+void tlsf_free(tlsf_t *tlsf, void *ptr);
+
+// The usable size of an allocation, at least what was asked of tlsf_alloc.
+size_t tlsf_size(void *ptr);
+
+#endif
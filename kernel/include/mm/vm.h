@@ -24,22 +24,37 @@
 #define ERR_VM_BOUNDARY       0x3
 #define ERR_VM_ALREADY_MAPPED 0x4
 #define ERR_VM_CONTIGUOUS     0x5
+#define ERR_VM_NO_MEMORY      0x6
+
+#ifdef TESTSUITE
+// The test suites run in user mode where cr3 can't be read, their PML4T is a fixed page of the emulated physical memory
+// right after the boot info.
+#define TEST_PML4T_ADDR 0x2000
+#endif
 
 static inline phys_addr_t read_cr3()
 {
+#ifdef TESTSUITE
+    return TEST_PML4T_ADDR;
+#else
     phys_addr_t val;
     asm volatile("mov %%cr3,%0\n\t"
                  : "=r"(val));
     return val;
+#endif
 }
 
 static inline void flush_tlb(virt_addr_t page)
 {
+#ifndef TESTSUITE
     asm volatile("invlpg (%0)" ::"r"(page)
                  : "memory");
+#endif
 }
 
 // Functions that are private within the subsystem of virtual memory management.
+
+// Allocate and zero num_pages page tables. Returns NULL if out of memory.
 phys_addr_t _alloc_page_tables(u8_t num_pages, u8_t flags);
 
 // Checks error conditions.
@@ -69,6 +84,11 @@ void _prepare_block_pt(const vmzone_t *zone, virt_addr_t base_pt_addr, page_tabl
 // Allocate a block in a VMZFLAG_ALLOC_BLOCK virtual memory zone.
 virt_addr_t vm_alloc_block(u8_t flags, u16_t vmzone);
 
+// Allocate a block in a VMZFLAG_ALLOC_BLOCK virtual memory zone but only back its first num_pages pages
+// (at most 2^block_order of the zone) with physical memory. vm_free_block frees however many pages are backed.
+// Returns NULL if no page table or physical memory could be allocated.
+virt_addr_t vm_alloc_block_pages(u8_t flags, u16_t vmzone, u8_t num_pages);
+
 // Free a block in a VMZFLAG_ALLOC_BLOCK virtual memory zone.
 int vm_free_block(virt_addr_t addr, u16_t vmzone);
 
@@ -77,6 +97,25 @@ int vm_free_block(virt_addr_t addr, u16_t vmzone);
 // This is great for setting up user space processes which are linked in any which way.
 // For example, we know we need to map N pages for the ".text" section at some address
 // specified in the ELF file, this lets us do just that.
+// Physical memory is allocated in the largest power of 2 blocks available. Returns NULL if out of memory.
 virt_addr_t vmalloc_direct(u8_t pages, u8_t flags, virt_addr_t base_address);
 
+// Unmap pages mapped by vmalloc_direct and free their physical memory.
+void vfree_direct(virt_addr_t base_address, size_t pages);
+
+// The vmalloc zone hands out virtual memory in granules of 2^VMALLOC_GRANULE_ORDER pages.
+#define VMALLOC_GRANULE_ORDER 4
+
+// Allocate virtually contiguous memory in the vmalloc zone. The base is aligned to a granule.
+// Returns NULL if there's no big enough hole in the zone or no physical memory.
+virt_addr_t vmalloc(size_t pages, u8_t flags);
+
+// Free memory allocated by vmalloc, pages must match the size of the allocation. Safe to call from interrupt handlers,
+// vmalloc, vfree and vmalloc_grow update the zone with interrupts disabled.
+void vfree(virt_addr_t addr, size_t pages);
+
+// Grow a vmalloc allocation of pages to new_pages without moving it, using the rest of its last granule and any free
+// granules right after it. Returns 0 on success, or -1 if the following virtual memory is taken or out of memory.
+int vmalloc_grow(virt_addr_t addr, size_t pages, size_t new_pages, u8_t flags);
+
 #endif
@@ -49,7 +49,11 @@ each PML4T will point to the same space in these zones.
 // Zone for memory used by the buddy allocator.
 #define VMZONE_BUDDY_MEM   0x4
 
-#define VMZONE_NUMBER_OF_ZONES 5
+// Zone for large virtually contiguous allocations which don't need to be physically contiguous (vmalloc).
+#define VMZONE_KERNEL_VMALLOC 0x5
+#define VMZONE_VMALLOC_GB     4
+
+#define VMZONE_NUMBER_OF_ZONES 6
 
 typedef struct {
     virt_addr_t start_address;
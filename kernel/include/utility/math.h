@@ -18,12 +18,34 @@ static inline size_t round_up_shift_right(size_t x, u8_t shift) {
     return shifted;
 }
 
-static inline u8_t bit_order(u32_t x) {
-    s32_t leading_zeros = __builtin_clz(x);
+// Bit scan helpers. x must be non zero for ctz64 and clz64. These compile to tzcnt/lzcnt when BMI is enabled
+// and to bsf/bsr otherwise.
+static inline u8_t ctz64(u64_t x) {
+    return __builtin_ctzl(x);
+}
+
+static inline u8_t clz64(u64_t x) {
+    return __builtin_clzl(x);
+}
+
+static inline u8_t popcount64(u64_t x) {
+#ifdef __POPCNT__
+    return __builtin_popcountl(x);
+#else
+    // Without popcnt GCC emits a call into libgcc, which the kernel doesn't link against. Count bits in parallel instead.
+    x = x - ((x >> 1) & 0x5555555555555555ul);
+    x = (x & 0x3333333333333333ul) + ((x >> 2) & 0x3333333333333333ul);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Ful;
+    return (x * 0x0101010101010101ul) >> 56;
+#endif
+}
+
+static inline u8_t bit_order(u64_t x) {
+    s32_t leading_zeros = __builtin_clzl(x);
     
-    u8_t order = 31 - leading_zeros;
+    u8_t order = 63 - leading_zeros;
 
-    if (x == (1u << order)) {
+    if (x == (1ul << order)) {
         return order;
     } else {
         return order + 1;
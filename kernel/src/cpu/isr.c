@@ -1,5 +1,6 @@
 #include <cpu/isr.h>
 #include <cpu/idt.h>
+#include <cpu/irq.h>
 #include <driver/pic.h>
 #include <driver/vga.h>
 #include <types.h>
@@ -167,9 +168,14 @@ void handle_irq(const isr_stack_frame *regs, u8_t irq_number, interrupt_handler_
 }
 
 
+u32_t __irq_depth[MAX_CPUS];
+
+
 void root_isr_handler(isr_stack_frame regs) {
     interrupt_handler_t handler = registered_handlers[regs.int_no];
 
+    ++__irq_depth[cpu_id()];
+
     if (regs.int_no >= IRQ_OFFSET1 && regs.int_no < IRQ_OFFSET1 + 8) {
         // This is an IRQ for IRQ 0-7
         handle_irq(&regs, regs.int_no - IRQ_OFFSET1, handler);
@@ -183,4 +189,6 @@ void root_isr_handler(isr_stack_frame regs) {
         kputstr(message, COLOR_WHT, COLOR_RED);
         kputstr("\n", COLOR_WHT, COLOR_BLK);
     }
+
+    --__irq_depth[cpu_id()];
 }
@@ -27,6 +27,8 @@ void clearwin(u8_t fg_color, u8_t bg_color) {
 }
 
 
+// Can be mocked in tests
+__attribute__((weak))
 void kputchar(const char character, const u8_t fg_color, const u8_t bg_color) {
     u16_t position = get_cursor_pos();
 
@@ -69,6 +71,8 @@ void kputchar(const char character, const u8_t fg_color, const u8_t bg_color) {
 }
 
 
+// Can be mocked in tests
+__attribute__((weak))
 void kputstr(const char *string, const u8_t fg_color, const u8_t bg_color) {
     while (*string != '\0') {
         kputchar(*string++, fg_color, bg_color);
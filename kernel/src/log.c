@@ -1,7 +1,9 @@
 #include <driver/vga.h>
 #include <utility/valist.h>
 #include <utility/strings.h>
-#include <mm/kmalloc.h>
+#include <mm/arena.h>
+#include <utility/math.h>
+#include <cpu/percpu.h>
 
 
 struct __printk_specifier {
@@ -18,6 +20,10 @@ struct __printk_specifier {
 
 u8_t _log_fg_color = COLOR_WHT, _log_bg_color = COLOR_BLK;
 
+// Scratch space for formatting numbers. Each __vprintk call pops everything it allocated on return, so after the first
+// call the buffers come out of an already mapped chunk.
+static arena_t __log_arenas[MAX_CPUS];
+
 
 void set_color(u8_t fg_color, u8_t bg_color) {
     _log_bg_color = fg_color;
@@ -124,9 +130,13 @@ static void __vprint_putstr(void (*putc)(char), const char *str) {
 }
 
 
-static void __vprint_putsigned(void (*putc)(char), s64_t sint, struct __printk_specifier *spec) {
+static void __vprint_putsigned(void (*putc)(char), arena_t *arena, s64_t sint, struct __printk_specifier *spec) {
     u16_t buffer_size = MAX(MAX(24, spec->precision + 4), spec->width + 4);
-    char *buffer = kmalloc(buffer_size);
+    char *buffer = arena_alloc(arena, buffer_size, 1);
+
+    if (buffer == NULL) {
+        return;
+    }
 
     char *unsigned_part;
 
@@ -160,13 +170,16 @@ static void __vprint_putsigned(void (*putc)(char), s64_t sint, struct __printk_s
     }
 
     __vprint_putstr(putc, buffer);
-    kfree(buffer);
 }
 
 
-static void __vprint_putunsigned(void (*putc)(char), u64_t uint, struct __printk_specifier *spec, u8_t base) {
+static void __vprint_putunsigned(void (*putc)(char), arena_t *arena, u64_t uint, struct __printk_specifier *spec, u8_t base) {
     u16_t buffer_size = MAX(MAX(24, spec->precision + 4), spec->width + 4);
-    char *buffer = kmalloc(buffer_size);
+    char *buffer = arena_alloc(arena, buffer_size, 1);
+
+    if (buffer == NULL) {
+        return;
+    }
 
     utoa(uint, buffer, base);
 
@@ -199,7 +212,6 @@ static void __vprint_putunsigned(void (*putc)(char), u64_t uint, struct __printk
     }
 
     __vprint_putstr(putc, buffer);
-    kfree(buffer); 
 }
 
 
@@ -208,6 +220,9 @@ void __vprintk(const char *fmt, void (*putc)(char), va_list args) {
     struct __printk_specifier spec;
     const char *pastspec;
 
+    arena_t *arena = &__log_arenas[cpu_id()];
+    arena_scope_t scope = arena_push(arena);
+
     size_t idx = 0;
     while (idx < len) {
         if (fmt[idx] == '%') {
@@ -250,38 +265,38 @@ void __vprintk(const char *fmt, void (*putc)(char), va_list args) {
                 case 'i':
                     switch (spec.lengthspec) {
                     case 'l':
-                        __vprint_putsigned(putc, (s64_t)va_arg(args, long int), &spec);
+                        __vprint_putsigned(putc, arena, (s64_t)va_arg(args, long int), &spec);
                         break;
                     case 'L':
-                        __vprint_putsigned(putc, (s64_t)va_arg(args, long long int), &spec);
+                        __vprint_putsigned(putc, arena, (s64_t)va_arg(args, long long int), &spec);
                         break;
                     case 'h':
-                        __vprint_putsigned(putc, (s64_t)((short int)va_arg(args, int)), &spec);
+                        __vprint_putsigned(putc, arena, (s64_t)((short int)va_arg(args, int)), &spec);
                         break;
                     case 'H':
-                        __vprint_putsigned(putc, (s64_t)((char)va_arg(args, int)), &spec);
+                        __vprint_putsigned(putc, arena, (s64_t)((char)va_arg(args, int)), &spec);
                         break;
                     default:
-                        __vprint_putsigned(putc, (s64_t)va_arg(args, int), &spec);
+                        __vprint_putsigned(putc, arena, (s64_t)va_arg(args, int), &spec);
                         break;
                     }
                     break;
                 case 'u':
                     switch(spec.lengthspec) {
                         case 'l':
-                            __vprint_putunsigned(putc, (u64_t)va_arg(args, long unsigned int), &spec, base);
+                            __vprint_putunsigned(putc, arena, (u64_t)va_arg(args, long unsigned int), &spec, base);
                             break;
                         case 'L':
-                            __vprint_putunsigned(putc, (u64_t)va_arg(args, unsigned long long int), &spec, base);
+                            __vprint_putunsigned(putc, arena, (u64_t)va_arg(args, unsigned long long int), &spec, base);
                             break;
                         case 'h':
-                            __vprint_putunsigned(putc, (u64_t)((unsigned short int)va_arg(args, unsigned int)), &spec, base);
+                            __vprint_putunsigned(putc, arena, (u64_t)((unsigned short int)va_arg(args, unsigned int)), &spec, base);
                             break;
                         case 'H':
-                            __vprint_putunsigned(putc, (u64_t)((unsigned char)va_arg(args, unsigned int)), &spec, base);
+                            __vprint_putunsigned(putc, arena, (u64_t)((unsigned char)va_arg(args, unsigned int)), &spec, base);
                             break;
                         default:
-                            __vprint_putunsigned(putc, (u64_t)va_arg(args, unsigned int), &spec, base);
+                            __vprint_putunsigned(putc, arena, (u64_t)va_arg(args, unsigned int), &spec, base);
                             break;
                     }                
                     break;
@@ -292,6 +307,8 @@ void __vprintk(const char *fmt, void (*putc)(char), va_list args) {
             putc(fmt[idx++]);
         }
     }
+
+    arena_pop(arena, scope);
 }
 
 
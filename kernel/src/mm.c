@@ -21,8 +21,8 @@ void mm_init() {
 
     vm_init();
 
-    // Initialize Physical Allocator
-    phys_alloc_init();
+    // Initialize the buddy allocators of the page frame allocator zones
+    pfa_init();
 
     kmalloc_init();
 }
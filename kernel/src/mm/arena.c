@@ -0,0 +1,111 @@
+#include <mm.h>
+#include <mm/arena.h>
+#include <mm/phys_alloc.h>
+#include <utility/math.h>
+
+
+static inline u8_t *__chunk_end(arena_chunk_t *chunk) {
+    return (u8_t*)chunk + (chunk->pages << PAGE_ORDER);
+}
+
+static inline u8_t *__align(u8_t *ptr, size_t align) {
+    return (u8_t*)(((size_t)ptr + align - 1) & ~(align - 1));
+}
+
+static void __free_chunk(arena_chunk_t *chunk) {
+    phys_free(phys_addr_for_kphys(chunk), chunk->pages);
+}
+
+void arena_init(arena_t *arena) {
+    arena->chunk = NULL;
+    arena->cursor = NULL;
+    arena->end = NULL;
+    arena->spare = NULL;
+}
+
+// Start a new chunk which fits size bytes at the given alignment, reusing the spare chunk if it's large enough.
+static u8_t __arena_grow(arena_t *arena, size_t size, size_t align) {
+    size_t bytes = sizeof(arena_chunk_t) + size + align - 1;
+    size_t pages = MAX(ARENA_CHUNK_PAGES, round_up_shift_right(bytes, PAGE_ORDER));
+    arena_chunk_t *chunk;
+
+    u64_t rflags = irq_save();
+
+    if (arena->spare != NULL && arena->spare->pages >= pages) {
+        chunk = arena->spare;
+        arena->spare = NULL;
+    } else {
+        phys_addr_t block = phys_alloc(pages);
+
+        if (block == NULL) {
+            irq_restore(rflags);
+            return 0;
+        }
+
+        chunk = KPHYS_ADDR(block);
+        chunk->pages = pages;
+    }
+
+    chunk->prev = arena->chunk;
+
+    arena->chunk = chunk;
+    arena->cursor = (u8_t*)(chunk + 1);
+    arena->end = __chunk_end(chunk);
+
+    irq_restore(rflags);
+    return 1;
+}
+
+void *arena_alloc(arena_t *arena, size_t size, size_t align) {
+    u8_t *ptr = __align(arena->cursor, align);
+
+    if (unlikely(arena->chunk == NULL || ptr + size > arena->end)) {
+        if (!__arena_grow(arena, size, align)) {
+            return NULL;
+        }
+
+        ptr = __align(arena->cursor, align);
+    }
+
+    arena->cursor = ptr + size;
+    return ptr;
+}
+
+void arena_pop(arena_t *arena, arena_scope_t scope) {
+    if (likely(arena->chunk == scope.chunk)) {
+        arena->cursor = scope.cursor;
+        return;
+    }
+
+    u64_t rflags = irq_save();
+
+    while (arena->chunk != scope.chunk) {
+        arena_chunk_t *chunk = arena->chunk;
+        arena->chunk = chunk->prev;
+
+        // Keep the largest chunk released as the spare.
+        if (arena->spare == NULL) {
+            arena->spare = chunk;
+        } else if (arena->spare->pages < chunk->pages) {
+            __free_chunk(arena->spare);
+            arena->spare = chunk;
+        } else {
+            __free_chunk(chunk);
+        }
+    }
+
+    arena->cursor = scope.cursor;
+    arena->end = scope.chunk != NULL ? __chunk_end(scope.chunk) : NULL;
+
+    irq_restore(rflags);
+}
+
+void arena_release(arena_t *arena) {
+    arena_scope_t empty = { NULL, NULL };
+    arena_pop(arena, empty);
+
+    if (arena->spare != NULL) {
+        __free_chunk(arena->spare);
+        arena->spare = NULL;
+    }
+}
@@ -1,58 +1,259 @@
 #include <mm/bitmap.h>
+#include <utility/math.h>
 #include <utility/strings.h>
 
 
-void bmp_init(bitmap_t *bmp, u8_t *base, size_t size_bits) {
+void bmp_init(bitmap_t *bmp, u64_t *base, size_t size_bits) {
     bmp->base = base;
-    bmp->size_bytes = (size_bits + 7) / 8;
+    bmp->size_bits = size_bits;
+    bmp->size_words = bmp_size_words(size_bits);
 
-    memset(bmp->base, 0, bmp->size_bytes);
+    memset(bmp->base, 0, bmp->size_words * sizeof(u64_t));
 }
 
-u8_t bmp_get_bit(const bitmap_t *bmp, const size_t index) {
-    const size_t byte_index = index / 8;
+// Scans for the first non zero word at or after start, after inverting every word with invert_mask.
+static inline size_t __find_next(const bitmap_t *bmp, size_t start, u64_t invert_mask) {
+    if (start >= bmp->size_bits) {
+        return BMP_NOT_FOUND;
+    }
+
+    size_t word_idx = start >> BMP_WORD_ORDER;
+
+    // Discard the bits below start in the first word.
+    u64_t word = (bmp->base[word_idx] ^ invert_mask) & (~0ul << (start & BMP_WORD_MASK));
 
-    if (byte_index >= bmp->size_bytes) {
-        return 0;
+    while (word == 0) {
+        if (++word_idx >= bmp->size_words) {
+            return BMP_NOT_FOUND;
+        }
+
+        word = bmp->base[word_idx] ^ invert_mask;
     }
 
-    const u8_t byte = bmp->base[byte_index];
-    return (byte >> (index % 8)) & 0x1;
+    size_t index = (word_idx << BMP_WORD_ORDER) + ctz64(word);
+
+    // The unused bits at the end of the last word are always 0 so they can match a search for zeroes.
+    return index < bmp->size_bits ? index : BMP_NOT_FOUND;
 }
 
-u8_t bmp_set_bit(bitmap_t *bmp, const size_t index, u8_t value) {
-    const size_t byte_index = index / 8;
+size_t bmp_find_next_set(const bitmap_t *bmp, size_t start) {
+    return __find_next(bmp, start, 0);
+}
 
-    if (byte_index >= bmp->size_bytes) {
-        return 0;
+size_t bmp_find_next_zero(const bitmap_t *bmp, size_t start) {
+    return __find_next(bmp, start, ~0ul);
+}
+
+size_t bmp_find_last_set(const bitmap_t *bmp) {
+    for (size_t word_idx = bmp->size_words; word_idx > 0; --word_idx) {
+        u64_t word = bmp->base[word_idx - 1];
+
+        if (word != 0) {
+            return ((word_idx - 1) << BMP_WORD_ORDER) + BMP_WORD_MASK - clz64(word);
+        }
     }
 
-    const u8_t byte = bmp->base[byte_index];
+    return BMP_NOT_FOUND;
+}
 
-    if (value > 0) {
-        bmp->base[byte_index] |= 1 << (index % 8);
+static inline void __apply_mask(u64_t *word, u64_t mask, u8_t value) {
+    if (value) {
+        *word |= mask;
     } else {
-        bmp->base[byte_index] &= ~(1 << (index % 8));
+        *word &= ~mask;
     }
-    
-    return 1;
 }
 
-u8_t bmp_toggle_bit(bitmap_t *bmp, const size_t index) {
-    const size_t byte_index = index / 8;
-    const u8_t bit_mask = 1 << (index % 8);
+static void __fill_range(bitmap_t *bmp, size_t start, size_t count, u8_t value) {
+    size_t end = MIN(start + count, bmp->size_bits);
 
-    if (byte_index >= bmp->size_bytes) {
-        return 0;
+    if (start >= end) {
+        return;
     }
 
-    const u8_t byte = bmp->base[byte_index];
+    size_t first_word = start >> BMP_WORD_ORDER;
+    size_t last_word = (end - 1) >> BMP_WORD_ORDER;
 
-    if (byte & bit_mask) {
-        bmp->base[byte_index] &= ~bit_mask;
-        return 0;
-    } else {
-        bmp->base[byte_index] |= bit_mask;
-        return 1;
+    u64_t first_mask = ~0ul << (start & BMP_WORD_MASK);
+    u64_t last_mask = ~0ul >> (BMP_WORD_MASK - ((end - 1) & BMP_WORD_MASK));
+
+    if (first_word == last_word) {
+        __apply_mask(&bmp->base[first_word], first_mask & last_mask, value);
+        return;
+    }
+
+    __apply_mask(&bmp->base[first_word], first_mask, value);
+
+    // Whole words in the middle of the range.
+    u64_t fill = value ? ~0ul : 0;
+    for (size_t word_idx = first_word + 1; word_idx < last_word; ++word_idx) {
+        bmp->base[word_idx] = fill;
+    }
+
+    __apply_mask(&bmp->base[last_word], last_mask, value);
+}
+
+void bmp_set_range(bitmap_t *bmp, size_t start, size_t count) {
+    __fill_range(bmp, start, count, 1);
+}
+
+void bmp_clear_range(bitmap_t *bmp, size_t start, size_t count) {
+    __fill_range(bmp, start, count, 0);
+}
+
+size_t bmp_popcount(const bitmap_t *bmp) {
+    size_t count = 0;
+
+    for (size_t word_idx = 0; word_idx < bmp->size_words; ++word_idx) {
+        count += popcount64(bmp->base[word_idx]);
+    }
+
+    return count;
+}
+
+// Number of summary levels needed above a leaf of leaf_words, and optionally the total words used by them.
+static u8_t __sbmp_levels(size_t leaf_words, size_t *summary_words) {
+    size_t level_bits = leaf_words, total_words = 0;
+    u8_t num_levels = 0;
+
+    do {
+        size_t level_words = bmp_size_words(level_bits);
+
+        total_words += level_words;
+        level_bits = level_words;
+        ++num_levels;
+    } while (level_bits > 1);
+
+    if (summary_words != NULL) {
+        *summary_words = total_words;
+    }
+
+    return num_levels;
+}
+
+size_t sbmp_size_words(size_t size_bits) {
+    size_t leaf_words = bmp_size_words(size_bits), summary_words;
+    __sbmp_levels(leaf_words, &summary_words);
+
+    return leaf_words + summary_words;
+}
+
+int sbmp_init(summary_bitmap_t *sbmp, u64_t *base, size_t size_bits) {
+    // The summary levels are stored in a fixed size array.
+    if (size_bits > SBMP_MAX_BITS) {
+        return -1;
+    }
+
+    bmp_init(&sbmp->leaf, base, size_bits);
+
+    // The padding at the end of the last leaf word is marked in use so it's never handed out.
+    if (size_bits & BMP_WORD_MASK) {
+        sbmp->leaf.base[sbmp->leaf.size_words - 1] = ~0ul << (size_bits & BMP_WORD_MASK);
+    }
+
+    sbmp->num_levels = __sbmp_levels(sbmp->leaf.size_words, NULL);
+
+    u64_t *level_base = base + sbmp->leaf.size_words;
+    size_t level_bits = sbmp->leaf.size_words;
+
+    for (u8_t level = 0; level < sbmp->num_levels; ++level) {
+        bitmap_t *summary = &sbmp->summary[level];
+
+        // Every word below has a free bit.
+        bmp_init(summary, level_base, level_bits);
+        bmp_set_range(summary, 0, level_bits);
+
+        level_base += summary->size_words;
+        level_bits = summary->size_words;
+    }
+
+    return 0;
+}
+
+// Updates the summary levels after a leaf word has changed. Stops as soon as a level's word keeps its zero/non zero state.
+static void __sbmp_propagate(summary_bitmap_t *sbmp, size_t word_idx) {
+    u8_t has_free = sbmp->leaf.base[word_idx] != ~0ul;
+
+    for (u8_t level = 0; level < sbmp->num_levels; ++level) {
+        u64_t *word = &sbmp->summary[level].base[word_idx >> BMP_WORD_ORDER];
+        u64_t previous = *word;
+
+        __apply_mask(word, 1ul << (word_idx & BMP_WORD_MASK), has_free);
+
+        if ((previous != 0) == (*word != 0)) {
+            return;
+        }
+
+        has_free = *word != 0;
+        word_idx >>= BMP_WORD_ORDER;
+    }
+}
+
+void sbmp_set_bit(summary_bitmap_t *sbmp, const size_t index, u8_t value) {
+    if (bmp_set_bit(&sbmp->leaf, index, value)) {
+        __sbmp_propagate(sbmp, index >> BMP_WORD_ORDER);
+    }
+}
+
+static void __sbmp_fill_range(summary_bitmap_t *sbmp, size_t start, size_t count, u8_t value) {
+    size_t end = MIN(start + count, sbmp->leaf.size_bits);
+
+    if (start >= end) {
+        return;
+    }
+
+    __fill_range(&sbmp->leaf, start, end - start, value);
+
+    for (size_t word_idx = start >> BMP_WORD_ORDER; word_idx <= (end - 1) >> BMP_WORD_ORDER; ++word_idx) {
+        __sbmp_propagate(sbmp, word_idx);
     }
 }
+
+void sbmp_set_range(summary_bitmap_t *sbmp, size_t start, size_t count) {
+    __sbmp_fill_range(sbmp, start, count, 1);
+}
+
+void sbmp_clear_range(summary_bitmap_t *sbmp, size_t start, size_t count) {
+    __sbmp_fill_range(sbmp, start, count, 0);
+}
+
+size_t sbmp_find_next_zero(const summary_bitmap_t *sbmp, size_t start) {
+    if (start >= sbmp->leaf.size_bits) {
+        return BMP_NOT_FOUND;
+    }
+
+    size_t idx = start >> BMP_WORD_ORDER;
+    u64_t free_bits = ~sbmp->leaf.base[idx] & (~0ul << (start & BMP_WORD_MASK));
+
+    if (free_bits != 0) {
+        return (idx << BMP_WORD_ORDER) + ctz64(free_bits);
+    }
+
+    // Climb the summary levels until a later word with free bits shows up.
+    u8_t level = 0;
+    ++idx;
+
+    while (1) {
+        if (level == sbmp->num_levels || idx >= sbmp->summary[level].size_bits) {
+            return BMP_NOT_FOUND;
+        }
+
+        u64_t word = sbmp->summary[level].base[idx >> BMP_WORD_ORDER] & (~0ul << (idx & BMP_WORD_MASK));
+
+        if (word != 0) {
+            idx = (idx & ~(u64_t)BMP_WORD_MASK) + ctz64(word);
+            break;
+        }
+
+        idx = (idx >> BMP_WORD_ORDER) + 1;
+        ++level;
+    }
+
+    // Descend back to the leaf following the first free word at each level.
+    while (level > 0) {
+        --level;
+        idx = (idx << BMP_WORD_ORDER) + ctz64(sbmp->summary[level].base[idx]);
+    }
+
+    return (idx << BMP_WORD_ORDER) + ctz64(~sbmp->leaf.base[idx]);
+}
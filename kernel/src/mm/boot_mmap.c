@@ -6,7 +6,7 @@
 #include <utility/math.h>
 #include <utility/strings.h>
 
-#define PHYSMEM_REGION_POOL_SIZE
+#define PHYSMEM_REGION_POOL_SIZE 12
 
 
 // Defined in kernel.ld linker script.
@@ -14,7 +14,12 @@ extern phys_addr_t __KERNEL_PHYSICAL_START;
 extern phys_addr_t __KERNEL_PHYSICAL_END;
 
 // TODO: Use SLAB allocation for this as well.
-physmem_region_t region_pool[12];
+physmem_region_t region_pool[PHYSMEM_REGION_POOL_SIZE];
+
+// The regions sorted by address. Regions never overlap and reservations only ever move free_start forward
+// within a region, so the order stays valid and is_block_usable can binary search it.
+static physmem_region_t *region_index[PHYSMEM_REGION_POOL_SIZE];
+static u8_t num_indexed_regions = 0;
 
 static inline u32_t __num_mmap_entries(const struct multiboot_tag_mmap *mmap_tag) {
     return (mmap_tag->size - sizeof(struct multiboot_tag_mmap)) / mmap_tag->entry_size;
@@ -61,6 +66,22 @@ static inline phys_addr_t clamp_down_to_page(phys_addr_t addr) {
     return (phys_addr_t)((u64_t)addr & ~0xFFF);
 }
 
+static void __build_region_index(physmem_region_t *regions) {
+    num_indexed_regions = 0;
+
+    // Insertion sort, the E820 map is tiny and usually sorted already.
+    for (physmem_region_t *region = regions; region; region = region->next_region) {
+        u8_t idx = num_indexed_regions++;
+
+        while (idx > 0 && region_index[idx - 1]->free_start > region->free_start) {
+            region_index[idx] = region_index[idx - 1];
+            --idx;
+        }
+
+        region_index[idx] = region;
+    }
+}
+
 physmem_region_t *load_physmem_regions() {
     static physmem_region_t *regions = NULL;
 
@@ -109,6 +130,8 @@ physmem_region_t *load_physmem_regions() {
     physmem_region_t *last_region = current_region - 1;
     last_region->next_region = NULL;
 
+    __build_region_index(regions);
+
     return regions;
 }
 
@@ -134,18 +157,28 @@ phys_addr_t reserve_physmem_region(u64_t num_pages) {
     return NULL;
 }
 
-const int is_block_usable(phys_addr_t block_base, size_t num_bytes) {
-    const physmem_region_t *region = load_physmem_regions();
+int is_block_usable(phys_addr_t block_base, size_t num_bytes) {
+    load_physmem_regions();
     phys_addr_t block_end = block_base + num_bytes;
 
-    // Check if the block is fully contained in any free physmem region
-    while (region) {
-        if (region->free_start <= block_base && block_end <= region->region_end) {
-            return 1;
+    // Binary search for the last region starting at or before the block, it's the only one
+    // that could fully contain the block.
+    u8_t low = 0, high = num_indexed_regions;
+
+    while (low < high) {
+        u8_t mid = (low + high) / 2;
+
+        if (region_index[mid]->free_start <= block_base) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        
-        region = region->next_region;
     }
 
-    return 0;
-}
\ No newline at end of file
+    if (low == 0) {
+        return 0;
+    }
+
+    const physmem_region_t *region = region_index[low - 1];
+    return block_end <= region->region_end;
+}
@@ -1,10 +1,10 @@
 #include <mm/buddy_alloc.h>
 #include <mm/boot_mmap.h>
-#include <mm/vmzone.h>
+#include <mm/page.h>
 
+#include <log.h>
 #include <utility/strings.h>
 #include <utility/math.h>
-#include <mm/slab.h>
 #include <mm/bitmap.h>
 
 size_t buddy_bmp_size_bits(size_t num_pages) {
@@ -22,95 +22,125 @@ static inline size_t __buddy_page_offset(size_t page_offset, u8_t order) {
 
     if (page_offset & alignment_mask) {
         // If page offset is not aligned with (order + 1) then it is the secondary buddy.
-        return page_offset - (1 << order);        
+        return page_offset - (1ul << order);
     } else {
-        return page_offset + (1 << order);
+        return page_offset + (1ul << order);
     }
 }
 
-buddy_prealloc_vector buddy_estimate_pool_size(size_t num_pages) {
-    size_t bitmap_struct_bytes = buddy_bmp_size_bits(num_pages) >> 3;
-    size_t num_max_blocks = round_up_shift_right(num_pages, MAX_ORDER);
-    
-    // Since the free list memory pool can grow as needed (since it has no physical contiguity requirement)
-    // in the allocation model we can allocate a few more pages than needed to save space.
-    
-    // Add 3 * (MAX_ORDER + 1) free list nodes. This is an arbitrary number however it can help account
-    // for memory boundaries which are not allocatable, and thus require smaller blocks to fit
-    // the memory at initialization. We want a slight overestimate so we allocate enough memory up front. 
-    // If we don't allocate enough memory up front it's more difficult to expand the free list before having
-    // a fully initialized allocator.
-    size_t freelist_nodes_estimate = num_max_blocks + 3 * (MAX_ORDER + 1);
+size_t buddy_bitmap_pages(phys_addr_t start_addr, phys_addr_t end_addr) {
+    // The allocator's page offsets start at the MAX_ORDER block containing start_addr.
+    size_t num_pages = page_offset_of(end_addr - trunc_n_bits(start_addr, MAX_ORDER + PAGE_ORDER));
+    size_t bitmap_bytes = bmp_size_words(buddy_bmp_size_bits(num_pages)) * sizeof(u64_t);
+
+    return round_up_shift_right(bitmap_bytes, PAGE_ORDER);
+}
+
+static inline page_info_t *__page_info_of(buddy_allocator_t *allocator, size_t page_offset) {
+    return page_info(allocator->base_addr + (page_offset << PAGE_ORDER));
+}
 
-    buddy_prealloc_vector prealloc;
+// Add the block at page_offset to the head of the freelist of the given order.
+static inline void __link_free_block(buddy_allocator_t *allocator, size_t page_offset, u8_t order) {
+    page_info_t *page = __page_info_of(allocator, page_offset);
+    page_info_t *head = allocator->freelists[order];
 
-    prealloc.bitmap_and_struct_pages = round_up_shift_right(bitmap_struct_bytes, PAGE_ORDER);
-    size_t per_slab = OBJS_PER_SLAB(freelist_entry_t);
+    set_page_flags_atomic(page, PAGE_BUDDY_FREE);
+    page->buddy_free_info.order = order;
+    page->buddy_free_info.prev = NULL;
+    page->buddy_free_info.next = head;
 
-    prealloc.freelist_pool_slabs = (freelist_nodes_estimate + per_slab - 1) / per_slab, PAGE_ORDER;
+    if (head != NULL) {
+        head->buddy_free_info.prev = page;
+    }
 
-    return prealloc;
+    allocator->freelists[order] = page;
+    ++allocator->free_blocks[order];
 }
 
-static inline void __allocate_freelist_entry(buddy_allocator_t *allocator, size_t page_offset, u8_t order) {
-    freelist_entry_t *entry = slab_alloc(&allocator->freelist_cache);
-    entry->next_entry = allocator->freelists[order] == NULL ? NULL : allocator->freelists[order] - entry;
-    entry->page_offset = page_offset;
+// Remove a free block from the freelist of the given order in constant time.
+static inline void __unlink_free_block(buddy_allocator_t *allocator, page_info_t *page, u8_t order) {
+    page_info_t *prev = page->buddy_free_info.prev;
+    page_info_t *next = page->buddy_free_info.next;
+
+    if (prev != NULL) {
+        prev->buddy_free_info.next = next;
+    } else {
+        // This block was the head so update the head of the list.
+        allocator->freelists[order] = next;
+    }
+
+    if (next != NULL) {
+        next->buddy_free_info.prev = prev;
+    }
 
-    allocator->freelists[order] = entry;
+    unset_page_flags_atomic(page, PAGE_BUDDY_FREE);
+    --allocator->free_blocks[order];
 }
 
-void __populate_initial_freelists(buddy_allocator_t *allocator) {
-    size_t cursor_page_offset = 0;
-    size_t max_page_offset = page_offset_of(allocator->end_addr - allocator->base_addr);
+// Remove the free block of the provided order at page_offset from its freelist.
+// Returns 0 if there is no such free block.
+static int __pop_free_block(buddy_allocator_t *allocator, size_t page_offset, u8_t order) {
+    page_info_t *page = __page_info_of(allocator, page_offset);
 
-    // We populate the list 1 block of MAX_ORDER at a time, but if we run into memory holes / boundaries
-    // we can put smaller blocks along the way.
-    while (cursor_page_offset < max_page_offset) {
-        size_t inner_page_offset = 0;
-        s8_t order = MAX_ORDER;
+    if (!(page->flags & PAGE_BUDDY_FREE) || page->buddy_free_info.order != order) {
+        return 0;
+    }
 
-        // We try to allocate as close to MAX_ORDER as we can. At each order level we'll check if the 
-        // block is usable. If not we allocate the largest possible block and advance the inner_page_offset
-        // to the boundary of that block's buddy. Mathematically that buddy will not be usable, but we can
-        // still try to fit even smaller blocks until order < 0, then stop.
-        while (order >= 0 && inner_page_offset < (1 << MAX_ORDER)) {
-            size_t curr_offset = inner_page_offset + cursor_page_offset;
-            phys_addr_t block_start = allocator->base_addr + ((cursor_page_offset + inner_page_offset) << PAGE_ORDER);
+    __unlink_free_block(allocator, page, order);
+    return 1;
+}
 
-            if (is_block_usable(block_start, 1 << (12 + order))) {
-                // If the block is usable allocate a free block here
-                __allocate_freelist_entry(allocator, curr_offset, order);
+static inline int __is_block_managed(buddy_allocator_t *allocator, size_t page_offset, u8_t order) {
+    phys_addr_t block_start = allocator->base_addr + (page_offset << PAGE_ORDER);
+    size_t block_bytes = 1ul << (order + PAGE_ORDER);
 
-                allocator->free_space_bytes += 1 << (12 + order);
+    return block_start >= allocator->start_addr
+        && block_start + block_bytes <= allocator->end_addr
+        && is_block_usable(block_start, block_bytes);
+}
 
-                // Advance the inner page offset by the size of the block.
-                inner_page_offset += (1 << order);
-            }
+static void __populate_initial_freelists(buddy_allocator_t *allocator) {
+    size_t cursor_page_offset = page_offset_of(allocator->start_addr - allocator->base_addr);
+    size_t max_page_offset = page_offset_of(allocator->end_addr - allocator->base_addr);
 
+    // Greedily place the largest block that the cursor is aligned to and which is fully usable. Memory holes and
+    // region boundaries are filled with smaller blocks on either side, and unusable pages are skipped.
+    while (cursor_page_offset < max_page_offset) {
+        s8_t order = cursor_page_offset == 0 ? MAX_ORDER : MIN(__builtin_ctzl(cursor_page_offset), MAX_ORDER);
+
+        while (order >= 0 && !__is_block_managed(allocator, cursor_page_offset, order)) {
             --order;
         }
 
-        cursor_page_offset += (1 << MAX_ORDER);
+        if (order < 0) {
+            // The page at the cursor isn't usable.
+            cursor_page_offset += 1;
+            continue;
+        }
+
+        __link_free_block(allocator, cursor_page_offset, order);
+        allocator->free_space_bytes += 1ul << (PAGE_ORDER + order);
+
+        cursor_page_offset += 1ul << order;
     }
 }
 
-void buddy_init(buddy_allocator_t *allocator, buddy_memory_pool pool, phys_addr_t base_addr, phys_addr_t end_addr) {
+void buddy_init(buddy_allocator_t *allocator, void *bitmap_pool, phys_addr_t start_addr, phys_addr_t end_addr) {
+    // Page offsets are relative to the MAX_ORDER block containing start_addr, so that every block is naturally aligned
+    // in physical memory (ie: a 2MB block can back a huge page).
+    const phys_addr_t base_addr = trunc_n_bits(start_addr, MAX_ORDER + PAGE_ORDER);
     const size_t region_size_pages = (end_addr - base_addr) >> PAGE_ORDER;
 
-    // Use the base of the bitmap and struct pool for the allocator's internal structures.
-    u8_t *bitmap_base = (u8_t*)pool.bitmap_and_struct_pool;
     memset(allocator, 0, sizeof(buddy_allocator_t));
     
-    bmp_init(&allocator->buddy_state_map, bitmap_base, buddy_bmp_size_bits(region_size_pages));
-    slab_cache_init(&allocator->freelist_cache, sizeof(freelist_entry_t), _Alignof(freelist_entry_t), 0, VMZONE_BUDDY_MEM);
-    slab_cache_prealloc(&allocator->freelist_cache, pool.freelist_pool, pool.freelist_pool_slabs);
+    bmp_init(&allocator->buddy_state_map, (u64_t*)bitmap_pool, buddy_bmp_size_bits(region_size_pages));
     
     allocator->base_addr = base_addr;
+    allocator->start_addr = start_addr;
     allocator->end_addr = end_addr;
     
     for (u8_t order = 0; order <= MAX_ORDER; ++order) {
-        // The first entry of the freelist pool will be NULL.
         allocator->freelists[order] = NULL;
     }
 
@@ -121,7 +151,7 @@ size_t __find_or_split_block(buddy_allocator_t *allocator, u8_t target_order) {
     u8_t order = target_order + 1;
 
     // Find a free block.
-    freelist_entry_t *free_block;
+    page_info_t *free_block;
     do {
         free_block = allocator->freelists[order];
     } while (free_block == NULL && order++ < MAX_ORDER);
@@ -133,91 +163,146 @@ size_t __find_or_split_block(buddy_allocator_t *allocator, u8_t target_order) {
 
     // Remove this block from the freelist of the corresponding order and flip its bitmap
     // bit (indicating that its been allocated).
-    allocator->freelists[order] = free_block->next_entry == NULL ? NULL : free_block + free_block->next_entry;
-    size_t bmp_index = buddy_bmp_index_of(free_block->page_offset, order);
+    __unlink_free_block(allocator, free_block, order);
+    size_t page_offset = buddy_block_offset(allocator, free_block);
+    size_t bmp_index = buddy_bmp_index_of(page_offset, order);
     bmp_toggle_bit(&allocator->buddy_state_map, bmp_index);
 
-    // For each order from order - 1 to target_order + 1 (inclusive) we need to create 
-    // a free list entry for the buddy of the page_offset of the free_block that we found.
+    allocator->stats.splits += order - target_order;
+
+    // For each order from order - 1 to target_order + 1 (inclusive) we need to add
+    // the buddy of the page_offset of the free_block that we found to the freelist.
     // These blocks represent the result of splitting the blocks at each level.
     // We also need to toggle the free bit at each of these levels.
     for (order = order - 1; order > target_order; --order) {
         // Page offset of the buddy of the block.
-        size_t buddy_offset = free_block->page_offset + (1 << order);
-        __allocate_freelist_entry(allocator, buddy_offset, order);
+        size_t buddy_offset = page_offset + (1ul << order);
+        __link_free_block(allocator, buddy_offset, order);
 
-        bmp_index = buddy_bmp_index_of(free_block->page_offset, order);
+        bmp_index = buddy_bmp_index_of(page_offset, order);
         bmp_toggle_bit(&allocator->buddy_state_map, bmp_index);
     }
 
-    // The final level needs to be split. Instead of allocating a free block we can just
-    // re-use the current one. More specifically if we just return the page_offset of the buddy at
-    // target_order, then all that remains is to take the current free_block and move it to the list 
+    // The final level needs to be split. If we just return the page_offset of the buddy at
+    // target_order, then all that remains is to move the current free_block to the list 
     // of target_order.
 
-    free_block->next_entry = allocator->freelists[target_order] == NULL ? NULL : allocator->freelists[target_order] - free_block;
-    allocator->freelists[target_order] = free_block;
+    __link_free_block(allocator, page_offset, target_order);
 
     // We also need to flip the buddy state bit for target_order now that we've allocated one of the
     // two buddies.
-    bmp_index = buddy_bmp_index_of(free_block->page_offset, target_order);
+    bmp_index = buddy_bmp_index_of(page_offset, target_order);
     bmp_toggle_bit(&allocator->buddy_state_map, bmp_index);
 
-    return free_block->page_offset + (1 << target_order);
+    return page_offset + (1ul << target_order);
 }
 
 phys_addr_t buddy_alloc_block(buddy_allocator_t *allocator, u8_t order) {
-    freelist_entry_t *free_block = allocator->freelists[order];
+    if (order > MAX_ORDER) {
+        return NULL;
+    }
+
+    page_info_t *free_block = allocator->freelists[order];
     size_t page_offset;
     if (free_block != NULL) {
-        page_offset = free_block->page_offset;
+        page_offset = buddy_block_offset(allocator, free_block);
 
         // Remove the block from the free list
-        allocator->freelists[order] = free_block->next_entry == NULL ? NULL : free_block + free_block->next_entry;
-        
-        // Make the block reclaimable and cache it for the next free / allocation
-        __release_freelist_entry(allocator, free_block);
+        __unlink_free_block(allocator, free_block, order);
 
         // Toggle the bit for this block and its buddy.
         size_t bmp_index = buddy_bmp_index_of(page_offset, order);
         bmp_toggle_bit(&allocator->buddy_state_map, bmp_index);
     } else {
         page_offset = __find_or_split_block(allocator, order);
+
+        if (page_offset == PAGE_OFFSET_OOB) {
+            ++allocator->stats.failures;
+            return NULL;
+        }
     }
 
+    ++allocator->stats.allocs;
+
     // Memory accounting
-    allocator->free_space_bytes -= (1 << (order + PAGE_ORDER));
-    allocator->allocated_bytes += (1 << (order + PAGE_ORDER));
+    allocator->free_space_bytes -= 1ul << (order + PAGE_ORDER);
+    allocator->allocated_bytes += 1ul << (order + PAGE_ORDER);
 
     return allocator->base_addr + (page_offset << PAGE_ORDER);
 }
 
-freelist_entry_t *__pop_freelist_entry(buddy_allocator_t *allocator, size_t page_offset, u8_t order) {
-    freelist_entry_t *entry, *prev;
+// Smallest order above target_order with a free block, or MAX_ORDER + 1 if there is none.
+static inline u8_t __smallest_free_order_above(buddy_allocator_t *allocator, u8_t target_order) {
+    u8_t order = target_order + 1;
 
-    prev = NULL;
-    entry = allocator->freelists[order];
+    while (order <= MAX_ORDER && allocator->freelists[order] == NULL) {
+        ++order;
+    }
 
-    while (entry != NULL && entry->page_offset != page_offset) {
-        prev = entry;
-        entry = entry->next_entry == NULL ? NULL : entry + entry->next_entry;
+    return order;
+}
+
+size_t buddy_alloc_bulk(buddy_allocator_t *allocator, u8_t order, phys_addr_t *blocks, size_t count) {
+    if (order > MAX_ORDER) {
+        return 0;
     }
 
-    if (entry == NULL) {
-        return NULL;
+    size_t allocated = 0;
+
+    while (allocated < count) {
+        page_info_t *free_block = allocator->freelists[order];
+        size_t page_offset;
+
+        if (free_block != NULL) {
+            // Exact fit, same as the single block fast path.
+            page_offset = buddy_block_offset(allocator, free_block);
+            __unlink_free_block(allocator, free_block, order);
+            bmp_toggle_bit(&allocator->buddy_state_map, buddy_bmp_index_of(page_offset, order));
+
+            blocks[allocated++] = allocator->base_addr + (page_offset << PAGE_ORDER);
+            continue;
+        }
+
+        u8_t found_order = __smallest_free_order_above(allocator, order);
+        if (found_order > MAX_ORDER) {
+            break;
+        }
+
+        size_t blocks_in_found = 1ul << (found_order - order);
+
+        if (blocks_in_found <= count - allocated) {
+            // The whole block is consumed, so rather than splitting it level by level we hand out every sub block
+            // directly. Every pair of buddies inside it ends up with both halves allocated so their state bits stay
+            // at 0, only the pair containing the block itself changes state.
+            free_block = allocator->freelists[found_order];
+            page_offset = buddy_block_offset(allocator, free_block);
+            __unlink_free_block(allocator, free_block, found_order);
+            bmp_toggle_bit(&allocator->buddy_state_map, buddy_bmp_index_of(page_offset, found_order));
+
+            allocator->stats.splits += blocks_in_found - 1;
+
+            for (size_t i = 0; i < blocks_in_found; ++i) {
+                blocks[allocated++] = allocator->base_addr + ((page_offset + (i << order)) << PAGE_ORDER);
+            }
+        } else {
+            // Split off a single block, the remainder of the split refills the freelist of this order
+            // so the following iterations take the exact fit path.
+            page_offset = __find_or_split_block(allocator, order);
+            blocks[allocated++] = allocator->base_addr + (page_offset << PAGE_ORDER);
+        }
     }
 
-    if (entry == allocator->freelists[order]) {
-        allocator->freelists[order] = entry->next_entry == NULL ? NULL : entry + entry->next_entry;
-    } else {
-        prev->next_entry = entry->next_entry == NULL ? NULL : (entry + entry->next_entry) - prev;
+    if (allocated < count) {
+        ++allocator->stats.failures;
     }
 
-    return entry;
-}
+    allocator->stats.allocs += allocated;
 
-inline void __release_freelist_entry(buddy_allocator_t *allocator, freelist_entry_t *entry) {
-    slab_free(&allocator->freelist_cache, entry);
+    // Memory accounting is done once for the whole batch.
+    allocator->free_space_bytes -= allocated << (order + PAGE_ORDER);
+    allocator->allocated_bytes += allocated << (order + PAGE_ORDER);
+
+    return allocated;
 }
 
 int __can_coalesce(buddy_allocator_t *allocator, size_t coalesced_offset, u8_t order, size_t *bmp_index) {
@@ -225,97 +310,104 @@ int __can_coalesce(buddy_allocator_t *allocator, size_t coalesced_offset, u8_t o
     u8_t buddy_pair_state = bmp_get_bit(&allocator->buddy_state_map, *bmp_index);
 
     size_t buddy_offset = __buddy_page_offset(coalesced_offset, order);
-    size_t buddy_addr = allocator->base_addr + (buddy_offset << PAGE_ORDER);
 
-    return buddy_pair_state == 1 && is_block_usable(buddy_addr, 1 << (PAGE_ORDER + order));
+    return buddy_pair_state == 1 && __is_block_managed(allocator, buddy_offset, order);
 }
 
-void buddy_free_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t order) {
+// Returns a block to the freelists, coalescing it with its buddies. Accounting is left to the caller.
+static void __free_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t order) {
     size_t page_offset = (block_base - allocator->base_addr) >> PAGE_ORDER;
-    size_t order_bytes = 1ul << (PAGE_ORDER + order);
-
-    size_t bmp_index = buddy_bmp_index_of(page_offset, order);
-    u8_t buddy_pair_state = bmp_get_bit(&allocator->buddy_state_map, bmp_index);
-
-    size_t buddy_offset = __buddy_page_offset(page_offset, order);
 
-    if (buddy_pair_state == 1 && is_block_usable(block_base + order_bytes, order_bytes)) {
-        // We are able to coalesce this block and its buddy. Don't bother creating a freelist entry,
-        // we'll find the entry of the buddy and merge with it.
+    size_t coalesced_offset = page_offset;
+    u8_t coalesced_order = order;
+    size_t bmp_index;
+
+    // Each step finds the buddy through its page info, so freeing a block costs O(MAX_ORDER)
+    // regardless of how long the freelists are.
+    while (coalesced_order < MAX_ORDER && __can_coalesce(allocator, coalesced_offset, coalesced_order, &bmp_index)) {
+        size_t buddy_offset = __buddy_page_offset(coalesced_offset, coalesced_order);
+
+        // The state bit says the buddy is free, so it has to be on its freelist. If it isn't the allocator's state is
+        // corrupt. Stop merging here rather than hand out the buddy twice.
+        if (!__pop_free_block(allocator, buddy_offset, coalesced_order)) {
+            printk("buddy: block at page offset %lu of order %u is marked free but isn't on its freelist\n",
+                buddy_offset, coalesced_order);
+            break;
+        }
 
-        // This entry will not be removed so we don't decrement
-        freelist_entry_t *buddy = __pop_freelist_entry(allocator, buddy_offset, order);
+        // Both buddies are now free and merged into a single block of the next order.
         bmp_set_bit(&allocator->buddy_state_map, bmp_index, 0);
-        
-        size_t coalesced_offset = MIN(page_offset, buddy_offset);
-        size_t coalesced_order = order;
-
-        while (++coalesced_order < MAX_ORDER && __can_coalesce(allocator, coalesced_offset, coalesced_order, &bmp_index)) {
-            buddy_offset = __buddy_page_offset(coalesced_offset, coalesced_order);
-            
-            // Coalesce the block.
-            freelist_entry_t *upper_buddy = __pop_freelist_entry(allocator, buddy_offset, coalesced_order);
-            __release_freelist_entry(allocator, upper_buddy);
+        ++allocator->stats.coalesces;
 
-            bmp_set_bit(&allocator->buddy_state_map, bmp_index, 0);
+        coalesced_offset = MIN(coalesced_offset, buddy_offset);
+        ++coalesced_order;
+    }
 
-            coalesced_offset = MIN(coalesced_offset, buddy_offset);
-        }
+    // Finally we've reached the highest possible coalescable order, add the block to the freelist
+    // of this order and toggle the state of its pair of buddies.
+    __link_free_block(allocator, coalesced_offset, coalesced_order);
 
-        // Finally we've reached the highest possible coalescable order, we just need to move the freelist entry
-        // to this order.
-        buddy->next_entry = allocator->freelists[coalesced_order] == NULL ? NULL : allocator->freelists[coalesced_order] - buddy;
-        buddy->page_offset = coalesced_offset;
+    bmp_index = buddy_bmp_index_of(coalesced_offset, coalesced_order);
+    bmp_toggle_bit(&allocator->buddy_state_map, bmp_index);
+}
 
-        // Add the buddy block to the free list and toggle its bit.
-        allocator->freelists[coalesced_order] = buddy;
-        bmp_toggle_bit(&allocator->buddy_state_map, bmp_index);
-    } else {
-        // Create a freelist entry for this block, we can't coalesce with the buddy afterwards.
-        // And toggle the bit.
-        __allocate_freelist_entry(allocator, page_offset, order);
-        bmp_set_bit(&allocator->buddy_state_map, bmp_index, 1);
-    }
+void buddy_free_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t order) {
+    __free_block(allocator, block_base, order);
+    ++allocator->stats.frees;
 
     // Memory Accounting
     allocator->free_space_bytes += 1ul << (order + PAGE_ORDER);
     allocator->allocated_bytes -= 1ul << (order + PAGE_ORDER);
 }
 
-void buddy_shrink_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t block_order, u8_t num_pages) {
+void buddy_free_bulk(buddy_allocator_t *allocator, const phys_addr_t *blocks, size_t count, u8_t order) {
+    for (size_t i = 0; i < count; ++i) {
+        __free_block(allocator, blocks[i], order);
+    }
+
+    allocator->stats.frees += count;
+
+    // Memory Accounting
+    allocator->free_space_bytes += count << (order + PAGE_ORDER);
+    allocator->allocated_bytes -= count << (order + PAGE_ORDER);
+}
+
+void buddy_shrink_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8_t block_order, size_t num_pages) {
     // We make no assumptions about the alignment of block_base,
     // get the block offset truncated to be the base of the block.
     size_t block_offset = trunc_n_bits((block_base - allocator->base_addr) >> PAGE_ORDER, block_order);
 
-    u8_t block_size = 1 << block_order;
     u8_t split_order = block_order - 1;
 
+    // num_pages is consumed by the loop below.
+    size_t pages_kept = num_pages;
+
     // This is essentially the unwound version of a recursive implementation.
     // The base case is when the num_pages requested is equal to 2^block_order. This means we have nothing
     // to shrink, so we don't do anything. 
 
-    // Else we then split the block in to two sub blocks, creating a freelist entry if necessary, then recursively
+    // Else we then split the block in to two sub blocks, freeing the right hand block if necessary, then recursively
     // shrink either the left or right block as needed.
 
     // In the "tailcall" the num_pages, split_order and block_offset variables are re-used in the "next frame".
-    while (num_pages != (1 << (split_order + 1))) {
+    while (num_pages != (1ul << (split_order + 1))) {
         // Bitmap index for the pair of buddies we'll be splitting.
         size_t bmp_index = buddy_bmp_index_of(block_offset, split_order);
 
-        // We need to split the block into two blocks of size (split_order). The question is do we need to create a free list node or not?
-        // If num_pages > 2^split_order then both sub blocks are going to be allocated, thus we don't need to create any free list entries,
+        // We need to split the block into two blocks of size (split_order). The question is do we need to free the right block or not?
+        // If num_pages > 2^split_order then both sub blocks are going to be allocated, thus we don't need to free anything,
         // and set the bitmap bit to 0 (since the bit is the XOR of the states), and we go to the right block for the next allocation.
-        if (num_pages > (1 << split_order)) {
-            block_offset += (1 << split_order);
+        if (num_pages > (1ul << split_order)) {
+            block_offset += (1ul << split_order);
 
             bmp_set_bit(&allocator->buddy_state_map, bmp_index, 0);
 
             // Num pages has to be adjusted for the left side block which contains the first (1 << split_order) pages of the
             // shrunk block.
-            num_pages -= (1 << split_order);
+            num_pages -= (1ul << split_order);
         } else {
-            // The right hand block of the split is going to be freed, so we need to create a freelist entry and toggle the bitmap bit for this pair of buddies.
-            __allocate_freelist_entry(allocator, block_offset + (1 << split_order), split_order);
+            // The right hand block of the split is going to be freed, so we need to add it to the freelist and toggle the bitmap bit for this pair of buddies.
+            __link_free_block(allocator, block_offset + (1ul << split_order), split_order);
 
             bmp_set_bit(&allocator->buddy_state_map, bmp_index, 1);
 
@@ -323,15 +415,13 @@ void buddy_shrink_block(buddy_allocator_t *allocator, phys_addr_t block_base, u8
             // num pages remains unchanged in this case since it's fully encapsulated in the left hand block.
         }
 
+        ++allocator->stats.splits;
         --split_order;
     }
 
     // Accounting
-    size_t bytes_freed = ((1ul << block_order) - num_pages) << PAGE_ORDER;
+    size_t bytes_freed = ((1ul << block_order) - pages_kept) << PAGE_ORDER;
     allocator->free_space_bytes += bytes_freed;
     allocator->allocated_bytes -= bytes_freed;
 }
 
-void buddy_freelist_pool_expand(buddy_allocator_t *allocator, void *slab) {
-    slab_cache_prealloc(&allocator->freelist_cache, slab, 1);
-}
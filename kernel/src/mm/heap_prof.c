@@ -0,0 +1,210 @@
+#include <log.h>
+#include <mm.h>
+#include <mm/heap_prof.h>
+#include <cpu/irq.h>
+#include <utility/math.h>
+#include <utility/strings.h>
+
+#define SITES_MASK (HEAP_PROF_SITES - 1)
+#define LIVE_MASK  (HEAP_PROF_LIVE - 1)
+
+// A sampled allocation which hasn't been freed yet.
+typedef struct {
+    void *ptr;
+    size_t bytes;
+    u8_t site_idx;
+} heap_prof_live_t;
+
+u32_t heap_prof_sample_bytes = 0;
+
+static heap_prof_site_t __sites[HEAP_PROF_SITES];
+static heap_prof_live_t __live[HEAP_PROF_LIVE];
+
+// Bytes left to allocate before the next sample.
+static s64_t __until_sample;
+static u64_t __dropped;
+
+static inline size_t __hash(void *key) {
+    return ((u64_t)key * 0x9E3779B97F4A7C15ul) >> 32;
+}
+
+void heap_prof_start(u32_t sample_bytes) {
+    u64_t irq = irq_save();
+    heap_prof_stop();
+
+    __until_sample = sample_bytes;
+    heap_prof_sample_bytes = sample_bytes;
+    irq_restore(irq);
+}
+
+void heap_prof_stop() {
+    u64_t irq = irq_save();
+    heap_prof_sample_bytes = 0;
+    __dropped = 0;
+
+    memset(__sites, 0, sizeof(__sites));
+    memset(__live, 0, sizeof(__live));
+    irq_restore(irq);
+}
+
+// The slot of a call site, claiming a free one on the first allocation from the site. Returns HEAP_PROF_SITES if the
+// hash is full.
+static size_t __site_slot(void *site) {
+    size_t slot = __hash(site) & SITES_MASK;
+
+    for (size_t probes = 0; probes < HEAP_PROF_SITES; ++probes) {
+        if (__sites[slot].site == site) {
+            return slot;
+        }
+
+        if (__sites[slot].site == NULL) {
+            __sites[slot].site = site;
+            return slot;
+        }
+
+        slot = (slot + 1) & SITES_MASK;
+    }
+
+    return HEAP_PROF_SITES;
+}
+
+static void __sample_alloc(void *ptr, size_t size, void *site) {
+    __until_sample -= size;
+
+    if (__until_sample > 0) {
+        return;
+    }
+
+    __until_sample = heap_prof_sample_bytes;
+
+    size_t site_idx = __site_slot(site);
+    size_t slot = __hash(ptr) & LIVE_MASK;
+    size_t probes = 0;
+
+    while (__live[slot].ptr != NULL && probes < HEAP_PROF_LIVE) {
+        slot = (slot + 1) & LIVE_MASK;
+        ++probes;
+    }
+
+    if (site_idx == HEAP_PROF_SITES || probes == HEAP_PROF_LIVE) {
+        ++__dropped;
+        return;
+    }
+
+    heap_prof_site_t *prof = &__sites[site_idx];
+    size_t bytes = MAX(size, heap_prof_sample_bytes);
+
+    __live[slot].ptr = ptr;
+    __live[slot].bytes = bytes;
+    __live[slot].site_idx = site_idx;
+
+    ++prof->allocs;
+    prof->live_bytes += bytes;
+    prof->peak_bytes = MAX(prof->peak_bytes, prof->live_bytes);
+}
+
+// Empty a slot of the live hash, moving back the entries after it which would no longer be found past the hole.
+static void __live_remove(size_t hole) {
+    size_t next = (hole + 1) & LIVE_MASK;
+
+    while (__live[next].ptr != NULL) {
+        size_t home = __hash(__live[next].ptr) & LIVE_MASK;
+
+        if (((next - home) & LIVE_MASK) >= ((next - hole) & LIVE_MASK)) {
+            __live[hole] = __live[next];
+            hole = next;
+        }
+
+        next = (next + 1) & LIVE_MASK;
+    }
+
+    __live[hole].ptr = NULL;
+}
+
+static void __charge_free(void *ptr) {
+    size_t slot = __hash(ptr) & LIVE_MASK;
+
+    for (size_t probes = 0; probes < HEAP_PROF_LIVE && __live[slot].ptr != NULL; ++probes) {
+        if (__live[slot].ptr == ptr) {
+            heap_prof_site_t *prof = &__sites[__live[slot].site_idx];
+
+            ++prof->frees;
+            prof->live_bytes -= __live[slot].bytes;
+
+            __live_remove(slot);
+            return;
+        }
+
+        slot = (slot + 1) & LIVE_MASK;
+    }
+}
+
+// The hooks run after the allocators have restored interrupts, and kmalloc and kfree may be called from interrupt
+// handlers, so the hashes are only touched with interrupts disabled.
+void __heap_prof_alloc(void *ptr, size_t size, void *site) {
+    u64_t irq = irq_save();
+    __sample_alloc(ptr, size, site);
+    irq_restore(irq);
+}
+
+void __heap_prof_free(void *ptr) {
+    u64_t irq = irq_save();
+    __charge_free(ptr);
+    irq_restore(irq);
+}
+
+size_t heap_prof_sites(heap_prof_site_t *sites, size_t max) {
+    size_t count = 0;
+    u64_t irq = irq_save();
+
+    for (size_t slot = 0; slot < HEAP_PROF_SITES; ++slot) {
+        if (__sites[slot].site == NULL) {
+            continue;
+        }
+
+        // Insertion sort, the output is at most HEAP_PROF_SITES long.
+        size_t pos = MIN(count, max);
+        while (pos > 0 && sites[pos - 1].live_bytes < __sites[slot].live_bytes) {
+            if (pos < max) {
+                sites[pos] = sites[pos - 1];
+            }
+
+            --pos;
+        }
+
+        if (pos < max) {
+            sites[pos] = __sites[slot];
+            count = MIN(count + 1, max);
+        }
+    }
+
+    irq_restore(irq);
+    return count;
+}
+
+u64_t heap_prof_dropped() {
+    return __dropped;
+}
+
+void heap_prof_dump() {
+    // Take a snapshot so every line of the dump comes from the same point in time.
+    static heap_prof_site_t snapshot[HEAP_PROF_SITES];
+    u64_t irq = irq_save();
+    size_t count = heap_prof_sites(snapshot, HEAP_PROF_SITES);
+    u64_t dropped = __dropped;
+    u32_t sample_bytes = heap_prof_sample_bytes;
+    irq_restore(irq);
+
+    if (sample_bytes == 0) {
+        printk("Heap profile: stopped\n");
+        return;
+    }
+
+    printk("Heap profile (sampling every %u bytes, %lu samples dropped):\n", sample_bytes, dropped);
+    printk("site: live bytes, peak bytes, allocs/frees\n");
+
+    for (size_t i = 0; i < count; ++i) {
+        printk("%p: %lu, %lu, %lu/%lu\n", snapshot[i].site,
+            snapshot[i].live_bytes, snapshot[i].peak_bytes, snapshot[i].allocs, snapshot[i].frees);
+    }
+}
@@ -1,54 +1,331 @@
 #include <mm/slab.h>
+#include <mm/page.h>
+#include <mm/page_alloc.h>
+#include <mm/phys_alloc.h>
+#include <mm/vm.h>
 #include <mm/kmalloc.h>
+#include <mm/magazine.h>
 #include <mm/vmzone.h>
+#include <mm/mm_stats.h>
+#include <mm/heap_prof.h>
+#include <utility/strings.h>
 
-#define NUM_CACHE_SIZES (sizeof(kmalloc_sizes) / sizeof(u16_t))
+#define NUM_CACHE_SIZES KMALLOC_NUM_SIZES
 #define NUM_SLABS_RESERVED 3
 
-// Maps from all possible values of (alloc_size + 7) / 8 to a cache to use for that alloc size.
+#if KMALLOC_OFF_SLAB
+#define KMALLOC_CACHE_FLAGS SLAB_CACHE_OFF_SLAB
+#else
+#define KMALLOC_CACHE_FLAGS 0
+#endif
+
+#define __SIZE_ENTRY(idx, size, prev_size, arg) size,
+#define __IDX_MAP_RANGE(idx, size, prev_size, arg) [((prev_size) >> 3) + 1 ... (size) >> 3] = idx,
+
+const u16_t kmalloc_sizes[KMALLOC_NUM_SIZES] = { KMALLOC_SIZE_CLASSES(__SIZE_ENTRY, 0) };
+
 // This is much faster than looping over all cache sizes on every allocation and this fits snugly into a page
 // and thus can be cached by HW quite easily.
-u8_t __cache_idx_map[MAX_KMALLOC_SIZE / 8];
+const u8_t __cache_idx_map[MAX_KMALLOC_SIZE / 8 + 1] = { KMALLOC_SIZE_CLASSES(__IDX_MAP_RANGE, 0) };
 kmem_cache_t __caches[NUM_CACHE_SIZES];
 
+// Names of the caches in slab_info_dump, one per kmalloc_sizes entry.
+static const char *__cache_names[] = {
+    "kmalloc-8", "kmalloc-16", "kmalloc-24", "kmalloc-48", "kmalloc-96",
+    "kmalloc-120", "kmalloc-240", "kmalloc-480", "kmalloc-1016", "kmalloc-2040",
+};
+
+// Per-CPU magazines in front of each cache, so that kmalloc and kfree don't touch the shared slab lists.
+mag_cache_t __mags[NUM_CACHE_SIZES];
+
+// Header at the start of a large allocation. It starts with a slab header so that the cache ID lookup of kfree
+// works the same way for every pointer: large allocations are aligned to SLAB_BLOCK_BYTES just like slabs.
+typedef struct {
+    slab_header_t slab;
+    size_t size;
+    size_t pages;
+    u8_t vmalloced;
+} kmalloc_large_t;
+
+// Shrinker which returns the objects in the depot of every kmalloc cache to the slabs. It releases no pages itself.
+// The CPUs' magazines are kept since a shrinker can run in the middle of a magazine refill.
+static size_t __kmalloc_drain_depots() {
+    for (u16_t i = 0; i < NUM_CACHE_SIZES; ++i) {
+        mag_cache_drain_depot(&__mags[i]);
+    }
+
+    return 0;
+}
+
 void kmalloc_init() {
+    magazine_init();
+
     for (u16_t i = 0; i < NUM_CACHE_SIZES; ++i) {
         kmem_cache_t *cache = &__caches[i];
-        slab_cache_init(cache, kmalloc_sizes[i], 8, i, VMZONE_KERNEL_SLAB);
+        slab_cache_init(cache, kmalloc_sizes[i], 8, i, VMZONE_KERNEL_SLAB, KMALLOC_CACHE_FLAGS);
         slab_cache_reserve(cache, cache->objs_per_slab * NUM_SLABS_RESERVED);
+        cache->name = __cache_names[i];
+        slab_cache_register(cache);
+        mag_cache_init(&__mags[i], cache);
     }
 
-    u16_t prev_size_eights = 0;
+    // When the page allocator runs low, objects parked in the depots go back to their slabs first so that slab_reap
+    // can give the slabs they emptied back along with the other empty slabs.
+    pfa_register_shrinker(__kmalloc_drain_depots);
+    pfa_register_shrinker(slab_reap);
+}
 
-    for (u16_t i = 0; i < NUM_CACHE_SIZES; ++i) {
-        u16_t size_in_eights = kmalloc_sizes[i] / 8;
-        
-        for (u16_t j = prev_size_eights + 1; j <= size_in_eights; ++j) {
-            // Map any allocation with (size / 8) between the previous size in eights and the current size in eights to
-            // the i'th cache.
-            __cache_idx_map[j] = i;
+kmem_cache_t *kmalloc_cache(u16_t cache_idx) {
+    return cache_idx < NUM_CACHE_SIZES ? &__caches[cache_idx] : NULL;
+}
+
+static void *__kmalloc_large(size_t size) {
+    size_t pages = round_up_shift_right(size + KMALLOC_LARGE_HEADER, PAGE_ORDER);
+    kmalloc_large_t *large = NULL;
+    u8_t vmalloced = 0;
+
+    if (pages <= (1ul << MAX_ORDER)) {
+        // Blocks of at least SLAB_BLOCK_BYTES are aligned to it, smaller allocations give back the tail.
+        size_t block_pages = MAX(pages, 1ul << SLAB_MAX_ORDER);
+        phys_addr_t base = phys_alloc(block_pages);
+
+        if (base != NULL) {
+            if (block_pages != pages) {
+                phys_block_shrink(base, block_pages, pages);
+            }
+
+            large = KPHYS_ADDR(base);
+        }
+    }
+
+    if (large == NULL) {
+        // Too large for a buddy block or physical memory is fragmented, map the pages in the vmalloc zone instead.
+        large = vmalloc(pages, VM_ALLOW_WRITE);
+        vmalloced = 1;
+
+        if (large == NULL) {
+            return NULL;
+        }
+    }
+
+    large->slab.cache_id = KMALLOC_LARGE_ID;
+    large->size = size;
+    large->pages = pages;
+    large->vmalloced = vmalloced;
+
+    return (u8_t *)large + KMALLOC_LARGE_HEADER;
+}
+
+static void __kfree_large(void *ptr) {
+    kmalloc_large_t *large = (kmalloc_large_t *)slab_of(ptr);
+
+    if (large->vmalloced) {
+        vfree(large, large->pages);
+    } else {
+        phys_free(phys_addr_for_kphys(large), large->pages);
+    }
+}
+
+static inline void *__kmalloc_from(u8_t size_class, u8_t flags, void *site) {
+    u64_t start = mm_stats_begin();
+    void *obj = mag_alloc_flags(__mags + size_class, flags);
+
+    mm_stats_end(MM_LAT_KMALLOC, start);
+    heap_prof_alloc(obj, kmalloc_sizes[size_class], site);
+    return obj;
+}
+
+static void *__kmalloc_at(size_t size, u8_t flags, void *site) {
+    if (size > MAX_KMALLOC_SIZE) {
+        // Large allocations map memory or dig into the page allocator, neither of which is bounded.
+        if (mm_atomic(flags)) {
+            return NULL;
         }
 
-        prev_size_eights = size_in_eights;
+        void *obj = __kmalloc_large(size);
+
+        if (heap_prof_enabled() && obj != NULL) {
+            heap_prof_alloc(obj, ksize(obj) + KMALLOC_LARGE_HEADER, site);
+        }
+
+        return obj;
     }
+
+    return __kmalloc_from(__cache_idx_map[(size + 7) >> 3], flags, site);
+}
+
+void *__kmalloc_class(u8_t size_class) {
+    return __kmalloc_from(size_class, MM_NORMAL, __builtin_return_address(0));
 }
 
 // Can be mocked in tests
 __attribute__((weak))
-void *kmalloc(u16_t size) {
-    if (size > MAX_KMALLOC_SIZE) {
-        return NULL;
+void *__kmalloc(size_t size) {
+    return __kmalloc_at(size, MM_NORMAL, __builtin_return_address(0));
+}
+
+void *kmalloc_flags(size_t size, u8_t flags) {
+    return __kmalloc_at(size, flags, __builtin_return_address(0));
+}
+
+void kmalloc_set_pool(size_t size, u16_t num_objects) {
+    if (size <= MAX_KMALLOC_SIZE) {
+        slab_cache_set_pool(&__caches[__cache_idx_map[(size + 7) >> 3]], num_objects);
+    }
+}
+
+// The kmalloc cache an object was allocated from.
+static inline u16_t __kmalloc_cache_id(void *ptr) {
+#if KMALLOC_OFF_SLAB
+    phys_addr_t phys = phys_addr_for_kphys(ptr);
+
+    // Large allocations keep their header in band, and vmalloc memory isn't in the physical mapping at all.
+    if (phys == NULL || !(page_info(phys)->flags & (PAGE_SLAB | PAGE_SLAB_TAIL))) {
+        return cache_id_for_alloc(ptr);
     }
 
-    u8_t cache = __cache_idx_map[(size + 7) >> 3];
-    return slab_alloc(__caches + cache);
+    return off_slab_header(ptr)->cache_id;
+#else
+    return cache_id_for_alloc(ptr);
+#endif
 }
 
 __attribute((weak))
 void kfree(void *ptr) {
-    u16_t cache_idx = cache_id_for_alloc(ptr);
+    u16_t cache_idx = __kmalloc_cache_id(ptr);
+
+    heap_prof_free(ptr);
+
+    if (cache_idx < NUM_CACHE_SIZES) {
+        mag_free(__mags + cache_idx, ptr);
+    } else if (cache_idx == KMALLOC_LARGE_ID) {
+        __kfree_large(ptr);
+    }
+}
+
+// Resize a large allocation without moving it. Returns 0 on success.
+static int __krealloc_large(kmalloc_large_t *large, size_t new_size) {
+    size_t new_pages = round_up_shift_right(new_size + KMALLOC_LARGE_HEADER, PAGE_ORDER);
+
+    if (new_pages > large->pages) {
+        // Only vmalloc memory can grow, by mapping the pages following it.
+        if (!large->vmalloced || vmalloc_grow(large, large->pages, new_pages, VM_ALLOW_WRITE) != 0) {
+            return -1;
+        }
+
+        large->pages = new_pages;
+    } else if (new_pages < large->pages && !large->vmalloced) {
+        // The physical runs of vmalloc memory can't be split, so only buddy blocks give back their tail.
+        phys_block_shrink(phys_addr_for_kphys(large), large->pages, new_pages);
+        large->pages = new_pages;
+    }
+
+    large->size = new_size;
+    return 0;
+}
+
+void *krealloc(void *ptr, size_t new_size) {
+    void *site = __builtin_return_address(0);
+
+    if (ptr == NULL) {
+        return __kmalloc_at(new_size, MM_NORMAL, site);
+    }
+
+    if (new_size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    u16_t cache_idx = __kmalloc_cache_id(ptr);
+
+    if (cache_idx < NUM_CACHE_SIZES) {
+        if (new_size <= kmalloc_sizes[cache_idx]) {
+            return ptr;
+        }
+    } else if (cache_idx == KMALLOC_LARGE_ID) {
+        if (__krealloc_large((kmalloc_large_t *)slab_of(ptr), new_size) == 0) {
+            if (heap_prof_enabled()) {
+                // Charge the new size to the caller.
+                heap_prof_free(ptr);
+                heap_prof_alloc(ptr, ksize(ptr) + KMALLOC_LARGE_HEADER, site);
+            }
+
+            return ptr;
+        }
+    }
+
+    void *moved = __kmalloc_at(new_size, MM_NORMAL, site);
+
+    if (moved == NULL) {
+        return NULL;
+    }
+
+    memcpy(moved, ptr, MIN(ksize(ptr), new_size));
+    kfree(ptr);
+
+    return moved;
+}
+
+size_t ksize(void *ptr) {
+    u16_t cache_idx = __kmalloc_cache_id(ptr);
 
     if (cache_idx < NUM_CACHE_SIZES) {
-        slab_free(__caches + cache_idx, ptr);
+        return kmalloc_sizes[cache_idx];
+    } else if (cache_idx == KMALLOC_LARGE_ID) {
+        return (((kmalloc_large_t *)slab_of(ptr))->pages << PAGE_ORDER) - KMALLOC_LARGE_HEADER;
+    }
+
+    return 0;
+}
+
+size_t kmalloc_bulk(u16_t size, void **objs, size_t count) {
+    if (size > MAX_KMALLOC_SIZE) {
+        return 0;
+    }
+
+    u8_t size_class = __cache_idx_map[(size + 7) >> 3];
+    size_t allocated = slab_alloc_bulk(&__caches[size_class], objs, count);
+
+    if (heap_prof_enabled()) {
+        for (size_t i = 0; i < allocated; ++i) {
+            heap_prof_alloc(objs[i], kmalloc_sizes[size_class], __builtin_return_address(0));
+        }
+    }
+
+    return allocated;
+}
+
+void kfree_bulk(void **objs, size_t count) {
+    size_t run_start = 0;
+
+    if (heap_prof_enabled()) {
+        for (size_t i = 0; i < count; ++i) {
+            heap_prof_free(objs[i]);
+        }
+    }
+
+    while (run_start < count) {
+        u16_t cache_idx = __kmalloc_cache_id(objs[run_start]);
+        size_t run_end = run_start + 1;
+
+        while (run_end < count && __kmalloc_cache_id(objs[run_end]) == cache_idx) {
+            ++run_end;
+        }
+
+        if (cache_idx < NUM_CACHE_SIZES) {
+            slab_free_bulk(&__caches[cache_idx], objs + run_start, run_end - run_start);
+        } else if (cache_idx == KMALLOC_LARGE_ID) {
+            for (size_t i = run_start; i < run_end; ++i) {
+                __kfree_large(objs[i]);
+            }
+        }
+
+        run_start = run_end;
+    }
+}
+
+void kmalloc_flush() {
+    for (u16_t i = 0; i < NUM_CACHE_SIZES; ++i) {
+        mag_cache_flush(&__mags[i]);
     }
 }
@@ -0,0 +1,287 @@
+#include <mm/magazine.h>
+#include <mm/vmzone.h>
+
+
+// The depot is touched with interrupts disabled but without a lock, which is only safe on a single CPU.
+_Static_assert(NUM_ONLINE_CPUS == 1, "the magazine depot is not locked");
+
+
+kmem_cache_t __magazine_cache;
+
+
+void magazine_init() {
+    slab_cache_init(&__magazine_cache, sizeof(magazine_t), _Alignof(magazine_t), MAG_CACHE_ID, VMZONE_KERNEL_SLAB, 0);
+    __magazine_cache.name = "magazine";
+    slab_cache_register(&__magazine_cache);
+}
+
+void mag_cache_init(mag_cache_t *mc, kmem_cache_t *cache) {
+    mc->cache = cache;
+
+    for (u32_t cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        mc->cpus[cpu].loaded = NULL;
+        mc->cpus[cpu].previous = NULL;
+    }
+
+    mc->depot.full = NULL;
+    mc->depot.empty = NULL;
+    mc->depot.full_count = 0;
+    mc->depot.empty_count = 0;
+}
+
+static inline void __depot_push(magazine_t **list, u16_t *count, magazine_t *mag) {
+    mag->next = *list;
+    *list = mag;
+    ++(*count);
+}
+
+static inline magazine_t *__depot_pop(magazine_t **list, u16_t *count) {
+    magazine_t *mag = *list;
+
+    if (mag != NULL) {
+        *list = mag->next;
+        --(*count);
+    }
+
+    return mag;
+}
+
+// Get an empty magazine from the depot, or allocate a new one. Returns NULL if out of memory.
+static magazine_t *__get_empty_magazine(mag_cache_t *mc) {
+    magazine_t *mag = __depot_pop(&mc->depot.empty, &mc->depot.empty_count);
+
+    if (mag == NULL) {
+        mag = slab_alloc(&__magazine_cache);
+
+        if (mag != NULL) {
+            mag->rounds = 0;
+        }
+    }
+
+    return mag;
+}
+
+// Fill a magazine with objects from the slab lists.
+static void __mag_fill(mag_cache_t *mc, magazine_t *mag) {
+    while (mag->rounds < MAG_ROUNDS) {
+        void *obj = slab_alloc(mc->cache);
+        if (obj == NULL) {
+            break;
+        }
+
+        mag->objs[mag->rounds++] = obj;
+    }
+}
+
+// Return every object in a magazine to the slab lists.
+static void __mag_empty(mag_cache_t *mc, magazine_t *mag) {
+    while (mag->rounds > 0) {
+        slab_free(mc->cache, mag->objs[--mag->rounds]);
+    }
+}
+
+static inline void __swap_magazines(mag_cpu_t *cpu) {
+    magazine_t *tmp = cpu->loaded;
+    cpu->loaded = cpu->previous;
+    cpu->previous = tmp;
+}
+
+// Make sure the CPU has both of its magazines. Returns 0 if they couldn't be allocated.
+static int __load_magazines(mag_cache_t *mc, mag_cpu_t *cpu) {
+    if (cpu->loaded == NULL) {
+        cpu->loaded = __get_empty_magazine(mc);
+    }
+
+    if (cpu->previous == NULL) {
+        cpu->previous = __get_empty_magazine(mc);
+    }
+
+    return cpu->loaded != NULL && cpu->previous != NULL;
+}
+
+// Atomic allocations only exchange magazines that are already there, before falling back to the slab lists.
+static void *__mag_alloc_atomic(mag_cache_t *mc, mag_cpu_t *cpu) {
+    if (cpu->loaded == NULL || cpu->previous == NULL) {
+        return slab_alloc_flags(mc->cache, MM_ATOMIC);
+    }
+
+    if (cpu->previous->rounds > 0) {
+        __swap_magazines(cpu);
+    } else if (mc->depot.full != NULL) {
+        __depot_push(&mc->depot.empty, &mc->depot.empty_count, cpu->previous);
+        cpu->previous = cpu->loaded;
+        cpu->loaded = __depot_pop(&mc->depot.full, &mc->depot.full_count);
+    } else {
+        return slab_alloc_flags(mc->cache, MM_ATOMIC);
+    }
+
+    return cpu->loaded->objs[--cpu->loaded->rounds];
+}
+
+static void *__mag_alloc(mag_cache_t *mc, u8_t flags) {
+    mag_cpu_t *cpu = &mc->cpus[cpu_id()];
+
+    // Fast path, only touches this CPU's magazine.
+    if (likely(cpu->loaded != NULL && cpu->loaded->rounds > 0)) {
+        return cpu->loaded->objs[--cpu->loaded->rounds];
+    }
+
+    if (mm_atomic(flags)) {
+        return __mag_alloc_atomic(mc, cpu);
+    }
+
+    if (unlikely(!__load_magazines(mc, cpu))) {
+        return slab_alloc(mc->cache);
+    }
+
+    if (cpu->previous->rounds > 0) {
+        __swap_magazines(cpu);
+    } else {
+        magazine_t *full = __depot_pop(&mc->depot.full, &mc->depot.full_count);
+
+        if (full != NULL) {
+            // Both magazines are empty, trade one of them for a full one from the depot.
+            __depot_push(&mc->depot.empty, &mc->depot.empty_count, cpu->previous);
+            cpu->previous = cpu->loaded;
+            cpu->loaded = full;
+        } else {
+            __mag_fill(mc, cpu->loaded);
+
+            if (cpu->loaded->rounds == 0) {
+                return NULL;
+            }
+        }
+    }
+
+    return cpu->loaded->objs[--cpu->loaded->rounds];
+}
+
+void *mag_alloc_flags(mag_cache_t *mc, u8_t flags) {
+    // The magazines of a CPU are shared with its interrupt handlers.
+    u64_t irq = irq_save();
+    void *obj = __mag_alloc(mc, flags);
+
+    irq_restore(irq);
+    return obj;
+}
+
+void *mag_alloc(mag_cache_t *mc) {
+    return mag_alloc_flags(mc, MM_NORMAL);
+}
+
+static void __mag_free(mag_cache_t *mc, void *ptr) {
+    mag_cpu_t *cpu = &mc->cpus[cpu_id()];
+
+    // Fast path, only touches this CPU's magazine.
+    if (likely(cpu->loaded != NULL && cpu->loaded->rounds < MAG_ROUNDS)) {
+        cpu->loaded->objs[cpu->loaded->rounds++] = ptr;
+        return;
+    }
+
+    if (in_interrupt()) {
+        // Don't allocate magazines or empty them into the slabs from an interrupt handler.
+        if (cpu->previous != NULL && cpu->previous->rounds < MAG_ROUNDS) {
+            __swap_magazines(cpu);
+            cpu->loaded->objs[cpu->loaded->rounds++] = ptr;
+        } else {
+            slab_free(mc->cache, ptr);
+        }
+
+        return;
+    }
+
+    if (unlikely(!__load_magazines(mc, cpu))) {
+        slab_free(mc->cache, ptr);
+        return;
+    }
+
+    if (cpu->previous->rounds < MAG_ROUNDS) {
+        // Only happens when the previous magazine is empty, since previous is always full or empty here.
+        __swap_magazines(cpu);
+    } else {
+        magazine_t *empty = NULL;
+
+        if (mc->depot.full_count < MAG_DEPOT_MAX_FULL) {
+            empty = __get_empty_magazine(mc);
+        }
+
+        if (empty != NULL) {
+            // Both magazines are full, hand one to the depot and continue with an empty one.
+            __depot_push(&mc->depot.full, &mc->depot.full_count, cpu->previous);
+            cpu->previous = cpu->loaded;
+            cpu->loaded = empty;
+        } else {
+            // The depot holds enough objects already, return a whole magazine's worth to the slabs.
+            __mag_empty(mc, cpu->previous);
+            __swap_magazines(cpu);
+        }
+    }
+
+    cpu->loaded->objs[cpu->loaded->rounds++] = ptr;
+}
+
+void mag_free(mag_cache_t *mc, void *ptr) {
+    u64_t irq = irq_save();
+    __mag_free(mc, ptr);
+    irq_restore(irq);
+}
+
+static void __release_magazine(mag_cache_t *mc, magazine_t *mag) {
+    if (mag != NULL) {
+        __mag_empty(mc, mag);
+        slab_free(&__magazine_cache, mag);
+    }
+}
+
+void mag_cache_flush(mag_cache_t *mc) {
+    u64_t irq = irq_save();
+
+    for (u32_t cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        __release_magazine(mc, mc->cpus[cpu].loaded);
+        __release_magazine(mc, mc->cpus[cpu].previous);
+
+        mc->cpus[cpu].loaded = NULL;
+        mc->cpus[cpu].previous = NULL;
+    }
+
+    mag_cache_drain_depot(mc);
+    irq_restore(irq);
+}
+
+size_t mag_cache_drain_depot(mag_cache_t *mc) {
+    size_t objects = 0;
+    u64_t irq = irq_save();
+
+    while (mc->depot.full != NULL) {
+        magazine_t *mag = __depot_pop(&mc->depot.full, &mc->depot.full_count);
+        objects += mag->rounds;
+        __release_magazine(mc, mag);
+    }
+
+    while (mc->depot.empty != NULL) {
+        __release_magazine(mc, __depot_pop(&mc->depot.empty, &mc->depot.empty_count));
+    }
+
+    irq_restore(irq);
+    return objects;
+}
+
+size_t mag_cache_objects(const mag_cache_t *mc) {
+    size_t objects = 0;
+
+    for (u32_t cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        if (mc->cpus[cpu].loaded != NULL) {
+            objects += mc->cpus[cpu].loaded->rounds;
+        }
+
+        if (mc->cpus[cpu].previous != NULL) {
+            objects += mc->cpus[cpu].previous->rounds;
+        }
+    }
+
+    for (magazine_t *mag = mc->depot.full; mag != NULL; mag = mag->next) {
+        objects += mag->rounds;
+    }
+
+    return objects;
+}
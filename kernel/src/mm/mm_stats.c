@@ -0,0 +1,96 @@
+#include <log.h>
+#include <mm/mm_stats.h>
+#include <mm/page_alloc.h>
+#include <mm/slab.h>
+#include <mm/heap_prof.h>
+#include <utility/math.h>
+#include <utility/strings.h>
+
+
+mm_latency_hist_t mm_latency_hists[MM_LAT_NUM];
+
+static const char *__latency_names[MM_LAT_NUM] = {
+    "phys_alloc",
+    "slab_alloc",
+    "kmalloc",
+    "vm_alloc_block",
+    "tlsf_alloc",
+};
+
+
+void mm_latency_record(u8_t hist, u64_t cycles) {
+    mm_latency_hist_t *latency = &mm_latency_hists[hist];
+
+    ++latency->samples;
+    latency->total_cycles += cycles;
+    latency->max_cycles = MAX(latency->max_cycles, cycles);
+    ++latency->buckets[mm_latency_bucket(cycles)];
+}
+
+const mm_latency_hist_t *mm_latency_hist(u8_t hist) {
+    return &mm_latency_hists[hist];
+}
+
+void mm_stats_reset_latency() {
+    memset(mm_latency_hists, 0, sizeof(mm_latency_hists));
+}
+
+static void __dump_buddy(const buddy_allocator_t *allocator) {
+    printk("  free %lu pages, allocated %lu pages\n",
+        allocator->free_space_bytes >> PAGE_ORDER, allocator->allocated_bytes >> PAGE_ORDER);
+
+    printk("  free blocks by order:");
+    for (u8_t order = 0; order <= MAX_ORDER; ++order) {
+        printk(" %lu", allocator->free_blocks[order]);
+    }
+
+    printk("\n  allocs %lu frees %lu splits %lu coalesces %lu failures %lu\n",
+        allocator->stats.allocs, allocator->stats.frees, allocator->stats.splits,
+        allocator->stats.coalesces, allocator->stats.failures);
+}
+
+static void __dump_latency(u8_t hist, const mm_latency_hist_t *latency) {
+    if (latency->samples == 0) {
+        printk("%s: no samples\n", __latency_names[hist]);
+        return;
+    }
+
+    printk("%s: %lu samples, avg %lu cycles, max %lu cycles\n", __latency_names[hist],
+        latency->samples, latency->total_cycles / latency->samples, latency->max_cycles);
+
+    for (u8_t bucket = 0; bucket < MM_LAT_BUCKETS; ++bucket) {
+        if (latency->buckets[bucket] > 0) {
+            printk("  >= 2^%u: %lu\n", bucket, latency->buckets[bucket]);
+        }
+    }
+}
+
+void mm_stats_dump() {
+    // The first printk on a CPU backs its arena with phys_alloc, take a snapshot so the dump doesn't measure itself.
+    mm_latency_hist_t latency[MM_LAT_NUM];
+    memcpy(latency, mm_latency_hists, sizeof(latency));
+
+    for (u8_t zone_idx = 0; zone_idx < PFA_NUM_ZONES; ++zone_idx) {
+        pfa_zone_t *zone = pfa_zone(zone_idx);
+
+        if (zone->start_addr >= zone->end_addr) {
+            continue;
+        }
+
+        printk("Zone %u (%p - %p)%s\n", zone_idx, zone->start_addr, zone->end_addr,
+            zone->under_pressure ? " under pressure" : "");
+        __dump_buddy(&zone->buddy);
+    }
+
+    printk("Slab caches:\n");
+    slab_info_dump();
+
+    printk("Allocation latency:\n");
+    for (u8_t hist = 0; hist < MM_LAT_NUM; ++hist) {
+        __dump_latency(hist, &latency[hist]);
+    }
+
+    if (heap_prof_enabled()) {
+        heap_prof_dump();
+    }
+}
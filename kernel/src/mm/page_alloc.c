@@ -1,14 +1,30 @@
 #include <types.h>
 
+#include <driver/vga.h>
+#include <mm/boot_mmap.h>
 #include <mm/page.h>
 #include <mm/page_alloc.h>
 #include <mm/buddy_alloc.h>
+#include <utility/strings.h>
 
 #include <cpu/atomic.h>
 
 
 volatile page_info_t *__freelist_head;
 
+pfa_zone_t __zones[PFA_NUM_ZONES];
+
+static pfa_shrinker_t __shrinkers[PFA_MAX_SHRINKERS];
+static u8_t __num_shrinkers = 0;
+
+// Set when an atomic allocation had to skip the shrinkers.
+static u8_t __shrink_deferred = 0;
+
+typedef struct {
+    phys_addr_t start;
+    phys_addr_t end;
+} _alloc_bounds_t;
+
 
 static void __init_general_pages(phys_addr_t buddy_start) {
     // Start at PAGE_SIZE, the first page of physical memory is ignored.
@@ -45,16 +61,426 @@ static void __init_general_pages(phys_addr_t buddy_start) {
 
 void page_alloc_init() {
     // Set up the upper mem buddy allocator (after kernel).
+    // The buddy allocator aligns its page offsets to MAX_ORDER blocks internally, so there's no need to skip
+    // ahead to the next MAX_ORDER boundary (which would waste up to 1GB).
     size_t buddy_start = last_kernel_page + PAGE_SIZE;
-    // Align with the next MAX ORDER block.
-    buddy_start = (buddy_start + MASK_FOR_FIRST_N_BITS(PAGE_ORDER + MAX_ORDER)) & (~MASK_FOR_FIRST_N_BITS(PAGE_ORDER + MAX_ORDER));
-
-    // TODO: Call the buddy allocator for this.
-    page_info_t *page = page_info(buddy_start);
 
+    // The buddy allocators are set up by pfa_init once virtual memory is available.
     __init_general_pages(buddy_start);
 }
 
+static void __find_allocatable_region(_alloc_bounds_t *bounds) {
+    physmem_region_t *region = load_physmem_regions();
+    // Get the first region after 1MB
+    while (region && region->free_start < 0x100000) {
+        region = region->next_region;
+    }
+
+    bounds->start = region->free_start;
+    
+    while (region->next_region != NULL) {
+        region = region->next_region;
+    }
+
+    bounds->end = region->region_end;
+}
+
+// Clamps the allocatable region to the range of a zone. Returns 0 if the zone is empty.
+static int __zone_bounds(u8_t zone_idx, const _alloc_bounds_t *bounds, _alloc_bounds_t *zone_bounds) {
+    if (zone_idx == PFA_ZONE_DMA) {
+        zone_bounds->start = MAX(bounds->start, DMA_ZONE_BEGIN);
+        zone_bounds->end = MIN(bounds->end, DMA_ZONE_END);
+    } else {
+        zone_bounds->start = MAX(bounds->start, DMA_ZONE_END);
+        zone_bounds->end = bounds->end;
+    }
+
+    return zone_bounds->start < zone_bounds->end;
+}
+
+// Reserve the buddy state bitmap of a zone from the boot memory regions.
+static void *__reserve_buddy_bitmap(_alloc_bounds_t *bounds) {
+    char buf[16];
+
+    size_t bitmap_pages = buddy_bitmap_pages(bounds->start, bounds->end);
+
+    kputs("Reserving ");
+    itoa(bitmap_pages, buf, 10);
+    kputs(buf);
+    kprintln(" pages for the buddy bitmap");
+
+    return KPHYS_ADDR(reserve_physmem_region(bitmap_pages));
+}
+
+static void __init_zone(pfa_zone_t *zone, void *bitmap_pool, _alloc_bounds_t *zone_bounds) {
+    zone->start_addr = zone_bounds->start;
+    zone->end_addr = zone_bounds->end;
+
+    buddy_init(&zone->buddy, bitmap_pool, zone_bounds->start, zone_bounds->end);
+
+    for (u32_t cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        pcp_init(&zone->pcp[cpu], &zone->buddy);
+    }
+
+    zone->watermark_low = (zone->buddy.free_space_bytes >> PAGE_ORDER) >> PFA_WATERMARK_LOW_SHIFT;
+    zone->watermark_high = zone->watermark_low << 1;
+    zone->watermark_min = zone->watermark_low >> 1;
+    zone->under_pressure = 0;
+}
+
+void pfa_init() {
+    kprintln("Initializing page frame allocator zones...");
+
+    _alloc_bounds_t bounds, zone_bounds;
+    void *bitmap_pools[PFA_NUM_ZONES];
+
+    __find_allocatable_region(&bounds);
+
+    for (u8_t zone_idx = 0; zone_idx < PFA_NUM_ZONES; ++zone_idx) {
+        if (__zone_bounds(zone_idx, &bounds, &zone_bounds)) {
+            bitmap_pools[zone_idx] = __reserve_buddy_bitmap(&zone_bounds);
+        }
+    }
+
+    // We need to recompute the allocatable region since the bitmap reservations changed what's available.
+    kprintln("Recomputing allocatable region");
+    __find_allocatable_region(&bounds);
+
+    for (u8_t zone_idx = 0; zone_idx < PFA_NUM_ZONES; ++zone_idx) {
+        pfa_zone_t *zone = &__zones[zone_idx];
+
+        if (__zone_bounds(zone_idx, &bounds, &zone_bounds)) {
+            kprintln("Initializing buddy allocator");
+            __init_zone(zone, bitmap_pools[zone_idx], &zone_bounds);
+        } else {
+            zone->start_addr = zone->end_addr = 0;
+        }
+    }
+}
+
+pfa_zone_t *pfa_zone(u8_t zone_idx) {
+    return &__zones[zone_idx];
+}
+
+static inline pfa_zone_t *__zone_of(phys_addr_t block_base) {
+    return block_base >= DMA_ZONE_END ? &__zones[PFA_ZONE_GENERAL] : &__zones[PFA_ZONE_DMA];
+}
+
+static inline size_t __zone_free_pages(pfa_zone_t *zone) {
+    return zone->buddy.free_space_bytes >> PAGE_ORDER;
+}
+
+static inline void __zone_update_pressure(pfa_zone_t *zone) {
+    size_t free_pages = __zone_free_pages(zone);
+
+    if (free_pages < zone->watermark_low) {
+        zone->under_pressure = 1;
+    } else if (free_pages >= zone->watermark_high) {
+        zone->under_pressure = 0;
+    }
+}
+
+static phys_addr_t __zone_alloc(pfa_zone_t *zone, u8_t order) {
+    if (zone->start_addr >= zone->end_addr) {
+        return NULL;
+    }
+
+    pcp_cache_t *pcp = &zone->pcp[cpu_id()];
+    phys_addr_t block_base;
+
+    if (order <= PCP_MAX_ORDER) {
+        // Fast path, the per-CPU cache only calls into the buddy allocator to refill.
+        block_base = pcp_alloc_block(pcp, order);
+    } else {
+        block_base = buddy_alloc_block(&zone->buddy, order);
+
+        if (block_base == NULL) {
+            // Blocks held by the per-CPU cache may be preventing a larger block from coalescing.
+            pcp_drain(pcp);
+            block_base = buddy_alloc_block(&zone->buddy, order);
+        }
+    }
+
+    __zone_update_pressure(zone);
+
+    return block_base;
+}
+
+void pfa_register_shrinker(pfa_shrinker_t shrinker) {
+    for (u8_t i = 0; i < __num_shrinkers; ++i) {
+        if (__shrinkers[i] == shrinker) {
+            return;
+        }
+    }
+
+    if (__num_shrinkers < PFA_MAX_SHRINKERS) {
+        __shrinkers[__num_shrinkers++] = shrinker;
+    }
+}
+
+size_t pfa_shrink() {
+    size_t released = 0;
+
+    for (u8_t i = 0; i < __num_shrinkers; ++i) {
+        released += __shrinkers[i]();
+    }
+
+    return released;
+}
+
+// Whether a general allocation of the given order may dig into the general zone below its low watermark.
+static inline u8_t __may_use_reserve(pfa_zone_t *zone, u8_t order, u8_t atomic) {
+    return atomic || __zone_free_pages(zone) >= zone->watermark_min + (1ul << order);
+}
+
+static phys_addr_t __general_alloc(u8_t order, u8_t atomic) {
+    pfa_zone_t *dma_zone = &__zones[PFA_ZONE_DMA];
+    pfa_zone_t *general_zone = &__zones[PFA_ZONE_GENERAL];
+    phys_addr_t block_base = NULL;
+
+    u8_t general_under_pressure = general_zone->under_pressure;
+
+    if (!general_under_pressure) {
+        block_base = __zone_alloc(general_zone, order);
+    }
+
+    // Spill into the DMA zone, but leave enough behind for devices that need DMA capable memory.
+    if (block_base == NULL && __zone_free_pages(dma_zone) >= dma_zone->watermark_high + (1ul << order)) {
+        block_base = __zone_alloc(dma_zone, order);
+    }
+
+    // Last resort, dig into the general zone's reserve.
+    if (block_base == NULL && general_under_pressure && __may_use_reserve(general_zone, order, atomic)) {
+        block_base = __zone_alloc(general_zone, order);
+    }
+
+    return block_base;
+}
+
+// Reclaim cached memory, or leave it to the next allocation which isn't atomic. Returns the number of pages released.
+static size_t __shrink(u8_t atomic) {
+    if (atomic) {
+        __shrink_deferred = 1;
+        return 0;
+    }
+
+    __shrink_deferred = 0;
+    return pfa_shrink();
+}
+
+phys_addr_t pfa_alloc_block(u8_t order, u8_t flags) {
+    pfa_zone_t *general_zone = &__zones[PFA_ZONE_GENERAL];
+    phys_addr_t block_base = NULL;
+    u8_t atomic = (flags & PFA_ATOMIC) || in_interrupt();
+    u64_t irq = irq_save();
+
+    if (unlikely(__shrink_deferred) && !atomic) {
+        __shrink(atomic);
+    }
+
+    if (flags & PFA_DMA) {
+        block_base = __zone_alloc(&__zones[PFA_ZONE_DMA], order);
+    } else {
+        u8_t was_under_pressure = general_zone->under_pressure;
+        block_base = __general_alloc(order, atomic);
+
+        // Reclaim cached memory as soon as the general zone comes under pressure, and once more before failing.
+        if (block_base == NULL) {
+            if (__shrink(atomic) > 0) {
+                block_base = __general_alloc(order, atomic);
+            }
+        } else if (!was_under_pressure && general_zone->under_pressure) {
+            __shrink(atomic);
+        }
+    }
+
+    if (block_base != NULL) {
+        // Remember the order of the block so that it can be freed by address alone.
+        page_info_t *page = page_info(block_base);
+        set_page_flags_atomic(page, PAGE_BUDDY);
+        page->buddy_alloc_info.block_base = page;
+        page->buddy_alloc_info.order = order;
+        page->buddy_alloc_info.num_pages = 1ul << order;
+    }
+
+    irq_restore(irq);
+    return block_base;
+}
+
+static size_t __zone_alloc_bulk(pfa_zone_t *zone, u8_t order, phys_addr_t *blocks, size_t count) {
+    if (count == 0 || zone->start_addr >= zone->end_addr) {
+        return 0;
+    }
+
+    // Batches go straight to the buddy allocator, the per-CPU cache would only add a copy per block.
+    size_t allocated = buddy_alloc_bulk(&zone->buddy, order, blocks, count);
+
+    if (allocated < count) {
+        pcp_drain(&zone->pcp[cpu_id()]);
+        allocated += buddy_alloc_bulk(&zone->buddy, order, blocks + allocated, count - allocated);
+    }
+
+    __zone_update_pressure(zone);
+
+    return allocated;
+}
+
+// Number of blocks of the given order that a general allocation may take from the DMA zone.
+static inline size_t __dma_spill_blocks(pfa_zone_t *dma_zone, u8_t order) {
+    size_t free_pages = __zone_free_pages(dma_zone);
+
+    if (free_pages <= dma_zone->watermark_high) {
+        return 0;
+    }
+
+    return (free_pages - dma_zone->watermark_high) >> order;
+}
+
+// Same zone policy as __general_alloc, applied to a whole batch at once.
+static size_t __general_alloc_bulk(u8_t order, u8_t atomic, phys_addr_t *blocks, size_t count) {
+    pfa_zone_t *dma_zone = &__zones[PFA_ZONE_DMA];
+    pfa_zone_t *general_zone = &__zones[PFA_ZONE_GENERAL];
+    size_t allocated = 0;
+
+    u8_t general_under_pressure = general_zone->under_pressure;
+
+    if (!general_under_pressure) {
+        allocated = __zone_alloc_bulk(general_zone, order, blocks, count);
+    }
+
+    if (allocated < count) {
+        size_t spill = MIN(count - allocated, __dma_spill_blocks(dma_zone, order));
+        allocated += __zone_alloc_bulk(dma_zone, order, blocks + allocated, spill);
+    }
+
+    if (allocated < count && general_under_pressure) {
+        size_t reserve = count - allocated;
+
+        if (!atomic) {
+            // Leave the pages below the min watermark to atomic allocations.
+            size_t free_pages = __zone_free_pages(general_zone);
+            reserve = free_pages > general_zone->watermark_min ?
+                MIN(reserve, (free_pages - general_zone->watermark_min) >> order) : 0;
+        }
+
+        allocated += __zone_alloc_bulk(general_zone, order, blocks + allocated, reserve);
+    }
+
+    return allocated;
+}
+
+size_t pfa_alloc_bulk(u8_t order, u8_t flags, phys_addr_t *blocks, size_t count) {
+    pfa_zone_t *general_zone = &__zones[PFA_ZONE_GENERAL];
+    size_t allocated = 0;
+    u8_t atomic = (flags & PFA_ATOMIC) || in_interrupt();
+
+    if (order > MAX_ORDER) {
+        return 0;
+    }
+
+    u64_t irq = irq_save();
+
+    if (unlikely(__shrink_deferred) && !atomic) {
+        __shrink(atomic);
+    }
+
+    if (flags & PFA_DMA) {
+        allocated = __zone_alloc_bulk(&__zones[PFA_ZONE_DMA], order, blocks, count);
+    } else {
+        u8_t was_under_pressure = general_zone->under_pressure;
+        allocated = __general_alloc_bulk(order, atomic, blocks, count);
+
+        // Like pfa_alloc_block, reclaim once before coming up short.
+        if (allocated < count) {
+            if (__shrink(atomic) > 0) {
+                allocated += __general_alloc_bulk(order, atomic, blocks + allocated, count - allocated);
+            }
+        } else if (!was_under_pressure && general_zone->under_pressure) {
+            __shrink(atomic);
+        }
+    }
+
+    for (size_t i = 0; i < allocated; ++i) {
+        page_info_t *page = page_info(blocks[i]);
+        set_page_flags_atomic(page, PAGE_BUDDY);
+        page->buddy_alloc_info.block_base = page;
+        page->buddy_alloc_info.order = order;
+        page->buddy_alloc_info.num_pages = 1ul << order;
+    }
+
+    irq_restore(irq);
+    return allocated;
+}
+
+void pfa_free_bulk(const phys_addr_t *blocks, size_t count, u8_t order) {
+    size_t run_start = 0;
+    u64_t irq = irq_save();
+
+    for (size_t i = 0; i < count; ++i) {
+        unset_page_flags_atomic(page_info(blocks[i]), PAGE_BUDDY);
+    }
+
+    // Free runs of blocks belonging to the same zone with a single call into its buddy allocator.
+    while (run_start < count) {
+        pfa_zone_t *zone = __zone_of(blocks[run_start]);
+        size_t run_end = run_start + 1;
+
+        while (run_end < count && __zone_of(blocks[run_end]) == zone) {
+            ++run_end;
+        }
+
+        buddy_free_bulk(&zone->buddy, blocks + run_start, run_end - run_start, order);
+        __zone_update_pressure(zone);
+
+        run_start = run_end;
+    }
+
+    irq_restore(irq);
+}
+
+void pfa_free_sized_block(phys_addr_t block_base, u8_t order) {
+    pfa_zone_t *zone = __zone_of(block_base);
+    u64_t irq = irq_save();
+
+    unset_page_flags_atomic(page_info(block_base), PAGE_BUDDY);
+
+    if (order <= PCP_MAX_ORDER) {
+        pcp_free_block(&zone->pcp[cpu_id()], block_base, order);
+    } else {
+        buddy_free_block(&zone->buddy, block_base, order);
+    }
+
+    __zone_update_pressure(zone);
+    irq_restore(irq);
+}
+
+void pfa_shrink_block(phys_addr_t block_base, u8_t order, size_t num_pages) {
+    pfa_zone_t *zone = __zone_of(block_base);
+    u64_t irq = irq_save();
+
+    buddy_shrink_block(&zone->buddy, block_base, order, num_pages);
+
+    // The block is now made up of one buddy block per bit set in num_pages, the largest of them at its base.
+    page_info_t *page = page_info(block_base);
+    page->buddy_alloc_info.order = 63 - __builtin_clzl(num_pages);
+    page->buddy_alloc_info.num_pages = num_pages;
+
+    __zone_update_pressure(zone);
+    irq_restore(irq);
+}
+
+void _pfa_free_block(phys_addr_t block_base) {
+    size_t num_pages = page_info(block_base)->buddy_alloc_info.num_pages;
+
+    // Free the buddy blocks of a shrunk block from the largest down, the same way pfa_shrink_block left them.
+    for (s8_t order = 63 - __builtin_clzl(num_pages); order >= 0; --order) {
+        if ((num_pages >> order) & 1) {
+            pfa_free_sized_block(block_base, order);
+            block_base += 1ul << (order + PAGE_ORDER);
+        }
+    }
+}
+
 // Allocate and free a single page from the general reserved region.
 phys_addr_t pfa_alloc_page() {
     // Lock free list removal. Since we're in the special case where we only add and remove blocks at the head of the linked list
@@ -0,0 +1,104 @@
+#include <mm/pcp.h>
+
+
+#define PCP_RING_MASK (PCP_HIGH - 1)
+
+
+static inline phys_addr_t __pop_hot(pcp_list_t *list) {
+    --list->count;
+    return list->blocks[(list->cold + list->count) & PCP_RING_MASK];
+}
+
+static inline void __push_hot(pcp_list_t *list, phys_addr_t block_base) {
+    list->blocks[(list->cold + list->count) & PCP_RING_MASK] = block_base;
+    ++list->count;
+}
+
+static inline phys_addr_t __pop_cold(pcp_list_t *list) {
+    phys_addr_t block_base = list->blocks[list->cold];
+
+    list->cold = (list->cold + 1) & PCP_RING_MASK;
+    --list->count;
+
+    return block_base;
+}
+
+static inline void __push_cold(pcp_list_t *list, phys_addr_t block_base) {
+    list->cold = (list->cold - 1) & PCP_RING_MASK;
+    list->blocks[list->cold] = block_base;
+    ++list->count;
+}
+
+static void __refill(pcp_cache_t *pcp, pcp_list_t *list, u8_t order) {
+    phys_addr_t batch[PCP_BATCH];
+    size_t num_blocks = buddy_alloc_bulk(pcp->allocator, order, batch, PCP_BATCH);
+
+    for (size_t i = 0; i < num_blocks; ++i) {
+        // Blocks coming from the buddy allocator haven't been touched by this CPU.
+        __push_cold(list, batch[i]);
+    }
+}
+
+static void __drain(pcp_cache_t *pcp, pcp_list_t *list, u8_t order, u16_t num_blocks) {
+    phys_addr_t batch[PCP_BATCH];
+
+    while (num_blocks > 0 && list->count > 0) {
+        u16_t batch_size = 0;
+
+        while (batch_size < PCP_BATCH && batch_size < num_blocks && list->count > 0) {
+            batch[batch_size++] = __pop_cold(list);
+        }
+
+        buddy_free_bulk(pcp->allocator, batch, batch_size, order);
+        num_blocks -= batch_size;
+    }
+}
+
+void pcp_init(pcp_cache_t *pcp, buddy_allocator_t *allocator) {
+    pcp->allocator = allocator;
+
+    for (u8_t order = 0; order <= PCP_MAX_ORDER; ++order) {
+        pcp->lists[order].cold = 0;
+        pcp->lists[order].count = 0;
+    }
+}
+
+phys_addr_t pcp_alloc_block(pcp_cache_t *pcp, u8_t order) {
+    pcp_list_t *list = &pcp->lists[order];
+
+    if (unlikely(list->count == 0)) {
+        __refill(pcp, list, order);
+
+        if (list->count == 0) {
+            return NULL;
+        }
+    }
+
+    return __pop_hot(list);
+}
+
+void pcp_free_block(pcp_cache_t *pcp, phys_addr_t block_base, u8_t order) {
+    pcp_list_t *list = &pcp->lists[order];
+
+    if (unlikely(list->count == PCP_HIGH)) {
+        __drain(pcp, list, order, PCP_BATCH);
+    }
+
+    __push_hot(list, block_base);
+}
+
+void pcp_free_block_cold(pcp_cache_t *pcp, phys_addr_t block_base, u8_t order) {
+    pcp_list_t *list = &pcp->lists[order];
+
+    if (unlikely(list->count == PCP_HIGH)) {
+        __drain(pcp, list, order, PCP_BATCH);
+    }
+
+    __push_cold(list, block_base);
+}
+
+void pcp_drain(pcp_cache_t *pcp) {
+    for (u8_t order = 0; order <= PCP_MAX_ORDER; ++order) {
+        __drain(pcp, &pcp->lists[order], order, PCP_HIGH);
+    }
+}
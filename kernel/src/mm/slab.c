@@ -1,173 +1,692 @@
 #include <mm.h>
 #include <mm/slab.h>
+#include <mm/page.h>
+#include <mm/phys_alloc.h>
 #include <mm/vm.h>
+#include <mm/mm_stats.h>
+#include <mm/heap_prof.h>
+#include <log.h>
 #include <utility/math.h>
+#include <utility/strings.h>
 
 
 // Remove a slab from its doubly linked list
-static inline void __unlink_slab(slab_t *slab, slab_t **list_head_ref) {
-    if (slab->header.prev != NULL) {
-        slab->header.prev->header.next = slab->header.next;
+static inline void __unlink_slab(slab_header_t *slab, slab_header_t **list_head_ref) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
     } else {
         // This slab was the head so mutate the list head to update it.
-        *list_head_ref = slab->header.next;
+        *list_head_ref = slab->next;
     }
 
-    if (slab->header.next != NULL) {
-        slab->header.next->header.prev = slab->header.prev;
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
     }
 }
 
 // Add a slab to the head of a doubly linked list
-static inline void __link_slab(slab_t *slab, slab_t **list_head) {
-    slab->header.next = *list_head;
-    slab->header.prev = NULL;
+static inline void __link_slab(slab_header_t *slab, slab_header_t **list_head) {
+    slab->next = *list_head;
+    slab->prev = NULL;
 
     if (*list_head != NULL) {
-        (*list_head)->header.prev = slab;
+        (*list_head)->prev = slab;
     }
 
     *list_head = slab;
 }
 
+// Caches visited by slab_reap.
+static kmem_cache_t *__registered_caches = NULL;
 
-void slab_cache_init(kmem_cache_t *cache, u16_t obj_size, u16_t obj_align, u16_t cache_id, u16_t vmzone) {
+// The caches handed out by kmem_cache_create are slab allocated themselves.
+static kmem_cache_t __cache_cache;
+static u8_t __cache_cache_ready = 0;
+
+// Bytes of each slab taken up by its header, including the padding needed to align the first object.
+static inline u16_t __header_bytes(const kmem_cache_t *cache) {
+    if (cache->flags & SLAB_CACHE_OFF_SLAB) {
+        return 0;
+    }
+
+    return (sizeof(slab_header_t) + cache->obj_align - 1) & ~(cache->obj_align - 1);
+}
+
+// Where a free object stores the pointer to the next free object of its slab.
+static inline slab_object_t **__free_link(const kmem_cache_t *cache, void *obj) {
+    return (slab_object_t **)((u8_t *)obj + cache->free_offset);
+}
+
+// The object area of a slab. On slab it follows the header, off slab it is the whole slab and is found from the
+// position of the header in the global page map, without reading anything.
+static inline u8_t *__slab_data(const kmem_cache_t *cache, slab_header_t *slab) {
+    if (cache->flags & SLAB_CACHE_OFF_SLAB) {
+        page_info_t *page = (page_info_t *)((u8_t *)slab - __builtin_offsetof(page_info_t, slab_header));
+        return KPHYS_ADDR(page_address_from_info(page));
+    }
+
+    return ((slab_t *)slab)->__slab_data;
+}
+
+// The header of the slab containing an object.
+static inline slab_header_t *__slab_header_of(const kmem_cache_t *cache, void *ptr) {
+    if (cache->flags & SLAB_CACHE_OFF_SLAB) {
+        return off_slab_header(ptr);
+    }
+
+    return &slab_of(ptr)->header;
+}
+
+
+// Pick the slab order for objects of the given cell size, see SLAB_MIN_OBJECTS.
+static u8_t __slab_order_for(u16_t cell_size, u16_t header_bytes) {
+    u8_t best_order = SLAB_ORDER;
+    size_t best_waste = SLAB_BYTES(SLAB_ORDER);
+
+    for (u8_t order = SLAB_ORDER; order <= SLAB_MAX_ORDER; ++order) {
+        size_t slab_bytes = SLAB_BYTES(order);
+        size_t objs = (slab_bytes - header_bytes) / cell_size;
+        size_t waste = slab_bytes - objs * cell_size;
+
+        if (objs >= SLAB_MIN_OBJECTS && waste * SLAB_WASTE_FRACTION <= slab_bytes) {
+            return order;
+        }
+
+        // Compare waste / slab_bytes against the best fraction so far.
+        if (waste * SLAB_BYTES(best_order) < best_waste * slab_bytes) {
+            best_order = order;
+            best_waste = waste;
+        }
+    }
+
+    return best_order;
+}
+
+static void __cache_init(
+    kmem_cache_t *cache,
+    u16_t obj_size,
+    u16_t obj_align,
+    u16_t cache_id,
+    u16_t vmzone,
+    u8_t flags,
+    slab_ctor_t ctor
+) {
+    cache->name = NULL;
+    cache->ctor = ctor;
+    cache->aliases = 0;
     cache->obj_size = obj_size;
-    cache->obj_cell_size = (obj_size + obj_align - 1) & ~(obj_align - 1);
+    cache->obj_align = obj_align;
+
+    // Constructed objects must keep their state while free, so their freelist link goes after the object.
+    cache->free_offset = ctor == NULL ? 0 : (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    u16_t cell_bytes = ctor == NULL ? obj_size : cache->free_offset + sizeof(void *);
+
+    cache->obj_cell_size = (cell_bytes + obj_align - 1) & ~(obj_align - 1);
     cache->allocated_objects = 0;
     cache->align_padding = cache->obj_cell_size - cache->obj_size;
     cache->total_free_slabs = 0;
     cache->total_free_objects = 0;
     cache->total_full_slabs = 0;
     cache->total_partial_slabs = 0;
+    cache->free_slabs_low = SLAB_FREE_LOW;
+    cache->free_slabs_high = SLAB_FREE_HIGH;
     cache->cache_id = cache_id;
     cache->vmzone = vmzone;
+    cache->flags = flags;
+
+    u16_t header_bytes = __header_bytes(cache);
+    cache->slab_order = __slab_order_for(cache->obj_cell_size, header_bytes);
+    cache->objs_per_slab = (SLAB_BYTES(cache->slab_order) - header_bytes) / cache->obj_cell_size;
+    cache->slab_overhead = SLAB_BYTES(cache->slab_order) - (cache->objs_per_slab * cache->obj_cell_size);
 
-    cache->objs_per_slab = (sizeof(slab_t) - sizeof(slab_header_t)) / cache->obj_cell_size;
-    cache->slab_overhead = sizeof(slab_t) - (cache->objs_per_slab * cache->obj_cell_size);
+    // Colours have to keep objects aligned.
+    cache->colour_align = MAX(obj_align, SLAB_COLOUR_ALIGN);
+    cache->colour_count = (cache->slab_overhead - header_bytes) / cache->colour_align + 1;
+    cache->colour_next = 0;
+    cache->colour_base = header_bytes == 0 ? 0 : header_bytes - sizeof(slab_header_t);
 
     cache->free_slabs = NULL;
     cache->full_slabs = NULL;
     cache->partial_slabs = NULL;
+
+    cache->pool = NULL;
+    cache->pool_count = 0;
+    cache->pool_target = 0;
+
+    memset(&cache->stats, 0, sizeof(slab_stats_t));
+}
+
+void slab_cache_init(kmem_cache_t *cache, u16_t obj_size, u16_t obj_align, u16_t cache_id, u16_t vmzone, u8_t flags) {
+    __cache_init(cache, obj_size, obj_align, cache_id, vmzone, flags, NULL);
 }
 
-static void __slab_init(const kmem_cache_t *const cache, slab_t *slab) {
-    // At initialization, the first free object will be at cell 0
-    slab->header.first_free_idx = 0;
-    slab->header.free_count = cache->objs_per_slab;
-    slab->header.cache_id = cache->cache_id;
+static void __slab_init(kmem_cache_t *const cache, slab_header_t *slab) {
+    u16_t colour = cache->colour_base + cache->colour_next * cache->colour_align;
+
+    if (++cache->colour_next == cache->colour_count) {
+        cache->colour_next = 0;
+    }
+
+    // At initialization, the first free object will be at cell 0, shifted by the colour of the slab.
+    slab->first_free_offset = colour;
+    slab->free_count = cache->objs_per_slab;
+    slab->cache_id = cache->cache_id;
+    slab->colour = colour;
+
+    slab_object_t *obj = (slab_object_t *)(__slab_data(cache, slab) + colour);
+
+    for (u16_t i = 0; i < cache->objs_per_slab; ++i) {
+        slab_object_t *next = i < cache->objs_per_slab - 1 ? (void*)obj + cache->obj_cell_size : NULL;
+
+        // Objects are only constructed once, when their slab is created.
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+
+        *__free_link(cache, obj) = next;
+        obj = next;
+    }
+}
+
+// Allocate the pages of an off-slab slab and mark them in the global page map. Returns the header in the page map of
+// the first page, or NULL if no memory is available.
+static slab_header_t *__off_slab_alloc(kmem_cache_t *const cache) {
+    size_t num_pages = 1ul << cache->slab_order;
+    phys_addr_t slab_base = phys_alloc(num_pages);
+    if (unlikely(slab_base == NULL)) {
+        return NULL;
+    }
 
-    slab_object_t *obj;
+    page_info_t *head = page_info(slab_base);
+    set_page_flags_atomic(head, PAGE_SLAB);
 
-    for (u16_t i = 0; i < cache->objs_per_slab - 1; ++i) {
-        obj = slab->__slab_data + i * cache->obj_cell_size;
-        obj->header.if_free.next_free = (void*)obj + cache->obj_cell_size;
-        obj = obj->header.if_free.next_free;
+    for (size_t i = 1; i < num_pages; ++i) {
+        set_page_flags_atomic(&head[i], PAGE_SLAB_TAIL);
+        head[i].slab_head = head;
     }
 
-    obj->header.if_free.next_free = NULL;
+    return &head->slab_header;
 }
 
-// Create a new slab of memory given some pages.
-static inline slab_t *__slab_create(const kmem_cache_t *const cache) {    
-    slab_t *new_slab = vm_alloc_block(VM_ALLOW_WRITE, VMZONE_KERNEL_SLAB);
+// Create a new slab of memory given some pages. Returns NULL if no memory is available.
+static inline slab_header_t *__slab_create(kmem_cache_t *const cache) {
+    slab_header_t *new_slab;
+
+    if (cache->flags & SLAB_CACHE_OFF_SLAB) {
+        new_slab = __off_slab_alloc(cache);
+    } else {
+        slab_t *slab = vm_alloc_block_pages(VM_ALLOW_WRITE, VMZONE_KERNEL_SLAB, 1 << cache->slab_order);
+        new_slab = slab == NULL ? NULL : &slab->header;
+    }
+
+    if (unlikely(new_slab == NULL)) {
+        return NULL;
+    }
+
     __slab_init(cache, new_slab);
+    ++cache->stats.grows;
     return new_slab;
 }
 
+// Give the memory of an empty slab back to the system.
+static void __slab_destroy(kmem_cache_t *const cache, slab_header_t *slab) {
+    if (cache->flags & SLAB_CACHE_OFF_SLAB) {
+        size_t num_pages = 1ul << cache->slab_order;
+        page_info_t *head = (page_info_t *)((u8_t *)slab - __builtin_offsetof(page_info_t, slab_header));
+
+        unset_page_flags_atomic(head, PAGE_SLAB);
+
+        for (size_t i = 1; i < num_pages; ++i) {
+            unset_page_flags_atomic(&head[i], PAGE_SLAB_TAIL);
+        }
+
+        phys_free(page_address_from_info(head), num_pages);
+    } else {
+        vm_free_block((virt_addr_t)slab, VMZONE_KERNEL_SLAB);
+    }
+}
+
+size_t slab_cache_shrink(kmem_cache_t *cache, u16_t keep_slabs) {
+    size_t released = 0;
+    u64_t irq = irq_save();
+
+    while (cache->total_free_slabs > keep_slabs) {
+        slab_header_t *slab = cache->free_slabs;
+        __unlink_slab(slab, &cache->free_slabs);
+
+        cache->total_free_slabs -= 1;
+        cache->total_free_objects -= cache->objs_per_slab;
+        ++cache->stats.shrinks;
+
+        __slab_destroy(cache, slab);
+        released += 1ul << cache->slab_order;
+    }
+
+    irq_restore(irq);
+    return released;
+}
+
+void slab_cache_register(kmem_cache_t *cache) {
+    for (kmem_cache_t *registered = __registered_caches; registered != NULL; registered = registered->next_cache) {
+        if (registered == cache) {
+            return;
+        }
+    }
+
+    cache->next_cache = __registered_caches;
+    __registered_caches = cache;
+}
+
+size_t slab_reap() {
+    size_t released = 0;
+
+    for (kmem_cache_t *cache = __registered_caches; cache != NULL; cache = cache->next_cache) {
+        released += slab_cache_shrink(cache, 0);
+    }
+
+    return released;
+}
+
 // Reserve enough slabs up front for the provided number of objects.
 void slab_cache_reserve(kmem_cache_t *cache, u16_t num_objects) {
     u16_t num_slabs = (num_objects + cache->objs_per_slab - 1) / cache->objs_per_slab;
 
     for (u16_t i = 0; i < num_slabs; ++i) {
         // Allocate a new slab of memory
-        slab_t *new_slab = __slab_create(cache);
+        slab_header_t *new_slab = __slab_create(cache);
+        if (new_slab == NULL) {
+            return;
+        }
+
         __link_slab(new_slab, &cache->free_slabs);
         cache->total_free_objects += cache->objs_per_slab;
+        cache->total_free_slabs += 1;
     }
-
-    cache->total_free_slabs += num_slabs;
 }
 
 void slab_cache_prealloc(kmem_cache_t *cache, void *pages, u8_t num_slabs) {
     for (u8_t i = 0; i < num_slabs; ++i) {
-        slab_t *slab = ((slab_t *)pages) + i;
-        __slab_init(cache, slab);
-        __link_slab(slab, &cache->free_slabs);
+        slab_t *slab = pages + i * SLAB_BLOCK_BYTES;
+        __slab_init(cache, &slab->header);
+        __link_slab(&slab->header, &cache->free_slabs);
         cache->total_free_objects += cache->objs_per_slab;
+        cache->total_free_slabs += 1;
     }
 }
 
-// Allocate an object.
-void *slab_alloc(kmem_cache_t *cache) {
-    slab_t *slab = cache->partial_slabs;
-    
+// The slab to allocate from, at the head of the partial list. A free slab is moved over if there's no partial slab,
+// and the cache grows if there's no free slab either and it may grow. Returns NULL if the cache can't grow.
+static inline slab_header_t *__slab_for_alloc(kmem_cache_t *cache, u8_t may_grow) {
+    slab_header_t *slab = cache->partial_slabs;
+
+    if (slab != NULL) {
+        return slab;
+    }
+
+    slab = cache->free_slabs;
+
     if (slab == NULL) {
-        slab = cache->free_slabs;
+        slab = may_grow ? __slab_create(cache) : NULL;
 
-        if (slab == NULL) {
-            slab = cache->partial_slabs = __slab_create(cache);
-            cache->total_partial_slabs += 1;
+        if (unlikely(slab == NULL)) {
+            return NULL;
+        }
+
+        cache->total_free_objects += cache->objs_per_slab;
+    } else {
+        // Remove the slab from the free_slabs
+        __unlink_slab(slab, &cache->free_slabs);
+        cache->total_free_slabs -= 1;
+    }
+
+    __link_slab(slab, &cache->partial_slabs);
+    cache->total_partial_slabs += 1;
+
+    return slab;
+}
+
+// Move a slab which ran out of objects from the partial list to the full list.
+static inline void __slab_filled(kmem_cache_t *cache, slab_header_t *slab) {
+    __unlink_slab(slab, &cache->partial_slabs);
+    __link_slab(slab, &cache->full_slabs);
+
+    cache->total_partial_slabs -= 1;
+    cache->total_full_slabs += 1;
+}
+
+// Move a slab to the right list after objects were returned to it, given its free count before they were.
+static inline void __slab_freed(kmem_cache_t *cache, slab_header_t *slab, u16_t prev_free_count) {
+    u8_t empty = slab->free_count == cache->objs_per_slab;
+
+    if (prev_free_count == 0) {
+        // The slab was full, so it moves to the partial list or straight to the free list.
+        __unlink_slab(slab, &cache->full_slabs);
+        cache->total_full_slabs -= 1;
+
+        if (empty) {
+            __link_slab(slab, &cache->free_slabs);
+            cache->total_free_slabs += 1;
         } else {
-            // Remove the slab from the free_slabs
-            __unlink_slab(slab, &cache->free_slabs);
             __link_slab(slab, &cache->partial_slabs);
-
-            cache->total_free_slabs -= 1;
             cache->total_partial_slabs += 1;
         }
+    } else if (empty) {
+        // The slab is now fully empty, we can move it to the free list.
+        __unlink_slab(slab, &cache->partial_slabs);
+        __link_slab(slab, &cache->free_slabs);
+
+        cache->total_partial_slabs -= 1;
+        cache->total_free_slabs += 1;
+    }
+}
+
+// Objects of the kmem_cache_create caches are profiled here, kmalloc profiles its own objects.
+static inline u8_t __profiled(kmem_cache_t *cache) {
+    return heap_prof_enabled() && cache->cache_id == KMEM_CACHE_ID;
+}
+
+// Take an object off the slab lists, growing the cache if allowed. Interrupts must be disabled.
+static inline slab_object_t *__slab_take(kmem_cache_t *cache, u8_t may_grow) {
+    slab_header_t *slab = __slab_for_alloc(cache, may_grow);
 
-        slab->header.prev = NULL;
-        slab->header.next = NULL;
+    if (unlikely(slab == NULL)) {
+        return NULL;
     }
 
-    slab_object_t *obj = slab->__slab_data + slab->header.first_free_idx * cache->obj_cell_size;
-    slab->header.first_free_idx = ((u8_t*)obj->header.if_free.next_free - slab->__slab_data) / cache->obj_cell_size;
-    slab->header.free_count -= 1;
+    u8_t *data = __slab_data(cache, slab);
+    slab_object_t *obj = (slab_object_t *)(data + slab->first_free_offset);
+    slab->first_free_offset = (u8_t*)*__free_link(cache, obj) - data;
+    slab->free_count -= 1;
 
-    if (slab->header.free_count == 0) {
+    if (slab->free_count == 0) {
         // Slab is full add it to full slabs
-        __unlink_slab(slab, &cache->partial_slabs);
-        __link_slab(slab, &cache->full_slabs);
-
-        cache->total_partial_slabs -= 1;
-        cache->total_full_slabs += 1;
+        __slab_filled(cache, slab);
     }
 
     ++cache->allocated_objects;
     --cache->total_free_objects;
+
+    return obj;
+}
+
+// Top up the emergency pool, outside of interrupt handlers. Interrupts must be disabled.
+static void __pool_refill(kmem_cache_t *cache) {
+    while (cache->pool_count < cache->pool_target) {
+        slab_object_t *obj = __slab_take(cache, 1);
+
+        if (obj == NULL) {
+            return;
+        }
+
+        *__free_link(cache, obj) = cache->pool;
+        cache->pool = obj;
+        ++cache->pool_count;
+    }
+}
+
+static inline slab_object_t *__pool_take(kmem_cache_t *cache) {
+    slab_object_t *obj = cache->pool;
+
+    if (obj != NULL) {
+        cache->pool = *__free_link(cache, obj);
+        --cache->pool_count;
+        ++cache->stats.pool_allocs;
+    }
+
+    return obj;
+}
+
+void slab_cache_set_pool(kmem_cache_t *cache, u16_t num_objects) {
+    u64_t irq = irq_save();
+    cache->pool_target = num_objects;
+
+    __pool_refill(cache);
+
+    while (cache->pool_count > num_objects) {
+        slab_object_t *obj = cache->pool;
+        cache->pool = *__free_link(cache, obj);
+        --cache->pool_count;
+
+        irq_restore(irq);
+        slab_free(cache, obj);
+        irq = irq_save();
+    }
+
+    irq_restore(irq);
+}
+
+static inline void *__slab_alloc(kmem_cache_t *cache, u8_t flags, void *site) {
+    u64_t start = mm_stats_begin();
+    u8_t atomic = mm_atomic(flags);
+    u64_t irq = irq_save();
+
+    if (unlikely(!atomic && cache->pool_count < cache->pool_target)) {
+        __pool_refill(cache);
+    }
+
+    // Atomic allocations never grow the cache, so they don't map memory and take a bounded amount of time.
+    slab_object_t *obj = __slab_take(cache, !atomic);
+
+    if (unlikely(obj == NULL && atomic)) {
+        obj = __pool_take(cache);
+    }
+
+    if (unlikely(obj == NULL)) {
+        ++cache->stats.failures;
+    } else {
+        ++cache->stats.allocs;
+    }
+
+    irq_restore(irq);
+    mm_stats_end(MM_LAT_SLAB_ALLOC, start);
+
+    if (__profiled(cache)) {
+        heap_prof_alloc(obj, cache->obj_cell_size, site);
+    }
+
     return obj;
 }
 
+// Allocate an object.
+void *slab_alloc(kmem_cache_t *cache) {
+    return __slab_alloc(cache, MM_NORMAL, __builtin_return_address(0));
+}
+
+void *slab_alloc_flags(kmem_cache_t *cache, u8_t flags) {
+    return __slab_alloc(cache, flags, __builtin_return_address(0));
+}
+
+size_t slab_alloc_bulk(kmem_cache_t *cache, void **objs, size_t count) {
+    size_t allocated = 0;
+    u8_t may_grow = !in_interrupt();
+    u64_t irq = irq_save();
+
+    while (allocated < count) {
+        slab_header_t *slab = __slab_for_alloc(cache, may_grow);
+
+        if (unlikely(slab == NULL)) {
+            ++cache->stats.failures;
+            break;
+        }
+
+        // Take as many objects as possible off the freelist of the slab before touching its header again.
+        u8_t *data = __slab_data(cache, slab);
+        u16_t take = MIN(count - allocated, slab->free_count);
+        slab_object_t *obj = (slab_object_t *)(data + slab->first_free_offset);
+
+        for (u16_t i = 0; i < take; ++i) {
+            objs[allocated++] = obj;
+            obj = *__free_link(cache, obj);
+        }
+
+        slab->free_count -= take;
+
+        if (slab->free_count == 0) {
+            __slab_filled(cache, slab);
+        } else {
+            slab->first_free_offset = (u8_t*)obj - data;
+        }
+    }
+
+    cache->allocated_objects += allocated;
+    cache->total_free_objects -= allocated;
+    cache->stats.allocs += allocated;
+
+    irq_restore(irq);
+
+    if (__profiled(cache)) {
+        for (size_t i = 0; i < allocated; ++i) {
+            heap_prof_alloc(objs[i], cache->obj_cell_size, __builtin_return_address(0));
+        }
+    }
+
+    return allocated;
+}
+
 // Free an object.
 void *slab_free(kmem_cache_t *cache, void *ptr) {
-    // Find the slab by rounding down
-    slab_t *slab = (slab_t *)aligndown(ptr, SLAB_ORDER + 12);
+    if (__profiled(cache)) {
+        heap_prof_free(ptr);
+    }
+
+    u64_t irq = irq_save();
+
+    // Find the slab by rounding down, or through the page map
+    slab_header_t *slab = __slab_header_of(cache, ptr);
+    u8_t *data = __slab_data(cache, slab);
+    u16_t prev_free_count = slab->free_count;
 
     // Free the object by settings its next free pointer to the next free object, and then setting
-    // the next free in the header of the slab to its index.
-    ((slab_object_t*)ptr)->header.if_free.next_free = slab->header.free_count == 0 ? 
+    // the next free in the header of the slab to its offset.
+    *__free_link(cache, ptr) = prev_free_count == 0 ? 
         NULL :
-        // Add first_free_idx * the cell size to the base of the object memory.
-        slab->__slab_data + slab->header.first_free_idx * cache->obj_cell_size;
-    slab->header.first_free_idx = ((u8_t*)ptr - slab->__slab_data) / cache->obj_cell_size;
+        (slab_object_t *)(data + slab->first_free_offset);
+    slab->first_free_offset = (u8_t*)ptr - data;
+    slab->free_count += 1;
 
-    if (!(slab->header.free_count++)) {
-        // The slab was full then we freed some objects, so now we must move the object to the partial list.
-        __unlink_slab(slab, &cache->full_slabs);
-        __link_slab(slab, &cache->partial_slabs);
+    __slab_freed(cache, slab, prev_free_count);
 
-        cache->total_full_slabs -= 1;
-        cache->total_partial_slabs += 1;
-    } else if (slab->header.free_count == cache->objs_per_slab) {
-        // The slab is now fully empty, we can move it to the free list.
-        __unlink_slab(slab, &cache->partial_slabs);
-        __link_slab(slab, &cache->free_slabs);
+    cache->allocated_objects -= 1;
+    cache->total_free_objects += 1;
+    ++cache->stats.frees;
 
-        cache->total_full_slabs -= 1;
-        cache->total_partial_slabs += 1;
+    irq_restore(irq);
+
+    // Unmapping slabs isn't bounded, interrupt handlers leave it to the next free outside of one.
+    if (cache->total_free_slabs > cache->free_slabs_high && !in_interrupt()) {
+        slab_cache_shrink(cache, cache->free_slabs_low);
     }
+}
 
-    cache->allocated_objects -= 1;
-    cache->total_free_objects += 1;
+void slab_free_bulk(kmem_cache_t *cache, void **objs, size_t count) {
+    size_t i = 0;
+
+    if (__profiled(cache)) {
+        for (size_t j = 0; j < count; ++j) {
+            heap_prof_free(objs[j]);
+        }
+    }
+
+    u64_t irq = irq_save();
+
+    while (i < count) {
+        slab_header_t *slab = __slab_header_of(cache, objs[i]);
+        u8_t *data = __slab_data(cache, slab);
+        u16_t prev_free_count = slab->free_count;
+
+        // Push the run of objects belonging to this slab onto its freelist, then update its header once.
+        slab_object_t *next_free = prev_free_count == 0 ? NULL : (slab_object_t *)(data + slab->first_free_offset);
+        u16_t freed = 0;
+
+        do {
+            slab_object_t *obj = objs[i++];
+            *__free_link(cache, obj) = next_free;
+            next_free = obj;
+            ++freed;
+        } while (i < count && __slab_header_of(cache, objs[i]) == slab);
+
+        slab->first_free_offset = (u8_t*)next_free - data;
+        slab->free_count += freed;
+
+        __slab_freed(cache, slab, prev_free_count);
+    }
+
+    cache->allocated_objects -= count;
+    cache->total_free_objects += count;
+    cache->stats.frees += count;
+
+    irq_restore(irq);
+
+    if (cache->total_free_slabs > cache->free_slabs_high && !in_interrupt()) {
+        slab_cache_shrink(cache, cache->free_slabs_low);
+    }
+}
+
+// A registered cache which kmem_cache_create can hand out instead of creating a new one, or NULL. Only caches created
+// by kmem_cache_create are merged, so that their objects stay apart from kmalloc's in the heap profile.
+static kmem_cache_t *__find_mergeable(u16_t obj_size, u16_t obj_align) {
+    u16_t cell_size = (obj_size + obj_align - 1) & ~(obj_align - 1);
+
+    for (kmem_cache_t *cache = __registered_caches; cache != NULL; cache = cache->next_cache) {
+        if (cache->cache_id == KMEM_CACHE_ID && cache->ctor == NULL && cache->flags == 0 && cache->obj_cell_size == cell_size &&
+            cache->obj_align >= obj_align) {
+            return cache;
+        }
+    }
+
+    return NULL;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, u16_t size, u16_t align, slab_ctor_t ctor) {
+    // Free objects hold a freelist link, so they're at least pointer aligned.
+    align = MAX(next_power_of_two(align), sizeof(void *));
+
+    // Caches without constructors are interchangeable as long as their objects are laid out the same way.
+    if (ctor == NULL) {
+        kmem_cache_t *merged = __find_mergeable(size, align);
+
+        if (merged != NULL) {
+            ++merged->aliases;
+            return merged;
+        }
+    }
+
+    if (!__cache_cache_ready) {
+        slab_cache_init(&__cache_cache, sizeof(kmem_cache_t), _Alignof(kmem_cache_t), KMEM_CACHE_ID, VMZONE_KERNEL_SLAB, 0);
+        __cache_cache.name = "kmem_cache";
+        slab_cache_register(&__cache_cache);
+        __cache_cache_ready = 1;
+    }
+
+    kmem_cache_t *cache = slab_alloc(&__cache_cache);
+    if (unlikely(cache == NULL)) {
+        return NULL;
+    }
+
+    __cache_init(cache, size, align, KMEM_CACHE_ID, VMZONE_KERNEL_SLAB, 0, ctor);
+    cache->name = name;
+    slab_cache_register(cache);
+
+    return cache;
+}
+
+void slab_info_dump() {
+    printk("name: active/total objects, size, free/partial/full slabs, pages, wasted bytes\n");
+
+    for (kmem_cache_t *cache = __registered_caches; cache != NULL; cache = cache->next_cache) {
+        u32_t slabs = cache->total_free_slabs + cache->total_partial_slabs + cache->total_full_slabs;
+        u32_t total_objects = cache->allocated_objects + cache->total_free_objects;
+        size_t pages = (size_t)slabs << cache->slab_order;
+        size_t waste = (pages << PAGE_ORDER) - (size_t)cache->allocated_objects * cache->obj_size;
+
+        printk("%s: %u/%u, %u bytes, %u/%u/%u, %lu, %lu",
+            cache->name == NULL ? "unnamed" : cache->name, cache->allocated_objects, total_objects, cache->obj_size,
+            cache->total_free_slabs, cache->total_partial_slabs, cache->total_full_slabs, pages, waste);
+
+        if (cache->aliases > 0) {
+            printk(" (%u aliases)", cache->aliases);
+        }
+
+        printk("\n");
+    }
 }
@@ -0,0 +1,264 @@
+#include <mm.h>
+#include <mm/tlsf.h>
+#include <mm/vm.h>
+#include <mm/mm_stats.h>
+#include <utility/math.h>
+#include <utility/strings.h>
+
+#define BLOCK_FREE 1ul
+
+// The smallest block has room for the free list links.
+#define MIN_BLOCK_SIZE (sizeof(tlsf_block_t) - TLSF_BLOCK_HEADER)
+
+
+static inline size_t __block_size(tlsf_block_t *block) {
+    return block->size & ~BLOCK_FREE;
+}
+
+static inline u8_t __block_free(tlsf_block_t *block) {
+    return block->size & BLOCK_FREE;
+}
+
+static inline void *__block_ptr(tlsf_block_t *block) {
+    return (u8_t*)block + TLSF_BLOCK_HEADER;
+}
+
+static inline tlsf_block_t *__ptr_block(void *ptr) {
+    return (tlsf_block_t*)((u8_t*)ptr - TLSF_BLOCK_HEADER);
+}
+
+static inline tlsf_block_t *__block_next(tlsf_block_t *block) {
+    return (tlsf_block_t*)((u8_t*)__block_ptr(block) + __block_size(block));
+}
+
+static inline u8_t __msb(size_t x) {
+    return 63 - clz64(x);
+}
+
+// The list a free block of size bytes belongs to.
+static inline void __mapping(size_t size, u8_t *fl, u8_t *sl) {
+    if (size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size >> TLSF_ALIGN_ORDER;
+    } else {
+        u8_t msb = __msb(size);
+
+        *fl = msb - (TLSF_SL_ORDER + TLSF_ALIGN_ORDER) + 1;
+        *sl = (size >> (msb - TLSF_SL_ORDER)) ^ TLSF_SL_COUNT;
+    }
+}
+
+// The first list whose blocks are all at least size bytes. Rounds size up to the next list boundary, which is what
+// spares tlsf_alloc from walking a list.
+static inline void __mapping_search(size_t size, u8_t *fl, u8_t *sl) {
+    if (size >= TLSF_SMALL_BLOCK) {
+        size += MASK_FOR_FIRST_N_BITS(__msb(size) - TLSF_SL_ORDER);
+    }
+
+    __mapping(size, fl, sl);
+}
+
+static void __insert_block(tlsf_t *tlsf, tlsf_block_t *block) {
+    u8_t fl, sl;
+    __mapping(__block_size(block), &fl, &sl);
+
+    tlsf_block_t *head = tlsf->free[fl][sl];
+
+    block->next_free = head;
+    block->prev_free = NULL;
+
+    if (head != NULL) {
+        head->prev_free = block;
+    }
+
+    tlsf->free[fl][sl] = block;
+    tlsf->fl_bitmap |= 1u << fl;
+    tlsf->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void __remove_block(tlsf_t *tlsf, tlsf_block_t *block) {
+    u8_t fl, sl;
+    __mapping(__block_size(block), &fl, &sl);
+
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        tlsf->free[fl][sl] = block->next_free;
+
+        if (block->next_free == NULL) {
+            tlsf->sl_bitmap[fl] &= ~(1u << sl);
+
+            if (tlsf->sl_bitmap[fl] == 0) {
+                tlsf->fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+}
+
+// A free block of at least size bytes, or NULL if there's none.
+static tlsf_block_t *__find_block(tlsf_t *tlsf, size_t size) {
+    u8_t fl, sl;
+    __mapping_search(size, &fl, &sl);
+
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+
+    u32_t sl_map = tlsf->sl_bitmap[fl] & (~0u << sl);
+
+    if (sl_map == 0) {
+        // Nothing left in this range, take the smallest block of the next non empty one.
+        u32_t fl_map = fl + 1 < TLSF_FL_COUNT ? tlsf->fl_bitmap & (~0u << (fl + 1)) : 0;
+
+        if (fl_map == 0) {
+            return NULL;
+        }
+
+        fl = ctz64(fl_map);
+        sl_map = tlsf->sl_bitmap[fl];
+    }
+
+    return tlsf->free[fl][ctz64(sl_map)];
+}
+
+int tlsf_init(tlsf_t *tlsf, void *mem, size_t bytes) {
+    memset(tlsf, 0, sizeof(tlsf_t));
+
+    u8_t *start = (u8_t*)(((size_t)mem + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1));
+    u8_t *end = (u8_t*)(((size_t)mem + bytes) & ~(TLSF_ALIGN - 1));
+
+    // Room for the first block and the sentinel which stops merges at the end of the pool.
+    if (end < start || (size_t)(end - start) < 2 * TLSF_BLOCK_HEADER + MIN_BLOCK_SIZE) {
+        return -1;
+    }
+
+    size_t size = MIN((size_t)(end - start) - 2 * TLSF_BLOCK_HEADER, (1ul << TLSF_FL_MAX_ORDER) - TLSF_ALIGN);
+
+    tlsf_block_t *block = (tlsf_block_t*)start;
+    block->prev_phys = NULL;
+    block->size = size;
+
+    tlsf_block_t *sentinel = __block_next(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+
+    block->size |= BLOCK_FREE;
+    __insert_block(tlsf, block);
+
+    return 0;
+}
+
+int tlsf_create(tlsf_t *tlsf, size_t pages) {
+    void *pool = vmalloc(pages, VM_ALLOW_WRITE);
+
+    if (pool == NULL) {
+        return -1;
+    }
+
+    if (tlsf_init(tlsf, pool, pages << PAGE_ORDER) != 0) {
+        vfree(pool, pages);
+        return -1;
+    }
+
+    tlsf->pool = pool;
+    tlsf->pool_pages = pages;
+    return 0;
+}
+
+void tlsf_destroy(tlsf_t *tlsf) {
+    if (tlsf->pool != NULL) {
+        vfree(tlsf->pool, tlsf->pool_pages);
+    }
+
+    memset(tlsf, 0, sizeof(tlsf_t));
+}
+
+void *tlsf_alloc(tlsf_t *tlsf, size_t size) {
+    if (size == 0 || size > TLSF_MAX_ALLOC) {
+        return NULL;
+    }
+
+    u64_t start = mm_stats_begin();
+    size_t aligned = (size + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1);
+    size = MAX(aligned, MIN_BLOCK_SIZE);
+
+    u64_t rflags = irq_save();
+    tlsf_block_t *block = __find_block(tlsf, size);
+
+    if (block == NULL) {
+        ++tlsf->failures;
+        irq_restore(rflags);
+        return NULL;
+    }
+
+    __remove_block(tlsf, block);
+
+    // Split off the tail if it's large enough to be a block of its own.
+    size_t block_size = __block_size(block);
+
+    if (block_size >= size + TLSF_BLOCK_HEADER + MIN_BLOCK_SIZE) {
+        tlsf_block_t *rest = (tlsf_block_t*)((u8_t*)__block_ptr(block) + size);
+
+        rest->prev_phys = block;
+        rest->size = block_size - size - TLSF_BLOCK_HEADER;
+        __block_next(rest)->prev_phys = rest;
+
+        rest->size |= BLOCK_FREE;
+        __insert_block(tlsf, rest);
+
+        block_size = size;
+    }
+
+    block->size = block_size;
+    tlsf->used_bytes += block_size;
+    ++tlsf->allocs;
+
+    irq_restore(rflags);
+    mm_stats_end(MM_LAT_TLSF_ALLOC, start);
+    return __block_ptr(block);
+}
+
+void tlsf_free(tlsf_t *tlsf, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    tlsf_block_t *block = __ptr_block(ptr);
+
+    u64_t rflags = irq_save();
+
+    tlsf->used_bytes -= __block_size(block);
+    ++tlsf->frees;
+
+    // Merge with the free neighbours, there's at most one on each side since free blocks are always merged.
+    tlsf_block_t *prev = block->prev_phys;
+
+    if (prev != NULL && __block_free(prev)) {
+        __remove_block(tlsf, prev);
+        prev->size = __block_size(prev) + TLSF_BLOCK_HEADER + __block_size(block);
+        block = prev;
+    }
+
+    tlsf_block_t *next = __block_next(block);
+
+    if (__block_free(next)) {
+        __remove_block(tlsf, next);
+        block->size = __block_size(block) + TLSF_BLOCK_HEADER + __block_size(next);
+        next = __block_next(block);
+    }
+
+    next->prev_phys = block;
+
+    block->size |= BLOCK_FREE;
+    __insert_block(tlsf, block);
+
+    irq_restore(rflags);
+}
+
+size_t tlsf_size(void *ptr) {
+    return __block_size(__ptr_block(ptr));
+}
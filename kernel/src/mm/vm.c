@@ -4,10 +4,20 @@
 #include <mm/vm.h>
 #include <mm/vmzone.h>
 #include <mm/phys_alloc.h>
+#include <mm/mm_stats.h>
+#include <mm/bitmap.h>
+#include <cpu/irq.h>
 
 #define PAGE_ADDRESS_MASK ((MASK_FOR_FIRST_N_BITS(40)) << 12)
 #define MASK_UNRESERVED_BITS (~(PAGE_ADDRESS_MASK | (1ul << 63) | MASK_FOR_FIRST_N_BITS(9)))
 
+#define VMALLOC_GRANULES (((size_t)VMZONE_VMALLOC_GB << 30) >> (VMALLOC_GRANULE_ORDER + PAGE_ORDER))
+
+// Granules of the vmalloc zone which are in use.
+static u64_t __vmalloc_words[VMALLOC_GRANULES >> BMP_WORD_ORDER];
+static bitmap_t __vmalloc_map;
+static u8_t __vmalloc_ready = 0;
+
 void vm_init()
 {
     vmzone_init();
@@ -17,19 +27,9 @@ void vm_init()
     vmspace_init(pml4t, VM_ALLOC_EARLY);
 }
 
-phys_addr_t _alloc_page_tables(u8_t num_pages, u8_t flags)
+// Zero out freshly allocated page tables and store the metadata about their allocation.
+static void __init_page_tables(phys_addr_t alloc_base, u8_t num_pages, u8_t flags)
 {
-    phys_addr_t alloc_base;
-
-    if (flags & VM_ALLOC_EARLY)
-    {
-        alloc_base = reserve_physmem_region(num_pages);
-    }
-    else
-    {
-        alloc_base = phys_alloc(num_pages);
-    }
-
     page_table_t *page_tables = KPHYS_ADDR(alloc_base);
     memset(page_tables, 0, num_pages << PAGE_ORDER);
 
@@ -59,6 +59,27 @@ phys_addr_t _alloc_page_tables(u8_t num_pages, u8_t flags)
 
         page_tables[i].entries[0] = first_entry;
     }
+}
+
+phys_addr_t _alloc_page_tables(u8_t num_pages, u8_t flags)
+{
+    phys_addr_t alloc_base;
+
+    if (flags & VM_ALLOC_EARLY)
+    {
+        alloc_base = reserve_physmem_region(num_pages);
+    }
+    else
+    {
+        alloc_base = phys_alloc(num_pages);
+    }
+
+    if (alloc_base == NULL)
+    {
+        return NULL;
+    }
+
+    __init_page_tables(alloc_base, num_pages, flags);
 
     return alloc_base;
 }
@@ -177,6 +198,7 @@ static page_table_t *__traverse_with_status(
 }
 
 // Finds the page table for the provided virtual address and allocates any missing pages tables along the way.
+// If they can't all be allocated none are linked in, and NULL is returned with ERR_VM_NO_MEMORY.
 static page_table_t *__find_or_allocate_pt(
     page_table_t *pml4t,
     virt_addr_t virt_addr,
@@ -191,9 +213,40 @@ static page_table_t *__find_or_allocate_pt(
     page_table_t *pt_or_parent = __traverse_with_status(pml4t, virt_addr, flags, &height, &traversal_error);
 
     if (traversal_error == ERR_VM_UNMAPPED) {
+        // Every missing level needs a page table, grab them in a single batch.
+        phys_addr_t new_page_tables[3];
+        u8_t num_tables = height;
+        size_t num_batched = 0;
+
+        if (!(flags & VM_ALLOC_EARLY)) {
+            num_batched = phys_alloc_bulk(0, new_page_tables, num_tables);
+
+            for (size_t i = 0; i < num_batched; ++i) {
+                __init_page_tables(new_page_tables[i], 1, flags);
+            }
+        }
+
+        for (size_t i = num_batched; i < num_tables; ++i) {
+            new_page_tables[i] = _alloc_page_tables(1, flags);
+
+            if (unlikely(new_page_tables[i] == NULL)) {
+                // Nothing is linked in yet, give back the tables we got. Early allocations can't be given back.
+                if (!(flags & VM_ALLOC_EARLY)) {
+                    phys_free_bulk(new_page_tables, num_batched, 0);
+
+                    for (size_t j = num_batched; j < i; ++j) {
+                        phys_free(new_page_tables[j], 1);
+                    }
+                }
+
+                *error = ERR_VM_NO_MEMORY;
+                return NULL;
+            }
+        }
+
         while (height > 0) {
             size_t offset = height_offset(virt_addr, height);
-            phys_addr_t new_page_table = _alloc_page_tables(1, flags);
+            phys_addr_t new_page_table = new_page_tables[num_tables - height];
             ++(*allocated_pages);
             __map_phys_page(pt_or_parent, offset, new_page_table, flags);
 
@@ -384,8 +437,18 @@ virt_addr_t vmzone_extend(u8_t pages, u8_t flags, u16_t vmzone) {
     int allocated_pages;
     page_table_t *pt = __find_or_allocate_pt(pml4t, cursor, flags, &err, &allocated_pages);
 
+    if (unlikely(pt == NULL)) {
+        return NULL;
+    }
+
     // Allocate a block of the current order
-    phys_addr_t phys_block = __alloc_phys_block(pages, flags);
+    phys_addr_t phys_base = __alloc_phys_block(pages, flags);
+
+    if (unlikely(phys_base == NULL)) {
+        return NULL;
+    }
+
+    phys_addr_t phys_block = phys_base;
     size_t next_pt_offset = pt_offset(cursor);
 
     for (size_t i = 0; i < pages; ++i) {
@@ -395,9 +458,25 @@ virt_addr_t vmzone_extend(u8_t pages, u8_t flags, u16_t vmzone) {
         phys_block += 1ul << PAGE_ORDER;
         cursor += 1ul << PAGE_ORDER;
 
-        if (next_pt_offset >= 512) {
+        if (next_pt_offset >= 512 && i + 1 < pages) {
             // We've crossed a pt boundary, allocate another page table.
-            pt = __find_or_allocate_pt(pml4t, cursor, flags, &err, &allocated_pages);
+            page_table_t *next_pt = __find_or_allocate_pt(pml4t, cursor, flags, &err, &allocated_pages);
+
+            if (unlikely(next_pt == NULL)) {
+                // Fewer than 512 pages are mapped, so they're all at the end of this pt.
+                for (size_t offset = pt_offset(zone->cursor_addr); offset < 512; ++offset) {
+                    pt->entries[offset] &= ~PT_PRESENT;
+                    flush_tlb(cursor - ((512 - offset) << PAGE_ORDER));
+                }
+
+                if (!(flags & VM_ALLOC_EARLY)) {
+                    phys_free(phys_base, pages);
+                }
+
+                return NULL;
+            }
+
+            pt = next_pt;
             next_pt_offset = 0;
         }
     }
@@ -498,9 +577,11 @@ void _prepare_block_pt(const vmzone_t * info, virt_addr_t base_pt_addr, page_tab
     }
 }
 
-// Allocate a block in a VMZFLAG_ALLOC_BLOCK virtual memory zone.
+// Allocate a block in a VMZFLAG_ALLOC_BLOCK virtual memory zone, only backing the first num_pages pages.
+// Can be mocked in tests
 __attribute__((weak))
-virt_addr_t vm_alloc_block(u8_t flags, u16_t vmzone) {
+virt_addr_t vm_alloc_block_pages(u8_t flags, u16_t vmzone, u8_t num_pages) {
+    u64_t start = mm_stats_begin();
     page_table_t *pml4t = KPHYS_ADDR(read_cr3());
 
     // Check the cursor address of the zone which points to the first available block.
@@ -513,30 +594,47 @@ virt_addr_t vm_alloc_block(u8_t flags, u16_t vmzone) {
 
     page_table_t *pt = __find_or_allocate_pt(pml4t, block_addr, flags, &error, &allocated_pages);
 
+    if (unlikely(error != 0 || pt == NULL)) {
+        return NULL;
+    }
+
     if (allocated_pages > 0) {
         _prepare_block_pt(zone, block_pt_offset, pt);
     }
 
+    phys_addr_t block_base = __alloc_phys_block(num_pages, flags);
+
+    if (unlikely(block_base == NULL)) {
+        // The cursor hasn't moved yet, the block stays first in line for the next allocation.
+        return NULL;
+    }
+
     pt_entry_t entry = pt->entries[block_pt_offset];
 
     zone->cursor_addr = next_free_entry(entry, block_addr);
-    
-    size_t alloc_size = 1ul << zone->block_order;
-    phys_addr_t block_base = __alloc_phys_block(alloc_size, flags);
 
-    for (u8_t i = 0; i < alloc_size; ++i) {
+    for (u8_t i = 0; i < num_pages; ++i) {
         pt_entry_t new_entry = vm_pt_entry_create(block_base, flags);
-        new_entry |= __data_alloc_flags(i, block_base, flags);
+        new_entry |= __data_alloc_flags(i, num_pages, flags);
         new_entry |= pt_alloc_flags(entry);
 
         pt->entries[block_pt_offset + i] = new_entry;
         block_base += PAGE_SIZE;
     }
 
+    mm_stats_end(MM_LAT_VM_ALLOC_BLOCK, start);
     return block_addr;
 }
 
+// Allocate a block in a VMZFLAG_ALLOC_BLOCK virtual memory zone.
+__attribute__((weak))
+virt_addr_t vm_alloc_block(u8_t flags, u16_t vmzone) {
+    return vm_alloc_block_pages(flags, vmzone, 1 << vmzone_info(vmzone)->block_order);
+}
+
 // Free a block in a VMZFLAG_ALLOC_BLOCK virtual memory zone.
+// Can be mocked in tests
+__attribute__((weak))
 int vm_free_block(virt_addr_t addr, u16_t vmzone) {
     page_table_t *pml4t = KPHYS_ADDR(read_cr3());
 
@@ -552,8 +650,14 @@ int vm_free_block(virt_addr_t addr, u16_t vmzone) {
         return ERR_VM_UNMAPPED;
     }
 
-    // Free the physical memory for this block.
-    u8_t num_pages = 1 << zone->block_order;
+    // Free the physical memory for this block. Blocks may only have their first few pages backed.
+    u8_t max_pages = 1 << zone->block_order;
+    u8_t num_pages = 1;
+
+    while (num_pages < max_pages && (pt->entries[offset + num_pages] & PT_PRESENT)) {
+        ++num_pages;
+    }
+
     __free_phys_block(pt->entries[offset], num_pages);
 
     virt_addr_t next_free_addr = zone->cursor_addr;
@@ -571,8 +675,222 @@ int vm_free_block(virt_addr_t addr, u16_t vmzone) {
     zone->cursor_addr = addr;
 
     for (u8_t i = 0; i < num_pages; ++i) {
+        pt->entries[offset + i] &= ~PT_PRESENT;
+    }
+
+    return 0;
+}
+
+// Can be mocked in tests
+__attribute__((weak))
+virt_addr_t vmalloc_direct(u8_t pages, u8_t flags, virt_addr_t base_address) {
+    page_table_t *pml4t = KPHYS_ADDR(read_cr3());
+    page_table_t *pt = NULL;
+
+    if (pages == 0) {
+        return base_address;
+    }
+
+    size_t mapped = 0;
+    u8_t chunk = 1 << (63 - __builtin_clzl(pages));
+
+    while (mapped < pages) {
+        while (chunk > pages - mapped) {
+            chunk >>= 1;
+        }
+
+        phys_addr_t phys_block = __alloc_phys_block(chunk, flags);
+
+        if (phys_block == NULL) {
+            if (chunk == 1) {
+                vfree_direct(base_address, mapped);
+                return NULL;
+            }
+
+            // Physical memory is fragmented, settle for smaller blocks.
+            chunk >>= 1;
+            continue;
+        }
+
+        for (u8_t i = 0; i < chunk; ++i) {
+            virt_addr_t page = base_address + ((mapped + i) << PAGE_ORDER);
+            size_t offset = pt_offset(page);
+
+            if (pt == NULL || offset == 0) {
+                int err;
+                int allocated_pages;
+                pt = __find_or_allocate_pt(pml4t, page, flags, &err, &allocated_pages);
+
+                if (unlikely(err != 0 || pt == NULL)) {
+                    // Unmap what's mapped so far. The pages of this chunk aren't freed by vfree_direct since the last
+                    // of them is still marked as having a page ahead, so its block is freed here.
+                    if (!(flags & VM_ALLOC_EARLY)) {
+                        phys_free(phys_block, chunk);
+                    }
+
+                    vfree_direct(base_address, mapped + i);
+                    return NULL;
+                }
+            }
+
+            pt->entries[offset] &= ~(PT_DATA_PAGE_AHEAD | PT_DATA_PAGE_BEHIND | PT_DATA_EARLY_ALLOC);
+            pt->entries[offset] |= __data_alloc_flags(i, chunk, flags);
+            __map_phys_page(pt, offset, phys_block + ((size_t)i << PAGE_ORDER), flags);
+            flush_tlb(page);
+        }
+
+        mapped += chunk;
+    }
+
+    return base_address;
+}
+
+// Can be mocked in tests
+__attribute__((weak))
+void vfree_direct(virt_addr_t base_address, size_t pages) {
+    page_table_t *pml4t = KPHYS_ADDR(read_cr3());
+    page_table_t *pt = NULL;
+
+    pt_entry_t block_entry = 0;
+    size_t block_pages = 0;
+
+    for (size_t i = 0; i < pages; ++i) {
+        virt_addr_t page = base_address + (i << PAGE_ORDER);
+        size_t offset = pt_offset(page);
+
+        if (pt == NULL || offset == 0) {
+            pt = __find_pt_or_null(pml4t, page);
+        }
+
+        pt_entry_t entry = pt->entries[offset];
+
+        if (block_pages++ == 0) {
+            block_entry = entry;
+        }
+
+        // Physical blocks are freed whole once their last page is reached.
+        if (!(entry & PT_DATA_PAGE_AHEAD)) {
+            __free_phys_block(block_entry, block_pages);
+            block_pages = 0;
+        }
+
         pt->entries[offset] &= ~PT_PRESENT;
+        flush_tlb(page);
+    }
+}
+
+// Map pages [from, to) of a vmalloc allocation. On failure the pages mapped so far are freed and -1 is returned.
+static int __vmalloc_map_pages(virt_addr_t base, size_t from, size_t to, u8_t flags) {
+    // vmalloc_direct maps up to 255 pages at a time, go in 128 page steps to keep physical blocks large.
+    for (size_t mapped = from; mapped < to; mapped += 128) {
+        u8_t step = MIN(to - mapped, 128);
+
+        if (vmalloc_direct(step, flags, base + (mapped << PAGE_ORDER)) == NULL) {
+            vfree_direct(base + (from << PAGE_ORDER), mapped - from);
+            return -1;
+        }
     }
 
     return 0;
 }
+
+static virt_addr_t __vmalloc(size_t pages, u8_t flags) {
+    vmzone_t *zone = vmzone_info(VMZONE_KERNEL_VMALLOC);
+
+    if (!__vmalloc_ready) {
+        bmp_init(&__vmalloc_map, __vmalloc_words, VMALLOC_GRANULES);
+        __vmalloc_ready = 1;
+    }
+
+    // First fit search for a hole of enough granules.
+    size_t granules = round_up_shift_right(pages, VMALLOC_GRANULE_ORDER);
+    size_t hole = bmp_find_next_zero(&__vmalloc_map, 0);
+
+    while (hole != BMP_NOT_FOUND) {
+        size_t hole_end = bmp_find_next_set(&__vmalloc_map, hole);
+
+        if (hole_end == BMP_NOT_FOUND) {
+            hole_end = VMALLOC_GRANULES;
+        }
+
+        if (hole_end - hole >= granules) {
+            break;
+        }
+
+        hole = hole_end >= VMALLOC_GRANULES ? BMP_NOT_FOUND : bmp_find_next_zero(&__vmalloc_map, hole_end);
+    }
+
+    if (hole == BMP_NOT_FOUND) {
+        return NULL;
+    }
+
+    virt_addr_t base = zone->start_address + (hole << (VMALLOC_GRANULE_ORDER + PAGE_ORDER));
+
+    if (__vmalloc_map_pages(base, 0, pages, flags) != 0) {
+        return NULL;
+    }
+
+    bmp_set_range(&__vmalloc_map, hole, granules);
+    return base;
+}
+
+// kfree may call vfree from an interrupt handler, so the zone's bitmap and page tables are only updated with
+// interrupts disabled.
+
+// Can be mocked in tests
+__attribute__((weak))
+virt_addr_t vmalloc(size_t pages, u8_t flags) {
+    u64_t irq = irq_save();
+    virt_addr_t base = __vmalloc(pages, flags);
+
+    irq_restore(irq);
+    return base;
+}
+
+// Can be mocked in tests
+__attribute__((weak))
+void vfree(virt_addr_t addr, size_t pages) {
+    vmzone_t *zone = vmzone_info(VMZONE_KERNEL_VMALLOC);
+    size_t granule = (addr - zone->start_address) >> (VMALLOC_GRANULE_ORDER + PAGE_ORDER);
+    u64_t irq = irq_save();
+
+    vfree_direct(addr, pages);
+    bmp_clear_range(&__vmalloc_map, granule, round_up_shift_right(pages, VMALLOC_GRANULE_ORDER));
+    irq_restore(irq);
+}
+
+static int __vmalloc_grow(virt_addr_t addr, size_t pages, size_t new_pages, u8_t flags) {
+    vmzone_t *zone = vmzone_info(VMZONE_KERNEL_VMALLOC);
+    size_t granule = (addr - zone->start_address) >> (VMALLOC_GRANULE_ORDER + PAGE_ORDER);
+    size_t granules = round_up_shift_right(pages, VMALLOC_GRANULE_ORDER);
+    size_t new_granules = round_up_shift_right(new_pages, VMALLOC_GRANULE_ORDER);
+
+    if (new_granules > granules) {
+        // The granules we grow into must all be free.
+        size_t taken = bmp_find_next_set(&__vmalloc_map, granule + granules);
+
+        if (granule + new_granules > VMALLOC_GRANULES || (taken != BMP_NOT_FOUND && taken < granule + new_granules)) {
+            return -1;
+        }
+    }
+
+    if (__vmalloc_map_pages(addr, pages, new_pages, flags) != 0) {
+        return -1;
+    }
+
+    if (new_granules > granules) {
+        bmp_set_range(&__vmalloc_map, granule + granules, new_granules - granules);
+    }
+
+    return 0;
+}
+
+// Can be mocked in tests
+__attribute__((weak))
+int vmalloc_grow(virt_addr_t addr, size_t pages, size_t new_pages, u8_t flags) {
+    u64_t irq = irq_save();
+    int result = __vmalloc_grow(addr, pages, new_pages, flags);
+
+    irq_restore(irq);
+    return result;
+}
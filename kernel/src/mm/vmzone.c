@@ -35,7 +35,10 @@ void vmzone_init()
     __define_vmzone(KERNEL_SENSITIVE_MEM, 8, VMZONE_KERNEL_HEAP, VMZFLAG_CONTIGUOUS, 0);
 
     // Another 8GB zone for larger general (non contiguous) kernel allocations.
-    __define_vmzone(KERNEL_SENSITIVE_MEM + (8ul << 30), 8, VMZONE_KERNEL_SLAB, VMZFLAG_BLOCK_ALLOC, SLAB_ORDER);
+    __define_vmzone(KERNEL_SENSITIVE_MEM + (8ul << 30), 8, VMZONE_KERNEL_SLAB, VMZFLAG_BLOCK_ALLOC, SLAB_MAX_ORDER);
+
+    // Large allocations are mapped page by page wherever vmalloc finds a big enough hole.
+    __define_vmzone((virt_addr_t)(KERNEL_SENSITIVE_MEM + (16ul << 30)), VMZONE_VMALLOC_GB, VMZONE_KERNEL_VMALLOC, 0, 0);
 
     // Kernel stacks should be mapped in user space for stack switches.
     __define_vmzone(KERNEL_NORMAL_MEM, 128, VMZONE_KERNEL_STACK, VMZFLAG_BLOCK_ALLOC, 1);
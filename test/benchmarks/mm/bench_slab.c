@@ -0,0 +1,122 @@
+#include <suite.h>
+#include <slab_colouring.h>
+
+#include <mm.h>
+#include <mm/vm.h>
+#include <mm/slab.h>
+#include <cpu/tsc.h>
+
+#include <utility/math.h>
+
+
+void *vm_alloc_block_pages(u8_t flags, u16_t vmzone, u8_t num_pages) {
+    static size_t alloc_idx = 0;
+
+    // We'll use the physical mem aligned to the slab block size.
+    u8_t *blocks_base = aligndown(__test_physical_mem + 0x100000, SLAB_MAX_ORDER + PAGE_ORDER);
+    
+    return blocks_base + (alloc_idx++) * SLAB_BLOCK_BYTES;
+}
+
+// Slab blocks are never reused by the mock above.
+int vm_free_block(virt_addr_t addr, u16_t vmzone) {
+    return 0;
+}
+
+
+typedef struct {
+    void *a, *b;
+} bench_obj_t;
+
+
+#define BULK_OBJS 64
+#define BULK_ROUNDS 4096
+
+
+// Compares the bulk APIs with one call per object.
+static void bench_slab_bulk() {
+    kmem_cache_t cache;
+    slab_cache_init(&cache, sizeof(bench_obj_t), _Alignof(bench_obj_t), 0, 0, 0);
+    slab_cache_reserve(&cache, BULK_OBJS);
+
+    void *objects[BULK_OBJS];
+    u64_t single_cycles = 0, bulk_cycles = 0;
+
+    for (u16_t round = 0; round < BULK_ROUNDS; ++round) {
+        u64_t start = rdtsc();
+
+        for (u16_t i = 0; i < BULK_OBJS; ++i) {
+            objects[i] = slab_alloc(&cache);
+        }
+
+        for (u16_t i = 0; i < BULK_OBJS; ++i) {
+            slab_free(&cache, objects[i]);
+        }
+
+        single_cycles += rdtsc() - start;
+        start = rdtsc();
+
+        slab_alloc_bulk(&cache, objects, BULK_OBJS);
+        slab_free_bulk(&cache, objects, BULK_OBJS);
+
+        bulk_cycles += rdtsc() - start;
+    }
+
+    printf("Alloc and free of %d objects: %lu cycles/object single, %lu cycles/object bulk\n",
+        BULK_OBJS, single_cycles / (BULK_ROUNDS * BULK_OBJS), bulk_cycles / (BULK_ROUNDS * BULK_OBJS));
+}
+
+
+#define CHASE_STEPS (1ul << 20)
+
+
+// Keeps the chase loop from being optimized away.
+static void **volatile __chase_end;
+
+static u64_t __chase(void **ring, size_t steps) {
+    u64_t start = rdtsc();
+
+    for (size_t i = 0; i < steps; ++i) {
+        ring = *ring;
+    }
+
+    u64_t cycles = rdtsc() - start;
+
+    __chase_end = ring;
+    return cycles;
+}
+
+
+// Shows the effect of colouring when chasing pointers through the first object of many slabs.
+static void bench_slab_colouring() {
+    kmem_cache_t coloured, uncoloured;
+    void *coloured_heads[COLOUR_SLABS], *uncoloured_heads[COLOUR_SLABS];
+
+    slab_cache_init(&coloured, COLOUR_OBJ_SIZE, 8, 0, 0, 0);
+    slab_cache_init(&uncoloured, COLOUR_OBJ_SIZE, 8, 0, 0, 0);
+    uncoloured.colour_count = 1;
+
+    void **coloured_ring = build_chase_ring(&coloured, coloured_heads);
+    void **uncoloured_ring = build_chase_ring(&uncoloured, uncoloured_heads);
+
+    // Warm up both rings before measuring.
+    __chase(coloured_ring, CHASE_STEPS);
+    __chase(uncoloured_ring, CHASE_STEPS);
+
+    u64_t coloured_cycles = __chase(coloured_ring, CHASE_STEPS);
+    u64_t uncoloured_cycles = __chase(uncoloured_ring, CHASE_STEPS);
+
+    printf("Pointer chase over %d slabs (%u colours): %lu cycles/step coloured, %lu cycles/step uncoloured\n",
+        COLOUR_SLABS, coloured.colour_count, coloured_cycles / CHASE_STEPS, uncoloured_cycles / CHASE_STEPS);
+}
+
+
+int main(void) {
+    suite_setup();
+
+    bench_slab_colouring();
+    bench_slab_bulk();
+
+    suite_teardown();
+    return 0;
+}
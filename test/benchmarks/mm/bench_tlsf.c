@@ -0,0 +1,147 @@
+#include <suite.h>
+
+#include <mm.h>
+#include <mm/vm.h>
+#include <mm/kmalloc.h>
+#include <mm/tlsf.h>
+#include <cpu/tsc.h>
+
+#include <utility/math.h>
+
+#include <stdlib.h>
+#include <time.h>
+
+
+void *vm_alloc_block_pages(u8_t flags, u16_t vmzone, u8_t num_pages) {
+    static size_t alloc_idx = 0;
+
+    // We'll use the physical mem aligned to the slab block size.
+    u8_t *blocks_base = aligndown(__test_physical_mem + 0x100000, SLAB_MAX_ORDER + PAGE_ORDER);
+    
+    return blocks_base + (alloc_idx++) * SLAB_BLOCK_BYTES;
+}
+
+// Slab blocks are never reused by the mock above.
+int vm_free_block(virt_addr_t addr, u16_t vmzone) {
+    return 0;
+}
+
+// The TLSF pool. Its pages are touched up front, like the kernel maps them up front, so that host page faults on
+// first use don't show up in the measurements.
+virt_addr_t vmalloc(size_t pages, u8_t flags) {
+    u8_t *pool = aligndown(__test_physical_mem + 0x800000, VMALLOC_GRANULE_ORDER + PAGE_ORDER);
+    memset(pool, 0, pages << PAGE_ORDER);
+
+    return pool;
+}
+
+void vfree(virt_addr_t addr, size_t pages) {
+}
+
+
+#define BENCH_OBJS   64
+#define BENCH_ROUNDS 200
+
+#define BENCH_SAMPLES (BENCH_ROUNDS * BENCH_OBJS)
+
+typedef struct {
+    u64_t samples[BENCH_SAMPLES];
+    size_t num_samples;
+} bench_result_t;
+
+static int __compare_cycles(const void *a, const void *b) {
+    u64_t x = *(const u64_t *)a, y = *(const u64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorts the samples. The 99th percentile is shown next to the maximum, which a single host interrupt can dominate.
+static void __print_result(const char *name, bench_result_t *result) {
+    u64_t total = 0;
+
+    qsort(result->samples, result->num_samples, sizeof(u64_t), __compare_cycles);
+
+    for (size_t i = 0; i < result->num_samples; ++i) {
+        total += result->samples[i];
+    }
+
+    printf("  %s: %lu cycles avg, %lu p99, %lu max\n", name, total / result->num_samples,
+        result->samples[result->num_samples * 99 / 100], result->samples[result->num_samples - 1]);
+}
+
+// Allocate the objects with alloc_fn and free them in a different order than they were allocated.
+static void __bench_round(void *(*alloc_fn)(size_t), void (*free_fn)(void *), size_t *sizes, bench_result_t *result) {
+    void *objects[BENCH_OBJS];
+
+    for (u16_t i = 0; i < BENCH_OBJS; ++i) {
+        u64_t start = rdtsc();
+        objects[i] = alloc_fn(sizes[i]);
+        u64_t cycles = rdtsc() - start;
+
+        if (result != NULL) {
+            result->samples[result->num_samples++] = cycles;
+        }
+    }
+
+    for (u16_t i = 0; i < BENCH_OBJS; ++i) {
+        free_fn(objects[(i * 7) % BENCH_OBJS]);
+    }
+}
+
+static tlsf_t __tlsf;
+
+static void *__tlsf_alloc(size_t size) {
+    return tlsf_alloc(&__tlsf, size);
+}
+
+static void __tlsf_free(void *ptr) {
+    tlsf_free(&__tlsf, ptr);
+}
+
+static void *__kmalloc_size(size_t size) {
+    return kmalloc(size);
+}
+
+
+// Compares the cycles per allocation of kmalloc and a TLSF pool on the same mix of sizes. Both get a round to warm
+// up first, so kmalloc's caches are already grown.
+static void bench_tlsf() {
+    kmalloc_init();
+
+    if (tlsf_create(&__tlsf, 64) != 0) {
+        printf("tlsf_create failed\n");
+        return;
+    }
+
+    size_t sizes[BENCH_OBJS];
+
+    srand(time(NULL));
+    for (u16_t i = 0; i < BENCH_OBJS; ++i) {
+        sizes[i] = 16 + rand() % (MAX_KMALLOC_SIZE - 16);
+    }
+
+    static bench_result_t kmalloc_result, tlsf_result;
+
+    __bench_round(__kmalloc_size, kfree, sizes, NULL);
+    __bench_round(__tlsf_alloc, __tlsf_free, sizes, NULL);
+
+    for (u16_t round = 0; round < BENCH_ROUNDS; ++round) {
+        __bench_round(__kmalloc_size, kfree, sizes, &kmalloc_result);
+        __bench_round(__tlsf_alloc, __tlsf_free, sizes, &tlsf_result);
+    }
+
+    tlsf_destroy(&__tlsf);
+
+    printf("Alloc of %d objects of 16-%d bytes, %d rounds:\n", BENCH_OBJS, MAX_KMALLOC_SIZE, BENCH_ROUNDS);
+    __print_result("kmalloc", &kmalloc_result);
+    __print_result("tlsf", &tlsf_result);
+}
+
+
+int main(void) {
+    suite_setup();
+
+    bench_tlsf();
+
+    suite_teardown();
+    return 0;
+}
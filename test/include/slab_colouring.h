@@ -0,0 +1,31 @@
+#ifndef __SLAB_COLOURING_H
+#define __SLAB_COLOURING_H
+
+#include <types.h>
+#include <mm/slab.h>
+
+// Objects this large leave a lot of padding at the end of each slab, and thus a lot of colours.
+#define COLOUR_OBJ_SIZE 3000
+#define COLOUR_SLABS 64
+
+// Allocate the first object of COLOUR_SLABS fresh slabs into heads and link them into a ring in a scattered order.
+// Shared by the colouring test and benchmark so that the test checks the layout the benchmark measures.
+static inline void **build_chase_ring(kmem_cache_t *cache, void **heads) {
+    for (u16_t i = 0; i < COLOUR_SLABS; ++i) {
+        heads[i] = slab_alloc(cache);
+
+        // Fill up the rest of the slab so that the next allocation comes from a new slab.
+        for (u16_t j = 1; j < cache->objs_per_slab; ++j) {
+            slab_alloc(cache);
+        }
+    }
+
+    // 37 is coprime with COLOUR_SLABS, so this visits every slab before wrapping around.
+    for (u16_t i = 0; i < COLOUR_SLABS; ++i) {
+        *(void **)heads[(i * 37) % COLOUR_SLABS] = heads[((i + 1) * 37) % COLOUR_SLABS];
+    }
+
+    return heads[0];
+}
+
+#endif
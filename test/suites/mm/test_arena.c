@@ -0,0 +1,146 @@
+#include <suite.h>
+#include <cmocka.h>
+#include <assertions.h>
+
+#include <mm.h>
+#include <mm/arena.h>
+
+
+#define CHUNK_BYTES (ARENA_CHUNK_PAGES << PAGE_ORDER)
+
+static size_t __next_page = 0x100;
+static size_t __allocated_pages = 0;
+static size_t __freed_pages = 0;
+static size_t __phys_allocs = 0;
+
+phys_addr_t phys_alloc(size_t num_pages) {
+    phys_addr_t block = __next_page << PAGE_ORDER;
+
+    __next_page += num_pages;
+    __allocated_pages += num_pages;
+    ++__phys_allocs;
+
+    return block;
+}
+
+void phys_free(phys_addr_t block_addr, size_t num_pages) {
+    __freed_pages += num_pages;
+}
+
+
+static void test_arena_alloc(void **state) {
+    arena_t arena;
+    arena_init(&arena);
+
+    u8_t *a = arena_alloc(&arena, 10, 1);
+    u8_t *b = arena_alloc(&arena, 3, 1);
+    u64_t *c = arena_alloc(&arena, sizeof(u64_t), 8);
+    u8_t *d = arena_alloc(&arena, 100, 64);
+
+    assert_int_equal(1, __phys_allocs);
+    assert_ptr_equal(a + 10, b);
+    assert_aligned(c, 8);
+    assert_aligned(d, 64);
+    assert_true((u8_t*)c >= b + 3);
+    assert_true(d >= (u8_t*)(c + 1));
+
+    // Fill up the rest of the chunk, then spill into a second one.
+    size_t allocs = 0;
+    while (__phys_allocs == 1) {
+        arena_alloc(&arena, 512, 1);
+        ++allocs;
+    }
+
+    assert_int_equal(2, __phys_allocs);
+    assert_int_equal(CHUNK_BYTES / 512, allocs);
+
+    arena_release(&arena);
+    assert_int_equal(__allocated_pages, __freed_pages);
+}
+
+
+static void test_arena_scopes(void **state) {
+    arena_t arena;
+    arena_init(&arena);
+
+    u8_t *first = arena_alloc(&arena, 16, 1);
+    arena_scope_t outer = arena_push(&arena);
+
+    u8_t *a = arena_alloc(&arena, 32, 1);
+    arena_scope_t inner = arena_push(&arena);
+    arena_alloc(&arena, 64, 1);
+
+    // Popping the inner scope hands out the same memory again.
+    arena_pop(&arena, inner);
+    assert_ptr_equal(a + 32, arena_alloc(&arena, 8, 1));
+
+    arena_pop(&arena, outer);
+    assert_ptr_equal(a, arena_alloc(&arena, 32, 1));
+
+    // A scope which crosses into new chunks gives them back when popped, keeping one as a spare.
+    size_t allocs_before = __phys_allocs;
+    size_t freed_before = __freed_pages;
+
+    arena_scope_t crossing = arena_push(&arena);
+    for (int i = 0; i < 3; ++i) {
+        arena_alloc(&arena, CHUNK_BYTES / 2, 1);
+        arena_alloc(&arena, CHUNK_BYTES / 2, 1);
+    }
+
+    size_t chunks = __phys_allocs - allocs_before;
+    assert_true(chunks >= 2);
+
+    arena_pop(&arena, crossing);
+    assert_int_equal(freed_before + (chunks - 1) * ARENA_CHUNK_PAGES, __freed_pages);
+
+    // Crossing the same chunk boundary again reuses the spare instead of allocating.
+    allocs_before = __phys_allocs;
+
+    for (int i = 0; i < 100; ++i) {
+        arena_scope_t scope = arena_push(&arena);
+
+        arena_alloc(&arena, CHUNK_BYTES / 2, 1);
+        arena_alloc(&arena, CHUNK_BYTES / 2, 1);
+        arena_pop(&arena, scope);
+    }
+
+    assert_int_equal(allocs_before, __phys_allocs);
+
+    // Allocations made before the scopes are untouched.
+    assert_ptr_equal(first + 16, a);
+
+    arena_release(&arena);
+    assert_int_equal(__allocated_pages, __freed_pages);
+}
+
+
+static void test_arena_large(void **state) {
+    arena_t arena;
+    arena_init(&arena);
+
+    arena_alloc(&arena, 16, 1);
+
+    size_t allocated_before = __allocated_pages;
+    u8_t *large = arena_alloc(&arena, 3 * CHUNK_BYTES, PAGE_SIZE);
+
+    assert_non_null(large);
+    assert_aligned(large, PAGE_SIZE);
+    assert_true(__allocated_pages - allocated_before > 3 * ARENA_CHUNK_PAGES);
+
+    // The whole allocation is usable.
+    memset(large, 0xAB, 3 * CHUNK_BYTES);
+
+    arena_release(&arena);
+    assert_int_equal(__allocated_pages, __freed_pages);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_arena_alloc),
+        cmocka_unit_test(test_arena_scopes),
+        cmocka_unit_test(test_arena_large),
+    };
+
+    return cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
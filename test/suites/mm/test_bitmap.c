@@ -7,15 +7,17 @@
 static void test_bmp_init(void **state) {
     bitmap_t bmp;
 
-    u8_t *buffer = (u8_t*)malloc(1001);
+    u64_t *buffer = (u64_t*)malloc(126 * sizeof(u64_t));
     bmp_init(&bmp, buffer, 8000);
 
     assert_ptr_equal(buffer, bmp.base);
-    assert_int_equal(1000, bmp.size_bytes);
+    assert_int_equal(8000, bmp.size_bits);
+    assert_int_equal(125, bmp.size_words);
 
     bmp_init(&bmp, buffer, 8001);
     assert_ptr_equal(buffer, bmp.base);
-    assert_int_equal(1001, bmp.size_bytes);
+    assert_int_equal(8001, bmp.size_bits);
+    assert_int_equal(126, bmp.size_words);
 
     free(buffer);
 }
@@ -23,7 +25,7 @@ static void test_bmp_init(void **state) {
 static void test_bmp_get_set_and_toggle(void **state) {
     bitmap_t bmp;
 
-    u8_t *buffer = (u8_t*)calloc(1000, 1);
+    u64_t *buffer = (u64_t*)calloc(125, sizeof(u64_t));
     bmp_init(&bmp, buffer, 8000);
 
     bmp_set_bit(&bmp, 0, 1);
@@ -35,6 +37,75 @@ static void test_bmp_get_set_and_toggle(void **state) {
     assert_int_equal(1, bmp_toggle_bit(&bmp, 7999));
     assert_int_equal(0, bmp_toggle_bit(&bmp, 7999));
 
+    // Out of bounds accesses are ignored.
+    assert_int_equal(0, bmp_set_bit(&bmp, 8000, 1));
+    assert_int_equal(0, bmp_get_bit(&bmp, 8000));
+
+    free(buffer);
+}
+
+static void test_bmp_find(void **state) {
+    bitmap_t bmp;
+
+    u64_t *buffer = (u64_t*)calloc(126, sizeof(u64_t));
+    bmp_init(&bmp, buffer, 8001);
+
+    assert_int_equal(BMP_NOT_FOUND, bmp_find_first_set(&bmp));
+    assert_int_equal(BMP_NOT_FOUND, bmp_find_last_set(&bmp));
+    assert_int_equal(0, bmp_find_first_zero(&bmp));
+
+    bmp_set_bit(&bmp, 63, 1);
+    bmp_set_bit(&bmp, 64, 1);
+    bmp_set_bit(&bmp, 5000, 1);
+
+    assert_int_equal(63, bmp_find_first_set(&bmp));
+    assert_int_equal(64, bmp_find_next_set(&bmp, 64));
+    assert_int_equal(5000, bmp_find_next_set(&bmp, 65));
+    assert_int_equal(BMP_NOT_FOUND, bmp_find_next_set(&bmp, 5001));
+    assert_int_equal(5000, bmp_find_last_set(&bmp));
+
+    assert_int_equal(65, bmp_find_next_zero(&bmp, 63));
+
+    // The padding at the end of the last word is never reported as a zero.
+    bmp_set_range(&bmp, 0, 8001);
+    assert_int_equal(BMP_NOT_FOUND, bmp_find_first_zero(&bmp));
+    assert_int_equal(8000, bmp_find_last_set(&bmp));
+
+    free(buffer);
+}
+
+static void test_bmp_ranges_and_popcount(void **state) {
+    bitmap_t bmp;
+
+    u64_t *buffer = (u64_t*)calloc(125, sizeof(u64_t));
+    bmp_init(&bmp, buffer, 8000);
+
+    // Range within a single word.
+    bmp_set_range(&bmp, 3, 10);
+    assert_int_equal(10, bmp_popcount(&bmp));
+    assert_int_equal(3, bmp_find_first_set(&bmp));
+    assert_int_equal(13, bmp_find_next_zero(&bmp, 3));
+
+    // Range spanning several words.
+    bmp_set_range(&bmp, 100, 1000);
+    assert_int_equal(1010, bmp_popcount(&bmp));
+    assert_int_equal(0, bmp_get_bit(&bmp, 99));
+    assert_int_equal(1, bmp_get_bit(&bmp, 100));
+    assert_int_equal(1, bmp_get_bit(&bmp, 1099));
+    assert_int_equal(0, bmp_get_bit(&bmp, 1100));
+
+    bmp_clear_range(&bmp, 128, 64);
+    assert_int_equal(946, bmp_popcount(&bmp));
+    assert_int_equal(128, bmp_find_next_zero(&bmp, 100));
+    assert_int_equal(192, bmp_find_next_set(&bmp, 128));
+
+    // Ranges are clipped to the size of the bitmap.
+    bmp_set_range(&bmp, 7990, 100);
+    assert_int_equal(956, bmp_popcount(&bmp));
+
+    bmp_clear_range(&bmp, 0, 8000);
+    assert_int_equal(0, bmp_popcount(&bmp));
+
     free(buffer);
 }
 
@@ -42,7 +113,9 @@ int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_bmp_init),
         cmocka_unit_test(test_bmp_get_set_and_toggle),
+        cmocka_unit_test(test_bmp_find),
+        cmocka_unit_test(test_bmp_ranges_and_popcount),
     };
 
     return cmocka_run_group_tests(tests, suite_setup, suite_teardown);
-}
\ No newline at end of file
+}
@@ -4,18 +4,22 @@
 
 #include <mm.h>
 #include <mm/buddy_alloc.h>
+#include <mm/page.h>
 
 
 // Sanity check for the buddy's state bitmap. Every bit should be hit twice while scanning
 // all possible block_offsets and orders.
 static void test_buddy_bit_mapping(void **state) {
-    size_t total_pages = 1024;
+    // Span two superblocks so that the largest orders and the boundary between superblocks are covered.
+    size_t total_pages = 2ul << (MAX_ORDER + 1);
     size_t total_bits = buddy_bmp_size_bits(total_pages);
 
-    u8_t *zero = malloc((total_bits + 7) / 8);
-    memset(zero, 0, (total_bits + 7) / 8);
+    size_t total_bytes = bmp_size_words(total_bits) * sizeof(u64_t);
 
-    u8_t *buffer = malloc((total_bits + 7) / 8);
+    u8_t *zero = malloc(total_bytes);
+    memset(zero, 0, total_bytes);
+
+    u64_t *buffer = malloc(total_bytes);
 
     bitmap_t bmp;
     bmp_init(&bmp, buffer, total_bits);
@@ -31,19 +35,15 @@ static void test_buddy_bit_mapping(void **state) {
     }
 
     // All bits should be 0 since they should have been toggled twice.
-    assert_int_equal(0, memcmp(buffer, zero, (total_bits + 7) / 8));
+    assert_int_equal(0, memcmp(buffer, zero, total_bytes));
+    assert_int_equal(BMP_NOT_FOUND, bmp_find_first_set(&bmp));
 
     free(zero);
     free(buffer);
 }
 
 
-__attribute__((aligned(1 << (SLAB_ORDER + PAGE_ORDER))))
-slab_t freelist_pool[4];
-
-
-buddy_prealloc_vector vector;
-buddy_memory_pool pool;
+void *bitmap_pool;
 
 
 static void check_free_integrity(buddy_allocator_t *allocator) {
@@ -51,53 +51,62 @@ static void check_free_integrity(buddy_allocator_t *allocator) {
     char buf[10];
 
     size_t order_counts[MAX_ORDER + 1];
-    size_t freelist_entries = 0;
 
     // Verify integrity by counting free bytes with the free list and ensuring they make sense
     for (u8_t order = 0; order <= MAX_ORDER; ++order) {
         order_counts[order] = 0;
 
-        freelist_entry_t *free = allocator->freelists[order];
+        page_info_t *free = allocator->freelists[order];
+        page_info_t *prev = NULL;
 
         while (free != NULL) {
-            ++freelist_entries;
             ++order_counts[order];
             free_bytes += 1ul << (order + PAGE_ORDER);
 
-            free = free->next_entry == NULL ? NULL : free + free->next_entry;
+            // The list must be doubly linked and every block must be marked free with its order.
+            assert_true(free->flags & PAGE_BUDDY_FREE);
+            assert_int_equal(order, free->buddy_free_info.order);
+            assert_ptr_equal(prev, free->buddy_free_info.prev);
+            assert_int_equal(0, buddy_block_offset(allocator, free) & MASK_FOR_FIRST_N_BITS(order));
+
+            prev = free;
+            free = free->buddy_free_info.next;
         }
+
+        assert_int_equal(order_counts[order], allocator->free_blocks[order]);
     }
 
-    assert_int_equal(allocator->freelist_cache.allocated_objects, freelist_entries);
     assert_int_equal(allocator->free_space_bytes, free_bytes);
 }
 
 
 static int setup_buddy_pool(void **state) {
-    vector = buddy_estimate_pool_size((PHYS_MEM_SIZE - 0x1000) >> PAGE_ORDER);
+    init_global_page_map();
 
-    pool.bitmap_and_struct_pool = malloc(vector.bitmap_and_struct_pages << PAGE_ORDER);
-    pool.freelist_pool = freelist_pool;
-    pool.freelist_pool_slabs = vector.freelist_pool_slabs;
+    bitmap_pool = malloc(buddy_bitmap_pages(0x1000, PHYS_MEM_SIZE) << PAGE_ORDER);
     return 0;
 }
 
 
 static int teardown_buddy_pool(void **state) {
-    free(pool.bitmap_and_struct_pool);
+    free(bitmap_pool);
     return 0;
 }
 
 
 static void test_buddy_init(void **state) {
     buddy_allocator_t allocator;
-    buddy_init(&allocator, pool, 0x1000, PHYS_MEM_SIZE);
-    size_t bits = buddy_bmp_size_bits((PHYS_MEM_SIZE - 0x1000) >> PAGE_ORDER);
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
+    size_t bits = buddy_bmp_size_bits(PHYS_MEM_SIZE >> PAGE_ORDER);
     
-    assert_int_equal((bits + 7) >> 3, allocator.buddy_state_map.size_bytes);
-    assert_int_equal(0x1000, allocator.base_addr);
+    assert_int_equal(bits, allocator.buddy_state_map.size_bits);
+    assert_int_equal(bmp_size_words(bits), allocator.buddy_state_map.size_words);
+    // Page offsets are relative to the MAX_ORDER block containing the start address.
+    assert_int_equal(0, allocator.base_addr);
+    assert_int_equal(0x1000, allocator.start_addr);
     assert_int_equal(PHYS_MEM_SIZE, allocator.end_addr);
-    assert_int_equal(PHYS_MEM_SIZE - MEMHOLE_SIZE - 0x2000, allocator.free_space_bytes);
+    // Every usable page after the start address is free.
+    assert_int_equal(PHYS_MEM_SIZE - MEMHOLE_SIZE - 0x1000, allocator.free_space_bytes);
 
     check_free_integrity(&allocator);
 }
@@ -105,7 +114,7 @@ static void test_buddy_init(void **state) {
 
 static void test_buddy_allocations(void **state) {
     buddy_allocator_t allocator;
-    buddy_init(&allocator, pool, 0x1000, PHYS_MEM_SIZE);
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
 
     phys_addr_t allocs[6];
     u8_t alloc_orders[6] = { 7, 5, 4, 3, 1, 0 };
@@ -159,14 +168,14 @@ static void test_buddy_allocations(void **state) {
 
 static void test_block_splitting_and_coalescing(void **state) {
     buddy_allocator_t allocator;
-    buddy_init(&allocator, pool, 0x1000, PHYS_MEM_SIZE);
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
 
     u8_t order_0_free = 0, order_1_free = 0;
-    freelist_entry_t *freelist = allocator.freelists[0];
+    page_info_t *freelist = allocator.freelists[0];
     
     while (freelist != NULL) {
         ++order_0_free;
-        freelist = freelist->next_entry == NULL ? NULL : freelist + freelist->next_entry;
+        freelist = freelist->buddy_free_info.next;
     }
 
     for (u8_t i = 0; i < order_0_free; ++i) {
@@ -176,7 +185,7 @@ static void test_block_splitting_and_coalescing(void **state) {
     freelist = allocator.freelists[1];
     while (freelist != NULL) {
         ++order_1_free;
-        freelist = freelist->next_entry == NULL ? NULL : freelist + freelist->next_entry;
+        freelist = freelist->buddy_free_info.next;
     }
 
     for (u8_t i = 0; i < order_1_free; ++i) {
@@ -191,20 +200,20 @@ static void test_block_splitting_and_coalescing(void **state) {
         ++next_order;
     }
 
-    size_t block_offset = allocator.freelists[next_order]->page_offset;
+    size_t block_offset = buddy_block_offset(&allocator, allocator.freelists[next_order]);
     size_t block_end = block_offset + (1 << next_order);
 
     size_t returned_offset = buddy_alloc_block(&allocator, 0);
     check_free_integrity(&allocator);
 
-    assert_int_not_equal(block_offset, allocator.freelists[next_order]->page_offset);
+    assert_int_not_equal(block_offset, buddy_block_offset(&allocator, allocator.freelists[next_order]));
     assert_in_range(returned_offset >> PAGE_ORDER, block_offset, block_end);
 
     // We expect the block has been split.
     for (u8_t order = 0; order < next_order; ++order) {
         // Except there to be a block within block_offset to block_end at this order at the head of the freelists.
         assert_non_null(allocator.freelists[order]);
-        assert_in_range(allocator.freelists[order]->page_offset, block_offset, block_end);
+        assert_in_range(buddy_block_offset(&allocator, allocator.freelists[order]), block_offset, block_end);
     }
 
     // The block should coalesce.
@@ -215,44 +224,190 @@ static void test_block_splitting_and_coalescing(void **state) {
     }
 
     assert_non_null(allocator.freelists[next_order]);
-    assert_int_equal(allocator.freelists[next_order]->page_offset, block_offset);
+    assert_int_equal(buddy_block_offset(&allocator, allocator.freelists[next_order]), block_offset);
 }
 
 
 static void test_block_shrinking(void **state) {
     buddy_allocator_t allocator;
-    buddy_init(&allocator, pool, 0x1000, PHYS_MEM_SIZE);
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
     phys_addr_t block_base = buddy_alloc_block(&allocator, 7);
     size_t block_offset = (block_base - allocator.base_addr) >> PAGE_ORDER;
 
     buddy_shrink_block(&allocator, block_base, 7, 33);
 
-    freelist_entry_t *freelist = allocator.freelists[6];
+    page_info_t *freelist = allocator.freelists[6];
     assert_non_null(freelist);
-    assert_int_equal(block_offset + (1ul << 6), freelist->page_offset);
+    assert_int_equal(block_offset + (1ul << 6), buddy_block_offset(&allocator, freelist));
 
     freelist = allocator.freelists[5];
-    assert_not_in_range(freelist->page_offset, block_offset, block_offset + (1ul << 7));
+    assert_not_in_range(buddy_block_offset(&allocator, freelist), block_offset, block_offset + (1ul << 7));
 
     freelist = allocator.freelists[4];
     assert_non_null(freelist);
-    assert_int_equal(block_offset + (1ul << 5) + (1ul << 4), freelist->page_offset);
+    assert_int_equal(block_offset + (1ul << 5) + (1ul << 4), buddy_block_offset(&allocator, freelist));
 
     freelist = allocator.freelists[3];
     assert_non_null(freelist);
-    assert_int_equal(block_offset + (1ul << 5) + (1ul << 3), freelist->page_offset);
+    assert_int_equal(block_offset + (1ul << 5) + (1ul << 3), buddy_block_offset(&allocator, freelist));
 
     freelist = allocator.freelists[2];
     assert_non_null(freelist);
-    assert_int_equal(block_offset + (1ul << 5) + (1ul << 2), freelist->page_offset);
+    assert_int_equal(block_offset + (1ul << 5) + (1ul << 2), buddy_block_offset(&allocator, freelist));
 
     freelist = allocator.freelists[1];
     assert_non_null(freelist);
-    assert_int_equal(block_offset + (1ul << 5) + (1ul << 1), freelist->page_offset);
+    assert_int_equal(block_offset + (1ul << 5) + (1ul << 1), buddy_block_offset(&allocator, freelist));
 
     freelist = allocator.freelists[0];
     assert_non_null(freelist);
-    assert_int_equal(block_offset + (1ul << 5) + 1, freelist->page_offset);
+    assert_int_equal(block_offset + (1ul << 5) + 1, buddy_block_offset(&allocator, freelist));
+}
+
+
+// Blocks beyond the old 128 page limit can be allocated and are naturally aligned in physical memory.
+static void test_large_order_allocations(void **state) {
+    buddy_allocator_t allocator;
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
+
+    size_t initial_free_bytes = allocator.free_space_bytes;
+
+    // 2MB, huge page sized block.
+    phys_addr_t huge_block = buddy_alloc_block(&allocator, 9);
+    assert_int_not_equal(NULL, huge_block);
+    assert_int_equal(0, huge_block & MASK_FOR_FIRST_N_BITS(9 + PAGE_ORDER));
+    check_free_integrity(&allocator);
+
+    phys_addr_t block = buddy_alloc_block(&allocator, 10);
+    assert_int_not_equal(NULL, block);
+    assert_int_equal(0, block & MASK_FOR_FIRST_N_BITS(10 + PAGE_ORDER));
+    check_free_integrity(&allocator);
+
+    // There's not enough memory for a block of MAX_ORDER, the allocation fails without affecting accounting.
+    size_t allocated_bytes = allocator.allocated_bytes;
+    assert_int_equal(NULL, buddy_alloc_block(&allocator, MAX_ORDER));
+    assert_int_equal(NULL, buddy_alloc_block(&allocator, MAX_ORDER + 1));
+    assert_int_equal(allocated_bytes, allocator.allocated_bytes);
+    check_free_integrity(&allocator);
+
+    buddy_free_block(&allocator, huge_block, 9);
+    buddy_free_block(&allocator, block, 10);
+    check_free_integrity(&allocator);
+
+    assert_int_equal(0, allocator.allocated_bytes);
+    assert_int_equal(initial_free_bytes, allocator.free_space_bytes);
+}
+
+
+// Build long freelists of uncoalescable blocks, then free their buddies. Every free has to find its buddy
+// in the middle of the freelist and everything should coalesce back to the initial state.
+static void test_coalescing_fragmented_freelists(void **state) {
+    buddy_allocator_t allocator;
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
+
+    size_t initial_free_bytes = allocator.free_space_bytes;
+    phys_addr_t allocs[512];
+
+    for (u16_t i = 0; i < 512; ++i) {
+        allocs[i] = buddy_alloc_block(&allocator, 0);
+    }
+
+    check_free_integrity(&allocator);
+
+    // Free every other page, none of these can coalesce.
+    for (u16_t i = 0; i < 512; i += 2) {
+        buddy_free_block(&allocator, allocs[i], 0);
+    }
+
+    check_free_integrity(&allocator);
+
+    // Free the remaining pages out of order.
+    for (u16_t i = 1; i < 512; i += 4) {
+        buddy_free_block(&allocator, allocs[i], 0);
+    }
+
+    check_free_integrity(&allocator);
+
+    for (u16_t i = 3; i < 512; i += 4) {
+        buddy_free_block(&allocator, allocs[i], 0);
+    }
+
+    check_free_integrity(&allocator);
+
+    assert_int_equal(0, allocator.allocated_bytes);
+    assert_int_equal(initial_free_bytes, allocator.free_space_bytes);
+}
+
+
+static void test_bulk_allocations(void **state) {
+    buddy_allocator_t allocator;
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
+
+    size_t initial_free_bytes = allocator.free_space_bytes;
+    phys_addr_t pages[300];
+    phys_addr_t blocks[5];
+
+    // Large enough to consume whole free blocks as well as split a partial one.
+    assert_int_equal(300, buddy_alloc_bulk(&allocator, 0, pages, 300));
+    assert_int_equal(5, buddy_alloc_bulk(&allocator, 3, blocks, 5));
+
+    assert_int_equal((300ul + (5ul << 3)) << PAGE_ORDER, allocator.allocated_bytes);
+    assert_int_equal(305, allocator.stats.allocs);
+    assert_int_equal(0, allocator.stats.failures);
+    check_free_integrity(&allocator);
+
+    // Every block is aligned to its order and no two blocks overlap.
+    for (u16_t i = 0; i < 5; ++i) {
+        assert_int_equal(0, blocks[i] & MASK_FOR_FIRST_N_BITS(3 + PAGE_ORDER));
+
+        for (u16_t j = 0; j < 300; ++j) {
+            assert_false(pages[j] >= blocks[i] && pages[j] < blocks[i] + (8ul << PAGE_ORDER));
+        }
+    }
+
+    for (u16_t i = 0; i < 300; ++i) {
+        assert_false(page_info(pages[i])->flags & PAGE_BUDDY_FREE);
+
+        for (u16_t j = i + 1; j < 300; ++j) {
+            assert_int_not_equal(pages[i], pages[j]);
+        }
+    }
+
+    // Bulk frees should coalesce everything back, a single block free in between shouldn't matter.
+    buddy_free_block(&allocator, pages[150], 0);
+    buddy_free_bulk(&allocator, pages, 150, 0);
+    buddy_free_bulk(&allocator, blocks, 5, 3);
+    check_free_integrity(&allocator);
+    buddy_free_bulk(&allocator, pages + 151, 149, 0);
+
+    check_free_integrity(&allocator);
+    assert_int_equal(0, allocator.allocated_bytes);
+    assert_int_equal(initial_free_bytes, allocator.free_space_bytes);
+    assert_int_equal(BMP_NOT_FOUND, bmp_find_first_set(&allocator.buddy_state_map));
+
+    // Everything that was split has been merged back together.
+    assert_int_equal(305, allocator.stats.frees);
+    assert_int_equal(allocator.stats.splits, allocator.stats.coalesces);
+}
+
+
+static void test_bulk_allocation_exhaustion(void **state) {
+    buddy_allocator_t allocator;
+    buddy_init(&allocator, bitmap_pool, 0x1000, 0x40000);
+
+    size_t free_pages = allocator.free_space_bytes >> PAGE_ORDER;
+    phys_addr_t pages[128];
+
+    // Asking for more than there is hands out everything that's left.
+    assert_int_equal(free_pages, buddy_alloc_bulk(&allocator, 0, pages, 128));
+    assert_int_equal(0, allocator.free_space_bytes);
+    assert_int_equal(0, buddy_alloc_bulk(&allocator, 0, pages + free_pages, 1));
+    assert_int_equal(2, allocator.stats.failures);
+
+    buddy_free_bulk(&allocator, pages, free_pages, 0);
+
+    check_free_integrity(&allocator);
+    assert_int_equal(free_pages << PAGE_ORDER, allocator.free_space_bytes);
 }
 
 
@@ -263,6 +418,10 @@ int main(void) {
         cmocka_unit_test_setup_teardown(test_buddy_allocations, setup_buddy_pool, teardown_buddy_pool),
         cmocka_unit_test_setup_teardown(test_block_splitting_and_coalescing, setup_buddy_pool, teardown_buddy_pool),
         cmocka_unit_test_setup_teardown(test_block_shrinking, setup_buddy_pool, teardown_buddy_pool),
+        cmocka_unit_test_setup_teardown(test_large_order_allocations, setup_buddy_pool, teardown_buddy_pool),
+        cmocka_unit_test_setup_teardown(test_coalescing_fragmented_freelists, setup_buddy_pool, teardown_buddy_pool),
+        cmocka_unit_test_setup_teardown(test_bulk_allocations, setup_buddy_pool, teardown_buddy_pool),
+        cmocka_unit_test_setup_teardown(test_bulk_allocation_exhaustion, setup_buddy_pool, teardown_buddy_pool),
     };
 
     cmocka_run_group_tests(tests, suite_setup, suite_teardown);
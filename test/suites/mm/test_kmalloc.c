@@ -1,21 +1,91 @@
 #include <suite.h>
 #include <cmocka.h>
 #include <mm/kmalloc.h>
+#include <mm/mm_stats.h>
+#include <mm/magazine.h>
+#include <mm/phys_alloc.h>
+#include <mm/page_alloc.h>
+#include <mm/vm.h>
+#include <mm/heap_prof.h>
 
 #include <time.h>
 
 
-extern u8_t __cache_idx_map[MAX_KMALLOC_SIZE / 8];
 extern kmem_cache_t __caches[];
+extern mag_cache_t __mags[];
 
 
-void *vm_alloc_block(u8_t flags, u16_t vmzone) {
+void *vm_alloc_block_pages(u8_t flags, u16_t vmzone, u8_t num_pages) {
     static size_t alloc_idx = 0;
 
-    // We'll use the physical mem aligned to the slab size.
-    slab_t *slabs_base = aligndown(__test_physical_mem + 0x100000, SLAB_ORDER + PAGE_ORDER);
+    // We'll use the physical mem aligned to the slab block size.
+    u8_t *blocks_base = aligndown(__test_physical_mem + 0x100000, SLAB_MAX_ORDER + PAGE_ORDER);
     
-    return slabs_base + alloc_idx++;
+    return blocks_base + (alloc_idx++) * SLAB_BLOCK_BYTES;
+}
+
+// Slab blocks are never reused by the mock above.
+int vm_free_block(virt_addr_t addr, u16_t vmzone) {
+    return 0;
+}
+
+// Large allocations of up to LARGE_PHYS_PAGES come from a bump allocator in test memory, anything bigger is vmalloced.
+#define LARGE_PHYS_ORDER 6
+#define LARGE_PHYS_PAGES (1 << LARGE_PHYS_ORDER)
+
+#define LARGE_PHYS_BLOCKS 8
+
+static size_t __phys_allocs, __phys_frees, __phys_shrinks, __vmallocs, __vfrees;
+static size_t __last_freed_pages;
+
+// Keep the blocks aligned to their size in the kernel's view of memory, like buddy blocks.
+static u8_t *__large_phys_base() {
+    return aligndown(__test_physical_mem + 0x400000, LARGE_PHYS_ORDER + PAGE_ORDER);
+}
+
+// Whether a large allocation is backed by one of the blocks handed out by phys_alloc below.
+static u8_t __phys_backed(void *ptr) {
+    u8_t *blocks_base = __large_phys_base();
+    return (u8_t *)ptr >= blocks_base && (u8_t *)ptr < blocks_base + LARGE_PHYS_BLOCKS * (LARGE_PHYS_PAGES << PAGE_ORDER);
+}
+
+phys_addr_t phys_alloc(size_t num_pages) {
+    static size_t next_block = 0;
+
+    if (num_pages > LARGE_PHYS_PAGES) {
+        return NULL;
+    }
+
+    u8_t *block = __large_phys_base() + (next_block++ % LARGE_PHYS_BLOCKS) * (LARGE_PHYS_PAGES << PAGE_ORDER);
+
+    ++__phys_allocs;
+    return block - __test_physical_mem;
+}
+
+void phys_block_shrink(phys_addr_t block_addr, size_t block_size, size_t target_size) {
+    ++__phys_shrinks;
+}
+
+void phys_free(phys_addr_t block_addr, size_t num_pages) {
+    ++__phys_frees;
+    __last_freed_pages = num_pages;
+}
+
+virt_addr_t vmalloc(size_t pages, u8_t flags) {
+    ++__vmallocs;
+    return aligndown(__test_physical_mem + 0x800000, VMALLOC_GRANULE_ORDER + PAGE_ORDER);
+}
+
+void vfree(virt_addr_t addr, size_t pages) {
+    ++__vfrees;
+    __last_freed_pages = pages;
+}
+
+static size_t __vmalloc_grows;
+
+int vmalloc_grow(virt_addr_t addr, size_t pages, size_t new_pages, u8_t flags) {
+    ++__vmalloc_grows;
+    return 0;
 }
 
 
@@ -24,8 +94,14 @@ static void test_kmalloc_init(void **state) {
 
     for (u8_t i = 0; i < sizeof(kmalloc_sizes) / sizeof(u16_t); ++i) {
         assert_int_equal(kmalloc_sizes[i], __caches[i].obj_cell_size);
+        assert_true(__caches[i].slab_order <= SLAB_MAX_ORDER);
     }
 
+    // The largest classes get bigger slabs so they don't waste most of the slab.
+    assert_int_equal(SLAB_ORDER, __caches[0].slab_order);
+    assert_int_equal(SLAB_MAX_ORDER, __caches[9].slab_order);
+    assert_true(__caches[9].objs_per_slab >= SLAB_MIN_OBJECTS);
+
     // Ensure allocations are mapped correctly
     for (u16_t alloc_size = 1; alloc_size <= MAX_KMALLOC_SIZE; ++alloc_size) {
         u16_t first_fit = 0;
@@ -35,7 +111,16 @@ static void test_kmalloc_init(void **state) {
         }
 
         assert_int_equal(first_fit, __cache_idx_map[(alloc_size + 7) >> 3]);
+        assert_int_equal(first_fit, KMALLOC_SIZE_CLASS(alloc_size));
     }
+
+    // Constant sizes are dispatched at compile time.
+    _Static_assert(KMALLOC_SIZE_CLASS(sizeof(kmem_cache_t)) < KMALLOC_NUM_SIZES, "kmem_cache_t fits kmalloc");
+    _Static_assert(KMALLOC_SIZE_CLASS(MAX_KMALLOC_SIZE) == KMALLOC_NUM_SIZES - 1, "largest class");
+
+    void *cache_obj = kmalloc(sizeof(kmem_cache_t));
+    assert_int_equal(__cache_idx_map[(sizeof(kmem_cache_t) + 7) >> 3], cache_id_for_alloc(cache_obj));
+    kfree(cache_obj);
 }
 
 static void test_kmalloc(void **state) {
@@ -43,7 +128,7 @@ static void test_kmalloc(void **state) {
 
     for (u16_t i = 1; i <= MAX_KMALLOC_SIZE; ++i) {
         void *ptr = kmalloc(i);
-        slab_t *slab = aligndown(ptr, SLAB_ORDER + PAGE_ORDER);
+        slab_t *slab = slab_of(ptr);
 
         u16_t expected_cache = __cache_idx_map[(i + 7) >> 3];
         assert_int_equal(expected_cache, slab->header.cache_id);
@@ -70,11 +155,326 @@ static void test_kfree(void **state) {
         u8_t alloc_objects = 0;
         for (u8_t i = 0; i < sizeof(kmalloc_sizes) / sizeof(u16_t); ++i) {
             kmem_cache_t *cache = __caches + i;
-            alloc_objects += cache->allocated_objects;
+            // Freed objects wait in the magazines until they're flushed back to the slabs.
+            alloc_objects += cache->allocated_objects - mag_cache_objects(__mags + i);
         }
 
         assert_int_equal(alloc_objects, 100 - i - 1);
     }
+
+    kmalloc_flush();
+
+    for (u8_t i = 0; i < sizeof(kmalloc_sizes) / sizeof(u16_t); ++i) {
+        assert_int_equal(0, __caches[i].allocated_objects);
+    }
+}
+
+
+// Objects parked in the depot don't keep their slabs alive once the page allocator runs low.
+static void test_kmalloc_shrink(void **state) {
+    kmalloc_init();
+
+    kmem_cache_t *cache = kmalloc_cache(KMALLOC_NUM_SIZES - 1);
+    mag_cache_t *mc = &__mags[KMALLOC_NUM_SIZES - 1];
+    void *allocations[6 * MAG_ROUNDS];
+
+    for (u16_t i = 0; i < 6 * MAG_ROUNDS; ++i) {
+        allocations[i] = kmalloc(MAX_KMALLOC_SIZE);
+    }
+
+    for (u16_t i = 0; i < 6 * MAG_ROUNDS; ++i) {
+        kfree(allocations[i]);
+    }
+
+    assert_true(mc->depot.full_count > 0);
+
+    pfa_shrink();
+
+    // Only the CPU's own magazines still hold objects, everything else went back to the slabs and was reaped.
+    assert_int_equal(0, mc->depot.full_count);
+    assert_int_equal(0, mc->depot.empty_count);
+    assert_true(mag_cache_objects(mc) <= 2 * MAG_ROUNDS);
+    assert_int_equal(mag_cache_objects(mc), cache->allocated_objects);
+    assert_int_equal(0, cache->total_free_slabs);
+
+    kmalloc_flush();
+}
+
+
+static void test_kmalloc_bulk(void **state) {
+    kmalloc_init();
+
+    void *allocations[100];
+    kmem_cache_t *cache = kmalloc_cache(__cache_idx_map[(100 + 7) >> 3]);
+    u32_t allocated = cache->allocated_objects;
+
+    assert_int_equal(50, kmalloc_bulk(100, allocations, 50));
+    assert_int_equal(50, kmalloc_bulk(8, allocations + 50, 50));
+    assert_int_equal(0, kmalloc_bulk(MAX_KMALLOC_SIZE + 1, allocations, 50));
+    assert_int_equal(allocated + 50, cache->allocated_objects);
+
+    for (u8_t i = 0; i < 100; ++i) {
+        u16_t expected_cache = __cache_idx_map[((i < 50 ? 100 : 8) + 7) >> 3];
+        assert_int_equal(expected_cache, cache_id_for_alloc(allocations[i]));
+    }
+
+    kfree_bulk(allocations, 100);
+
+    // Bulk frees skip the magazines.
+    assert_int_equal(allocated, cache->allocated_objects);
+    assert_int_equal(0, mag_cache_objects(&__mags[__cache_idx_map[(8 + 7) >> 3]]));
+}
+
+
+static void test_kmalloc_large(void **state) {
+    kmalloc_init();
+
+    size_t phys_allocs = __phys_allocs, phys_frees = __phys_frees, shrinks = __phys_shrinks;
+    size_t vmallocs = __vmallocs, vfrees = __vfrees;
+
+    // Just above the slab sizes, a single page block carved out of a SLAB_BLOCK_BYTES block.
+    u8_t *small = kmalloc(MAX_KMALLOC_SIZE + 1);
+    assert_non_null(small);
+    assert_int_equal(KMALLOC_LARGE_ID, cache_id_for_alloc(small));
+    assert_true(__phys_backed(small));
+    assert_int_equal(phys_allocs + 1, __phys_allocs);
+    assert_int_equal(shrinks + 1, __phys_shrinks);
+    assert_int_equal(vmallocs, __vmallocs);
+    memset(small, 0xAB, MAX_KMALLOC_SIZE + 1);
+
+    kfree(small);
+    assert_int_equal(phys_frees + 1, __phys_frees);
+    assert_int_equal(1, __last_freed_pages);
+
+    // Whole buddy blocks don't need shrinking.
+    u8_t *block = kmalloc((16 << PAGE_ORDER) - KMALLOC_LARGE_HEADER);
+    assert_int_equal(KMALLOC_LARGE_ID, cache_id_for_alloc(block));
+    assert_true(__phys_backed(block));
+    assert_int_equal(shrinks + 1, __phys_shrinks);
+    assert_int_equal(vmallocs, __vmallocs);
+
+    // Too big for the physical allocator, served from the vmalloc zone.
+    u8_t *mapped = kmalloc(100 << PAGE_ORDER);
+    assert_non_null(mapped);
+    assert_int_equal(KMALLOC_LARGE_ID, cache_id_for_alloc(mapped));
+    assert_false(__phys_backed(mapped));
+    assert_int_equal(vmallocs + 1, __vmallocs);
+
+    void *objs[] = { block, mapped };
+    kfree_bulk(objs, 2);
+
+    assert_int_equal(phys_frees + 2, __phys_frees);
+    assert_int_equal(vfrees + 1, __vfrees);
+    assert_int_equal(101, __last_freed_pages);
+}
+
+
+static void test_krealloc(void **state) {
+    kmalloc_init();
+
+    // Growing within the size class stays in place.
+    u8_t *ptr = krealloc(NULL, 10);
+    assert_int_equal(16, ksize(ptr));
+    memset(ptr, 0x5A, 10);
+    assert_ptr_equal(ptr, krealloc(ptr, 16));
+
+    // Outgrowing it moves the contents to a bigger class.
+    u8_t *moved = krealloc(ptr, 100);
+    assert_ptr_not_equal(ptr, moved);
+    assert_int_equal(120, ksize(moved));
+    for (u8_t i = 0; i < 10; ++i) {
+        assert_int_equal(0x5A, moved[i]);
+    }
+
+    // Moving into a large allocation and shrinking it in place.
+    size_t shrinks = __phys_shrinks, phys_frees = __phys_frees, vmallocs = __vmallocs;
+    u8_t *large = krealloc(moved, 3 << PAGE_ORDER);
+    assert_int_equal(KMALLOC_LARGE_ID, cache_id_for_alloc(large));
+    assert_true(__phys_backed(large));
+    assert_int_equal(vmallocs, __vmallocs);
+    assert_int_equal((4 << PAGE_ORDER) - KMALLOC_LARGE_HEADER, ksize(large));
+    assert_int_equal(0x5A, large[9]);
+
+    assert_ptr_equal(large, krealloc(large, PAGE_SIZE));
+    assert_int_equal(shrinks + 1, __phys_shrinks);
+    assert_int_equal((2 << PAGE_ORDER) - KMALLOC_LARGE_HEADER, ksize(large));
+
+    // Buddy blocks can't grow so they're copied, vmalloc memory grows in place.
+    size_t grows = __vmalloc_grows;
+    u8_t *mapped = krealloc(large, 100 << PAGE_ORDER);
+    assert_ptr_not_equal(large, mapped);
+    assert_false(__phys_backed(mapped));
+    assert_int_equal(vmallocs + 1, __vmallocs);
+    assert_int_equal(phys_frees + 1, __phys_frees);
+    assert_int_equal(0x5A, mapped[9]);
+
+    assert_ptr_equal(mapped, krealloc(mapped, 120 << PAGE_ORDER));
+    assert_int_equal(grows + 1, __vmalloc_grows);
+    assert_int_equal((121 << PAGE_ORDER) - KMALLOC_LARGE_HEADER, ksize(mapped));
+
+    size_t vfrees = __vfrees;
+    assert_null(krealloc(mapped, 0));
+    assert_int_equal(vfrees + 1, __vfrees);
+}
+
+
+static void test_kmalloc_atomic(void **state) {
+    kmalloc_init();
+    kmalloc_set_pool(MAX_KMALLOC_SIZE, 2);
+
+    kmem_cache_t *cache = kmalloc_cache(KMALLOC_NUM_SIZES - 1);
+    assert_int_equal(2, cache->pool_count);
+
+    // Large allocations can't be made atomically.
+    size_t phys_allocs = __phys_allocs;
+    assert_null(kmalloc_flags(MAX_KMALLOC_SIZE + 1, MM_ATOMIC));
+    assert_int_equal(phys_allocs, __phys_allocs);
+
+    // Drain the magazines and slabs of the class from an interrupt handler, down into the pool.
+    u64_t grows = cache->stats.grows;
+    void *obj;
+
+    __irq_depth[cpu_id()] = 1;
+    while ((obj = kmalloc(MAX_KMALLOC_SIZE)) != NULL) {
+        assert_int_equal(KMALLOC_NUM_SIZES - 1, cache_id_for_alloc(obj));
+    }
+    __irq_depth[cpu_id()] = 0;
+
+    assert_int_equal(grows, cache->stats.grows);
+    assert_int_equal(2, cache->stats.pool_allocs);
+    assert_int_equal(0, cache->pool_count);
+
+    // Back outside of the interrupt handler the pool is refilled.
+    assert_non_null(kmalloc_flags(MAX_KMALLOC_SIZE, MM_NORMAL));
+    assert_int_equal(2, cache->pool_count);
+    kmalloc_set_pool(MAX_KMALLOC_SIZE, 0);
+}
+
+
+// Output of printk, the heap profile dump is checked against it.
+static char __printed[1024];
+static size_t __printed_len = 0;
+
+void kputchar(const char character, const u8_t fg_color, const u8_t bg_color) {
+    if (__printed_len < sizeof(__printed) - 1) {
+        __printed[__printed_len++] = character;
+        __printed[__printed_len] = '\0';
+    }
+}
+
+static void test_heap_prof(void **state) {
+    kmalloc_init();
+    kmem_cache_t *cache = kmem_cache_create("test_prof", 40, 8, NULL);
+    heap_prof_start(1);
+
+    void *small[10];
+    void *big[3];
+    heap_prof_site_t sites[HEAP_PROF_SITES];
+
+    for (u8_t i = 0; i < 10; ++i) {
+        small[i] = kmalloc(100);
+    }
+
+    for (u8_t i = 0; i < 3; ++i) {
+        big[i] = __kmalloc(2000 + i);
+    }
+
+    for (u8_t i = 0; i < 5; ++i) {
+        kfree(small[i]);
+    }
+
+    void *obj = slab_alloc(cache);
+
+    // Sites are ordered by live bytes.
+    assert_int_equal(3, heap_prof_sites(sites, HEAP_PROF_SITES));
+    assert_int_equal(3 * 2040, sites[0].live_bytes);
+    assert_int_equal(3, sites[0].allocs);
+
+    assert_int_equal(5 * 120, sites[1].live_bytes);
+    assert_int_equal(10 * 120, sites[1].peak_bytes);
+    assert_int_equal(10, sites[1].allocs);
+    assert_int_equal(5, sites[1].frees);
+
+    assert_int_equal(40, sites[2].live_bytes);
+    assert_ptr_not_equal(sites[0].site, sites[1].site);
+
+    // The dump prints a line per site in the same order.
+    __printed_len = 0;
+    heap_prof_dump();
+
+    const char *header = strstr(__printed, "Heap profile (sampling every 1 bytes, 0 samples dropped):\n"
+        "site: live bytes, peak bytes, allocs/frees\n");
+    const char *big_line = strstr(__printed, ": 6120, 6120, 3/0\n");
+    const char *small_line = strstr(__printed, ": 600, 1200, 10/5\n");
+    const char *obj_line = strstr(__printed, ": 40, 40, 1/0\n");
+
+    assert_ptr_equal(__printed, header);
+    assert_true(header < big_line && big_line < small_line && small_line < obj_line);
+
+    slab_free(cache, obj);
+    kfree_bulk(big, 3);
+    assert_int_equal(1, heap_prof_sites(sites, 1));
+    assert_int_equal(5 * 120, sites[0].live_bytes);
+    assert_int_equal(0, heap_prof_dropped());
+
+    // Sampled, every sample stands for a whole period.
+    heap_prof_start(4096);
+    for (u8_t i = 10; i < 110; ++i) {
+        kfree(i < 15 ? small[i - 10] : kmalloc(100));
+    }
+
+    assert_int_equal(1, heap_prof_sites(sites, HEAP_PROF_SITES));
+    assert_int_equal(95 * 120 / 4096, sites[0].allocs);
+    assert_int_equal(sites[0].allocs, sites[0].frees);
+    assert_int_equal(4096, sites[0].peak_bytes);
+    assert_int_equal(0, sites[0].live_bytes);
+
+    heap_prof_stop();
+    assert_int_equal(0, heap_prof_sites(sites, HEAP_PROF_SITES));
+}
+
+
+static void test_kmalloc_stats(void **state) {
+    kmalloc_init();
+    mm_stats_reset_latency();
+
+    kmem_cache_t *cache = kmalloc_cache(0);
+    u64_t allocs = cache->stats.allocs;
+    void *allocations[50];
+
+    for (u8_t i = 0; i < 50; ++i) {
+        allocations[i] = kmalloc(8);
+    }
+
+    for (u8_t i = 0; i < 50; ++i) {
+        kfree(allocations[i]);
+    }
+
+    // The slabs are only touched to fill whole magazines.
+    u64_t slab_allocs = cache->stats.allocs - allocs;
+    assert_int_equal(0, slab_allocs % MAG_ROUNDS);
+    assert_in_range(slab_allocs, 50, 50 + MAG_ROUNDS);
+    // Magazines are slab allocated as well.
+    assert_true(mm_latency_hist(MM_LAT_SLAB_ALLOC)->samples >= slab_allocs);
+
+    kmalloc_flush();
+    assert_int_equal(cache->stats.allocs, cache->stats.frees);
+    assert_int_equal(0, cache->stats.failures);
+    assert_null(kmalloc_cache(sizeof(kmalloc_sizes) / sizeof(u16_t)));
+
+    const mm_latency_hist_t *latency = mm_latency_hist(MM_LAT_KMALLOC);
+    assert_int_equal(50, latency->samples);
+    assert_true(latency->max_cycles * 50 >= latency->total_cycles);
+
+    u64_t bucketed = 0;
+    for (u8_t bucket = 0; bucket < MM_LAT_BUCKETS; ++bucket) {
+        bucketed += latency->buckets[bucket];
+    }
+
+    assert_int_equal(50, bucketed);
+    assert_int_equal(MM_LAT_BUCKETS - 1, mm_latency_bucket(~0ul));
+    assert_int_equal(10, mm_latency_bucket(1024));
+    assert_int_equal(10, mm_latency_bucket(2047));
 }
 
 
@@ -83,6 +483,13 @@ int main(void) {
         cmocka_unit_test(test_kmalloc_init),
         cmocka_unit_test(test_kmalloc),
         cmocka_unit_test(test_kfree),
+        cmocka_unit_test(test_kmalloc_shrink),
+        cmocka_unit_test(test_kmalloc_bulk),
+        cmocka_unit_test(test_kmalloc_large),
+        cmocka_unit_test(test_krealloc),
+        cmocka_unit_test(test_kmalloc_atomic),
+        cmocka_unit_test(test_heap_prof),
+        cmocka_unit_test(test_kmalloc_stats),
     };
 
     cmocka_run_group_tests(tests, suite_setup, suite_teardown);
@@ -0,0 +1,138 @@
+#include <suite.h>
+#include <setup/setup_bootinfo.h>
+#include <cmocka.h>
+
+#include <mm.h>
+#include <mm/slab.h>
+#include <mm/magazine.h>
+
+#include <utility/math.h>
+
+
+#define NUM_TEST_OBJS ((MAG_DEPOT_MAX_FULL + 4) * MAG_ROUNDS)
+
+
+void *vm_alloc_block_pages(u8_t flags, u16_t vmzone, u8_t num_pages) {
+    static size_t alloc_idx = 0;
+
+    // We'll use the physical mem aligned to the slab block size.
+    u8_t *blocks_base = aligndown(__test_physical_mem + 0x100000, SLAB_MAX_ORDER + PAGE_ORDER);
+
+    return blocks_base + (alloc_idx++) * SLAB_BLOCK_BYTES;
+}
+
+// Slab blocks are never reused by the mock above.
+int vm_free_block(virt_addr_t addr, u16_t vmzone) {
+    return 0;
+}
+
+
+kmem_cache_t cache;
+mag_cache_t mc;
+
+
+static int setup_magazines(void **state) {
+    magazine_init();
+    slab_cache_init(&cache, 16, 8, 0, 0, 0);
+    mag_cache_init(&mc, &cache);
+    return 0;
+}
+
+
+// Once a magazine is loaded, alloc/free pairs never go back to the slab lists.
+static void test_mag_fast_path(void **state) {
+    void *obj = mag_alloc(&mc);
+    assert_non_null(obj);
+
+    assert_int_equal(MAG_ROUNDS, cache.stats.allocs);
+    assert_int_equal(MAG_ROUNDS - 1, mag_cache_objects(&mc));
+
+    mag_free(&mc, obj);
+
+    for (u16_t i = 0; i < 100; ++i) {
+        void *reused = mag_alloc(&mc);
+
+        // The most recently freed object is handed out first.
+        assert_ptr_equal(obj, reused);
+        mag_free(&mc, reused);
+    }
+
+    assert_int_equal(MAG_ROUNDS, cache.stats.allocs);
+    assert_int_equal(0, cache.stats.frees);
+    assert_int_equal(MAG_ROUNDS, mag_cache_objects(&mc));
+
+    mag_cache_flush(&mc);
+
+    assert_int_equal(0, cache.allocated_objects);
+    assert_int_equal(0, mag_cache_objects(&mc));
+}
+
+
+// Full magazines go through the depot and are reused before the slabs are touched again.
+static void test_mag_depot(void **state) {
+    void *objs[4 * MAG_ROUNDS];
+
+    for (u16_t i = 0; i < 4 * MAG_ROUNDS; ++i) {
+        objs[i] = mag_alloc(&mc);
+        assert_non_null(objs[i]);
+    }
+
+    for (u16_t i = 0; i < 4 * MAG_ROUNDS; ++i) {
+        mag_free(&mc, objs[i]);
+    }
+
+    // Two magazines stay loaded on the CPU and the rest sit in the depot.
+    assert_int_equal(2, mc.depot.full_count);
+    assert_int_equal(4 * MAG_ROUNDS, mag_cache_objects(&mc));
+    assert_int_equal(0, cache.stats.frees);
+
+    u64_t slab_allocs = cache.stats.allocs;
+
+    for (u16_t i = 0; i < 4 * MAG_ROUNDS; ++i) {
+        objs[i] = mag_alloc(&mc);
+    }
+
+    assert_int_equal(slab_allocs, cache.stats.allocs);
+    assert_int_equal(0, mc.depot.full_count);
+    assert_int_equal(0, mag_cache_objects(&mc));
+
+    for (u16_t i = 0; i < 4 * MAG_ROUNDS; ++i) {
+        mag_free(&mc, objs[i]);
+    }
+
+    mag_cache_flush(&mc);
+    assert_int_equal(0, cache.allocated_objects);
+}
+
+
+// The depot doesn't grow without bound, whole magazines are returned to the slabs past MAG_DEPOT_MAX_FULL.
+static void test_mag_depot_limit(void **state) {
+    void *objs[NUM_TEST_OBJS];
+
+    for (u16_t i = 0; i < NUM_TEST_OBJS; ++i) {
+        objs[i] = mag_alloc(&mc);
+    }
+
+    for (u16_t i = 0; i < NUM_TEST_OBJS; ++i) {
+        mag_free(&mc, objs[i]);
+    }
+
+    assert_int_equal(MAG_DEPOT_MAX_FULL, mc.depot.full_count);
+    assert_int_equal((MAG_DEPOT_MAX_FULL + 2) * MAG_ROUNDS, mag_cache_objects(&mc));
+    assert_int_equal(2 * MAG_ROUNDS, cache.stats.frees);
+    assert_int_equal(cache.allocated_objects, mag_cache_objects(&mc));
+
+    mag_cache_flush(&mc);
+    assert_int_equal(0, cache.allocated_objects);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup(test_mag_fast_path, setup_magazines),
+        cmocka_unit_test_setup(test_mag_depot, setup_magazines),
+        cmocka_unit_test_setup(test_mag_depot_limit, setup_magazines),
+    };
+
+    cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
@@ -0,0 +1,168 @@
+#include <suite.h>
+#include <setup/setup_bootinfo.h>
+#include <cmocka.h>
+
+#include <mm.h>
+#include <mm/page.h>
+#include <mm/page_alloc.h>
+
+
+// The zones log their initialization, there's no VGA text area in user space.
+void kputstr(const char *string, const u8_t fg_color, const u8_t bg_color) {
+}
+
+
+// The zones' bitmap reservations clobber the boot info, so the zones are only initialized once for the suite.
+static int setup_pfa(void **state) {
+    init_global_page_map();
+    pfa_init();
+    return 0;
+}
+
+
+// The test machine has 10MB of memory so only the DMA zone is populated.
+static void test_pfa_init(void **state) {
+    pfa_zone_t *dma_zone = pfa_zone(PFA_ZONE_DMA);
+    pfa_zone_t *general_zone = pfa_zone(PFA_ZONE_GENERAL);
+
+    assert_int_equal(DMA_ZONE_BEGIN, dma_zone->start_addr);
+    assert_int_equal(PHYS_MEM_SIZE, dma_zone->end_addr);
+    assert_int_equal(PHYS_MEM_SIZE - DMA_ZONE_BEGIN, dma_zone->buddy.free_space_bytes);
+
+    size_t zone_pages = (PHYS_MEM_SIZE - DMA_ZONE_BEGIN) >> PAGE_ORDER;
+    assert_int_equal(zone_pages >> PFA_WATERMARK_LOW_SHIFT, dma_zone->watermark_low);
+    assert_int_equal(zone_pages >> (PFA_WATERMARK_LOW_SHIFT - 1), dma_zone->watermark_high);
+    assert_int_equal(zone_pages >> (PFA_WATERMARK_LOW_SHIFT + 1), dma_zone->watermark_min);
+
+    assert_true(general_zone->start_addr >= general_zone->end_addr);
+}
+
+
+// General allocations may only take the DMA zone down to its high watermark, DMA allocations can use all of it.
+static void test_pfa_dma_fallback(void **state) {
+    pfa_zone_t *dma_zone = pfa_zone(PFA_ZONE_DMA);
+    size_t initial_free_bytes = dma_zone->buddy.free_space_bytes;
+
+    phys_addr_t blocks[3];
+
+    blocks[0] = pfa_alloc_block(9, PFA_GENERAL);
+    blocks[1] = pfa_alloc_block(9, PFA_GENERAL);
+
+    assert_int_not_equal(NULL, blocks[0]);
+    assert_int_not_equal(NULL, blocks[1]);
+
+    // Another 2MB would take the zone below the high watermark.
+    assert_int_equal(NULL, pfa_alloc_block(9, PFA_GENERAL));
+
+    blocks[2] = pfa_alloc_block(9, PFA_DMA);
+    assert_int_not_equal(NULL, blocks[2]);
+    assert_true(dma_zone->under_pressure);
+
+    for (u8_t i = 0; i < 3; ++i) {
+        assert_in_range(blocks[i], DMA_ZONE_BEGIN, DMA_ZONE_END - 1);
+        assert_int_equal(0, blocks[i] & MASK_FOR_FIRST_N_BITS(9 + PAGE_ORDER));
+
+        page_info_t *page = page_info(blocks[i]);
+        assert_true(page->flags & PAGE_BUDDY);
+        assert_int_equal(9, page->buddy_alloc_info.order);
+    }
+
+    // Blocks are freed using the order recorded at allocation time.
+    for (u8_t i = 0; i < 3; ++i) {
+        _pfa_free_block(blocks[i]);
+        assert_false(page_info(blocks[i])->flags & PAGE_BUDDY);
+    }
+
+    assert_false(dma_zone->under_pressure);
+    assert_int_equal(initial_free_bytes, dma_zone->buddy.free_space_bytes);
+    assert_int_equal(0, dma_zone->buddy.allocated_bytes);
+}
+
+
+// A shrunk block is freed whole by _pfa_free_block, not just its largest power of 2 part.
+static void test_pfa_free_shrunk_block(void **state) {
+    pfa_zone_t *dma_zone = pfa_zone(PFA_ZONE_DMA);
+    size_t initial_free_bytes = dma_zone->buddy.free_space_bytes;
+
+    phys_addr_t block = pfa_alloc_block(9, PFA_DMA);
+    assert_int_not_equal(NULL, block);
+
+    // 384 pages are an order 8 and an order 7 block, both too large for the per-CPU caches.
+    pfa_shrink_block(block, 9, 384);
+
+    page_info_t *page = page_info(block);
+    assert_int_equal(8, page->buddy_alloc_info.order);
+    assert_int_equal(384, page->buddy_alloc_info.num_pages);
+    assert_int_equal(initial_free_bytes - (384ul << PAGE_ORDER), dma_zone->buddy.free_space_bytes);
+
+    _pfa_free_block(block);
+
+    assert_false(page->flags & PAGE_BUDDY);
+    assert_int_equal(initial_free_bytes, dma_zone->buddy.free_space_bytes);
+    assert_int_equal(0, dma_zone->buddy.allocated_bytes);
+}
+
+
+// A block held back by a cache, handed back to the page frame allocator when it's shrunk.
+static phys_addr_t __cached_block = NULL;
+static size_t __shrinker_calls = 0;
+
+static size_t __release_cached_block() {
+    ++__shrinker_calls;
+
+    if (__cached_block == NULL) {
+        return 0;
+    }
+
+    pfa_free_sized_block(__cached_block, 9);
+    __cached_block = NULL;
+    return 1ul << 9;
+}
+
+// Bulk allocations run the shrinkers like pfa_alloc_block: deferred by atomic callers and once before coming up short.
+static void test_pfa_alloc_bulk_shrink(void **state) {
+    pfa_zone_t *dma_zone = pfa_zone(PFA_ZONE_DMA);
+    size_t initial_free_bytes = dma_zone->buddy.free_space_bytes;
+    phys_addr_t blocks[2];
+
+    pfa_register_shrinker(__release_cached_block);
+
+    // General allocations may only take two 2MB blocks from the DMA zone, the cache holds one of them.
+    __cached_block = pfa_alloc_block(9, PFA_GENERAL);
+    assert_int_not_equal(NULL, __cached_block);
+
+    assert_int_equal(1, pfa_alloc_bulk(9, PFA_GENERAL | PFA_ATOMIC, blocks, 2));
+    assert_int_equal(0, __shrinker_calls);
+    assert_int_not_equal(NULL, __cached_block);
+    pfa_free_bulk(blocks, 1, 9);
+
+    // The next allocation which isn't atomic runs the deferred shrink before allocating.
+    assert_int_equal(2, pfa_alloc_bulk(9, PFA_GENERAL, blocks, 2));
+    assert_int_equal(1, __shrinker_calls);
+    assert_int_equal(NULL, __cached_block);
+    pfa_free_bulk(blocks, 2, 9);
+
+    // Coming up short shrinks once and retries for the rest of the batch.
+    __cached_block = pfa_alloc_block(9, PFA_GENERAL);
+    __shrinker_calls = 0;
+
+    assert_int_equal(2, pfa_alloc_bulk(9, PFA_GENERAL, blocks, 2));
+    assert_int_equal(1, __shrinker_calls);
+    assert_int_equal(NULL, __cached_block);
+    pfa_free_bulk(blocks, 2, 9);
+
+    assert_int_equal(initial_free_bytes, dma_zone->buddy.free_space_bytes);
+    assert_int_equal(0, dma_zone->buddy.allocated_bytes);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup(test_pfa_init, setup_pfa),
+        cmocka_unit_test(test_pfa_dma_fallback),
+        cmocka_unit_test(test_pfa_free_shrunk_block),
+        cmocka_unit_test(test_pfa_alloc_bulk_shrink),
+    };
+
+    cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
@@ -0,0 +1,126 @@
+#include <suite.h>
+#include <setup/setup_bootinfo.h>
+#include <cmocka.h>
+
+#include <mm.h>
+#include <mm/buddy_alloc.h>
+#include <mm/page.h>
+#include <mm/pcp.h>
+
+
+void *bitmap_pool;
+buddy_allocator_t allocator;
+pcp_cache_t pcp;
+
+
+static int setup_pcp(void **state) {
+    init_global_page_map();
+
+    bitmap_pool = malloc(buddy_bitmap_pages(0x1000, PHYS_MEM_SIZE) << PAGE_ORDER);
+
+    buddy_init(&allocator, bitmap_pool, 0x1000, PHYS_MEM_SIZE);
+    pcp_init(&pcp, &allocator);
+    return 0;
+}
+
+
+static int teardown_pcp(void **state) {
+    free(bitmap_pool);
+    return 0;
+}
+
+
+// An empty cache refills a batch of blocks from the buddy allocator at once.
+static void test_pcp_refill(void **state) {
+    phys_addr_t block = pcp_alloc_block(&pcp, 0);
+    assert_int_not_equal(NULL, block);
+
+    assert_int_equal(PCP_BATCH << PAGE_ORDER, allocator.allocated_bytes);
+    assert_int_equal(PCP_BATCH - 1, pcp.lists[0].count);
+
+    for (u8_t i = 1; i < PCP_BATCH; ++i) {
+        pcp_alloc_block(&pcp, 0);
+    }
+
+    // No more calls into the buddy allocator for the rest of the batch.
+    assert_int_equal(PCP_BATCH << PAGE_ORDER, allocator.allocated_bytes);
+    assert_int_equal(0, pcp.lists[0].count);
+
+    block = pcp_alloc_block(&pcp, 1);
+    assert_int_not_equal(NULL, block);
+    assert_int_equal(0, block & MASK_FOR_FIRST_N_BITS(1 + PAGE_ORDER));
+    assert_int_equal((PCP_BATCH + (PCP_BATCH << 1)) << PAGE_ORDER, allocator.allocated_bytes);
+}
+
+
+// Recently freed blocks are handed out first.
+static void test_pcp_hot_blocks_first(void **state) {
+    phys_addr_t first = pcp_alloc_block(&pcp, 0);
+    phys_addr_t second = pcp_alloc_block(&pcp, 0);
+
+    pcp_free_block(&pcp, first, 0);
+    pcp_free_block(&pcp, second, 0);
+
+    assert_int_equal(second, pcp_alloc_block(&pcp, 0));
+    assert_int_equal(first, pcp_alloc_block(&pcp, 0));
+
+    // Cold blocks are handed out last.
+    phys_addr_t cold = first;
+    pcp_free_block_cold(&pcp, cold, 0);
+    pcp_free_block(&pcp, second, 0);
+
+    for (u8_t i = 0; i < PCP_BATCH - 1; ++i) {
+        assert_int_not_equal(cold, pcp_alloc_block(&pcp, 0));
+    }
+
+    assert_int_equal(cold, pcp_alloc_block(&pcp, 0));
+}
+
+
+// A full cache drains a batch of its coldest blocks to the buddy allocator.
+static void test_pcp_drain(void **state) {
+    phys_addr_t blocks[PCP_HIGH + 1];
+
+    for (u8_t i = 0; i <= PCP_HIGH; ++i) {
+        blocks[i] = pcp_alloc_block(&pcp, 0);
+    }
+
+    // Return the rest of the last refill so the cache starts out empty.
+    pcp_drain(&pcp);
+    assert_int_equal((PCP_HIGH + 1) << PAGE_ORDER, allocator.allocated_bytes);
+
+    size_t allocated_bytes = allocator.allocated_bytes;
+
+    for (u8_t i = 0; i < PCP_HIGH; ++i) {
+        pcp_free_block(&pcp, blocks[i], 0);
+    }
+
+    assert_int_equal(PCP_HIGH, pcp.lists[0].count);
+    assert_int_equal(allocated_bytes, allocator.allocated_bytes);
+
+    pcp_free_block(&pcp, blocks[PCP_HIGH], 0);
+
+    assert_int_equal(PCP_HIGH - PCP_BATCH + 1, pcp.lists[0].count);
+    assert_int_equal(allocated_bytes - (PCP_BATCH << PAGE_ORDER), allocator.allocated_bytes);
+
+    // The hottest block is still cached.
+    assert_int_equal(blocks[PCP_HIGH], pcp_alloc_block(&pcp, 0));
+    pcp_free_block(&pcp, blocks[PCP_HIGH], 0);
+
+    pcp_drain(&pcp);
+
+    assert_int_equal(0, pcp.lists[0].count);
+    assert_int_equal(0, pcp.lists[1].count);
+    assert_int_equal(0, allocator.allocated_bytes);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_pcp_refill, setup_pcp, teardown_pcp),
+        cmocka_unit_test_setup_teardown(test_pcp_hot_blocks_first, setup_pcp, teardown_pcp),
+        cmocka_unit_test_setup_teardown(test_pcp_drain, setup_pcp, teardown_pcp),
+    };
+
+    cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
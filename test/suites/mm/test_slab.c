@@ -3,10 +3,13 @@
 #include <cmocka.h>
 #include <time.h>
 #include <assertions.h>
+#include <slab_colouring.h>
 
 #include <mm.h>
 #include <mm/vm.h>
 #include <mm/slab.h>
+#include <mm/page.h>
+#include <cpu/irq.h>
 
 #include <utility/math.h>
 
@@ -15,54 +18,91 @@ typedef struct __test_object_t {
 } test_obj_t;
 
 
-#define TEST_OBJS_PER_SLAB ((sizeof(slab_t) - sizeof(slab_header_t)) / sizeof(test_obj_t))
+#define TEST_OBJS_PER_SLAB ((SLAB_BYTES(SLAB_ORDER) - sizeof(slab_header_t)) / sizeof(test_obj_t))
 
 
-void *vm_alloc_block(u8_t flags, u16_t vmzone) {
+void *vm_alloc_block_pages(u8_t flags, u16_t vmzone, u8_t num_pages) {
     static size_t alloc_idx = 0;
 
-    // We'll use the physical mem aligned to the slab size.
-    slab_t *slabs_base = aligndown(__test_physical_mem + 0x100000, SLAB_ORDER + PAGE_ORDER);
+    // We'll use the physical mem aligned to the slab block size.
+    u8_t *blocks_base = aligndown(__test_physical_mem + 0x100000, SLAB_MAX_ORDER + PAGE_ORDER);
     
-    return slabs_base + alloc_idx++;
+    return blocks_base + (alloc_idx++) * SLAB_BLOCK_BYTES;
 }
 
 
-void __validate_slab_objs(kmem_cache_t *cache, slab_t *slab) {
-    u16_t first_obj = slab->header.first_free_idx;
+static size_t __freed_blocks = 0;
 
-    if (slab->header.free_count == 0) {
+int vm_free_block(virt_addr_t addr, u16_t vmzone) {
+    assert_aligned(addr, SLAB_BLOCK_BYTES);
+    ++__freed_blocks;
+    return 0;
+}
+
+
+// Off-slab slabs come from the top of physical memory, away from the slab blocks above.
+#define OFF_SLAB_BASE 0x800000
+
+static page_info_t __test_page_map[PHYS_MEM_SIZE >> PAGE_ORDER];
+
+phys_addr_t phys_alloc(size_t num_pages) {
+    static size_t alloc_idx = 0;
+
+    return OFF_SLAB_BASE + (alloc_idx++) * SLAB_BLOCK_BYTES;
+}
+
+
+static u8_t *__slab_data(kmem_cache_t *cache, slab_header_t *slab) {
+    if (cache->flags & SLAB_CACHE_OFF_SLAB) {
+        page_info_t *page = (page_info_t *)((u8_t *)slab - offsetof(page_info_t, slab_header));
+        return KPHYS_ADDR(page_address_from_info(page));
+    }
+
+    return ((slab_t *)slab)->__slab_data;
+}
+
+
+void __validate_slab_objs(kmem_cache_t *cache, slab_header_t *slab) {
+    u16_t first_obj = slab->first_free_offset;
+
+    if (slab->free_count == 0) {
         return;
     }
 
-    slab_object_t *obj = slab->__slab_data + first_obj * cache->obj_cell_size;
+    u8_t *objs_base = __slab_data(cache, slab) + slab->colour;
+    slab_object_t *obj = (slab_object_t *)(__slab_data(cache, slab) + first_obj);
     
     u16_t objs = 0;
 
     do {
+        // Free objects always start on a cell boundary, counting from the colour offset of the slab.
+        size_t offset = (u8_t *)obj - objs_base;
+        assert_int_equal(0, offset % cache->obj_cell_size);
+        assert_true(offset / cache->obj_cell_size < cache->objs_per_slab);
+
         ++objs;
         obj = obj->header.if_free.next_free;
     } while (obj != NULL);
 
-    assert_int_equal(slab->header.free_count, objs);
+    assert_int_equal(slab->free_count, objs);
 }
 
 
-void __validate_slab_list(kmem_cache_t *cache, slab_t *head, u16_t expected_num_slabs) {
+void __validate_slab_list(kmem_cache_t *cache, slab_header_t *head, u16_t expected_num_slabs) {
     if (head == NULL) {
         assert_int_equal(0, expected_num_slabs);
         return;
     }
 
-    slab_t *prev = NULL;
+    slab_header_t *prev = NULL;
     u16_t actual_num_slabs = 0;
 
     while (head != NULL) {
         __validate_slab_objs(cache, head);
-        assert_ptr_equal(prev, head->header.prev);
+        assert_ptr_equal(prev, head->prev);
 
         prev = head;
-        head = head->header.next;
+        head = head->next;
         ++actual_num_slabs;
     }
 
@@ -71,9 +111,11 @@ void __validate_slab_list(kmem_cache_t *cache, slab_t *head, u16_t expected_num_
 
 
 void __validate_cache_lists(kmem_cache_t *cache) {
-    assert_aligned(cache->free_slabs, sizeof(slab_t));
-    assert_aligned(cache->partial_slabs, sizeof(slab_t));
-    assert_aligned(cache->full_slabs, sizeof(slab_t));
+    if (!(cache->flags & SLAB_CACHE_OFF_SLAB)) {
+        assert_aligned(cache->free_slabs, SLAB_BLOCK_BYTES);
+        assert_aligned(cache->partial_slabs, SLAB_BLOCK_BYTES);
+        assert_aligned(cache->full_slabs, SLAB_BLOCK_BYTES);
+    }
 
     __validate_slab_list(cache, cache->free_slabs, cache->total_free_slabs);
     __validate_slab_list(cache, cache->partial_slabs, cache->total_partial_slabs);
@@ -83,13 +125,14 @@ void __validate_cache_lists(kmem_cache_t *cache) {
 
 void test_slab_cache_init(void **state) {
     kmem_cache_t cache;
-    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0);
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0, 0);
     
     assert_int_equal(0, cache.align_padding);
     assert_int_equal(16, cache.obj_size);
     assert_int_equal(16, cache.obj_cell_size);
-    assert_int_equal((sizeof(slab_t) - sizeof(slab_header_t)) % 16 + sizeof(slab_header_t), cache.slab_overhead);
-    assert_int_equal((sizeof(slab_t) - sizeof(slab_header_t)) / 16, cache.objs_per_slab);
+    assert_int_equal(SLAB_ORDER, cache.slab_order);
+    assert_int_equal((SLAB_BYTES(SLAB_ORDER) - sizeof(slab_header_t)) % 16 + sizeof(slab_header_t), cache.slab_overhead);
+    assert_int_equal((SLAB_BYTES(SLAB_ORDER) - sizeof(slab_header_t)) / 16, cache.objs_per_slab);
 
     assert_null(cache.partial_slabs);
     assert_null(cache.free_slabs);
@@ -110,7 +153,7 @@ void test_slab_cache_init(void **state) {
 
 void test_slab_alloc(void **state) {
     kmem_cache_t cache;
-    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0);
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0, 0);
 
     test_obj_t *obj = slab_alloc(&cache);
 
@@ -118,7 +161,7 @@ void test_slab_alloc(void **state) {
     __validate_cache_lists(&cache);
 
     assert_int_equal(1, cache.allocated_objects);
-    assert_int_equal(cache.objs_per_slab - 1, cache.partial_slabs->header.free_count);
+    assert_int_equal(cache.objs_per_slab - 1, cache.partial_slabs->free_count);
 
     // Reserve a free slab
     slab_cache_reserve(&cache, 3 * cache.objs_per_slab);
@@ -132,7 +175,7 @@ void test_slab_alloc(void **state) {
 
     __validate_slab_objs(&cache, cache.partial_slabs);
 
-    u16_t objs_to_alloc = cache.partial_slabs->header.free_count;
+    u16_t objs_to_alloc = cache.partial_slabs->free_count;
 
     // Fill up the partial slab, and verify that it goes to full_slabs
     for (u16_t i = 0; i < objs_to_alloc; ++i) {
@@ -151,12 +194,17 @@ void test_slab_alloc(void **state) {
     assert_int_equal(2, cache.total_free_slabs);
     assert_int_equal(cache.objs_per_slab + 1, cache.allocated_objects);
     __validate_cache_lists(&cache);
+
+    // One slab grown by the first allocation and three reserved.
+    assert_int_equal(4, cache.stats.grows);
+    assert_int_equal(cache.objs_per_slab + 1, cache.stats.allocs);
+    assert_int_equal(0, cache.stats.failures);
 }
 
 
 void test_slab_free(void **state) {
     kmem_cache_t cache;
-    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0);
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0, 0);
 
     test_obj_t *objects[TEST_OBJS_PER_SLAB];
 
@@ -193,7 +241,7 @@ void test_slab_free(void **state) {
 
     assert_int_equal(1, cache.total_partial_slabs);
     assert_int_equal(0, cache.total_full_slabs);
-    assert_int_equal(5, cache.partial_slabs->header.free_count);
+    assert_int_equal(5, cache.partial_slabs->free_count);
 
     assert_int_equal(cache.objs_per_slab - 5, cache.allocated_objects);
 
@@ -201,11 +249,324 @@ void test_slab_free(void **state) {
 }
 
 
+void test_off_slab(void **state) {
+    global_page_map = __test_page_map;
+
+    kmem_cache_t cache;
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 7, 0, SLAB_CACHE_OFF_SLAB);
+
+    // The objects get the whole slab.
+    assert_int_equal(SLAB_ORDER, cache.slab_order);
+    assert_int_equal(SLAB_BYTES(SLAB_ORDER) / sizeof(test_obj_t), cache.objs_per_slab);
+    assert_int_equal(0, cache.slab_overhead);
+
+    u16_t num_objs = cache.objs_per_slab + 1;
+    test_obj_t *objects[num_objs];
+
+    for (u16_t i = 0; i < num_objs; ++i) {
+        objects[i] = slab_alloc(&cache);
+    }
+
+    assert_int_equal(1, cache.total_full_slabs);
+    assert_int_equal(1, cache.total_partial_slabs);
+    assert_ptr_equal(KPHYS_ADDR(OFF_SLAB_BASE), objects[0]);
+    __validate_cache_lists(&cache);
+
+    // Every object of a slab, including those past its first page, maps to the header in the page map.
+    slab_header_t *header = off_slab_header(objects[0]);
+    assert_ptr_equal(&page_info(OFF_SLAB_BASE)->slab_header, header);
+    assert_ptr_equal(cache.full_slabs, header);
+
+    for (u16_t i = 0; i < cache.objs_per_slab; ++i) {
+        assert_ptr_equal(header, off_slab_header(objects[i]));
+        assert_int_equal(7, off_slab_header(objects[i])->cache_id);
+    }
+
+    assert_ptr_equal(cache.partial_slabs, off_slab_header(objects[num_objs - 1]));
+
+    for (u16_t i = 0; i < num_objs; ++i) {
+        slab_free(&cache, objects[i]);
+    }
+
+    assert_int_equal(0, cache.allocated_objects);
+    assert_int_equal(0, cache.total_full_slabs);
+    assert_int_equal(0, cache.total_partial_slabs);
+    assert_int_equal(2, cache.total_free_slabs);
+    __validate_cache_lists(&cache);
+}
+
+
+#define SHRINK_SLABS (SLAB_FREE_HIGH + 2)
+
+void test_slab_shrink(void **state) {
+    kmem_cache_t cache;
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0, 0);
+
+    u16_t num_objs = cache.objs_per_slab * SHRINK_SLABS;
+    test_obj_t *objects[num_objs];
+
+    for (u16_t i = 0; i < num_objs; ++i) {
+        objects[i] = slab_alloc(&cache);
+    }
+
+    assert_int_equal(SHRINK_SLABS, cache.total_full_slabs);
+    __freed_blocks = 0;
+
+    for (u16_t i = 0; i < num_objs; ++i) {
+        slab_free(&cache, objects[i]);
+        __validate_cache_lists(&cache);
+        assert_true(cache.total_free_slabs <= cache.free_slabs_high);
+    }
+
+    // Going over the high watermark shrinks the cache back to the low watermark, the last slab is freed after that.
+    assert_int_equal(SLAB_FREE_LOW + 1, cache.total_free_slabs);
+    assert_int_equal(SHRINK_SLABS - SLAB_FREE_LOW - 1, cache.stats.shrinks);
+    assert_int_equal(cache.stats.shrinks, __freed_blocks);
+    assert_int_equal(cache.total_free_slabs * cache.objs_per_slab, cache.total_free_objects);
+
+    assert_int_equal((SLAB_FREE_LOW + 1) << cache.slab_order, slab_cache_shrink(&cache, 0));
+    assert_int_equal(0, cache.total_free_slabs);
+    assert_int_equal(0, cache.total_free_objects);
+    assert_null(cache.free_slabs);
+}
+
+
+#define POOL_OBJS 4
+
+void test_slab_atomic(void **state) {
+    kmem_cache_t cache;
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0, 0);
+    slab_cache_set_pool(&cache, POOL_OBJS);
+
+    assert_int_equal(POOL_OBJS, cache.pool_count);
+    assert_int_equal(POOL_OBJS, cache.allocated_objects);
+    assert_int_equal(1, cache.stats.grows);
+
+    // Atomic allocations use up the free objects, then the pool, and never grow the cache.
+    u16_t free_objs = cache.total_free_objects;
+    test_obj_t *objects[free_objs + POOL_OBJS];
+
+    for (u16_t i = 0; i < free_objs + POOL_OBJS; ++i) {
+        objects[i] = slab_alloc_flags(&cache, MM_ATOMIC);
+        assert_non_null(objects[i]);
+    }
+
+    assert_int_equal(0, cache.pool_count);
+    assert_int_equal(POOL_OBJS, cache.stats.pool_allocs);
+    assert_null(slab_alloc_flags(&cache, MM_ATOMIC));
+    assert_int_equal(1, cache.stats.failures);
+    assert_int_equal(1, cache.stats.grows);
+
+    // Allocations from an interrupt handler are atomic whatever their flags.
+    __irq_depth[cpu_id()] = 1;
+    assert_null(slab_alloc(&cache));
+    __irq_depth[cpu_id()] = 0;
+
+    // The next normal allocation grows the cache and refills the pool.
+    test_obj_t *obj = slab_alloc(&cache);
+    assert_non_null(obj);
+    assert_int_equal(POOL_OBJS, cache.pool_count);
+    assert_int_equal(2, cache.stats.grows);
+    __validate_cache_lists(&cache);
+
+    slab_free(&cache, obj);
+    for (u16_t i = 0; i < free_objs + POOL_OBJS; ++i) {
+        slab_free(&cache, objects[i]);
+    }
+
+    slab_cache_set_pool(&cache, 0);
+    assert_int_equal(0, cache.pool_count);
+    assert_int_equal(0, cache.allocated_objects);
+    __validate_cache_lists(&cache);
+}
+
+
+void test_slab_reap(void **state) {
+    // Registered caches stay on the reap list for good.
+    static kmem_cache_t cache;
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0, 0);
+    slab_cache_register(&cache);
+    slab_cache_register(&cache);
+
+    slab_cache_reserve(&cache, cache.objs_per_slab * 2);
+    test_obj_t *obj = slab_alloc(&cache);
+    __freed_blocks = 0;
+
+    // Only the free slab is released, the partial one stays.
+    assert_int_equal(1 << cache.slab_order, slab_reap());
+    assert_int_equal(1, __freed_blocks);
+    assert_int_equal(0, cache.total_free_slabs);
+    assert_int_equal(1, cache.total_partial_slabs);
+    __validate_cache_lists(&cache);
+
+    slab_free(&cache, obj);
+    assert_int_equal(1 << cache.slab_order, slab_reap());
+    assert_int_equal(0, slab_reap());
+}
+
+
+void test_slab_bulk(void **state) {
+    kmem_cache_t cache;
+    slab_cache_init(&cache, sizeof(test_obj_t), _Alignof(test_obj_t), 0, 0, 0);
+
+    // Start off with a partial slab so the batch spans a partial slab, a free slab and a new slab.
+    test_obj_t *single = slab_alloc(&cache);
+    slab_cache_reserve(&cache, 1);
+
+    u16_t num_objs = cache.objs_per_slab * 2 + 3;
+    void *objects[num_objs];
+
+    assert_int_equal(num_objs, slab_alloc_bulk(&cache, objects, num_objs));
+    assert_int_equal(num_objs + 1, cache.allocated_objects);
+    assert_int_equal(num_objs + 1, cache.stats.allocs);
+    assert_int_equal(2, cache.total_full_slabs);
+    assert_int_equal(1, cache.total_partial_slabs);
+    assert_int_equal(cache.objs_per_slab - 4, cache.total_free_objects);
+    __validate_cache_lists(&cache);
+
+    for (u16_t i = 0; i < num_objs; ++i) {
+        assert_ptr_not_equal(single, objects[i]);
+        assert_ptr_not_equal(objects[i], objects[(i + 1) % num_objs]);
+    }
+
+    // Return the batch with its two halves swapped, so every slab is visited in two runs.
+    void *swapped[num_objs];
+    u16_t half = num_objs / 2;
+
+    for (u16_t i = 0; i < num_objs; ++i) {
+        swapped[i] = objects[(i + half) % num_objs];
+    }
+
+    slab_free_bulk(&cache, swapped, num_objs);
+
+    assert_int_equal(1, cache.allocated_objects);
+    assert_int_equal(num_objs, cache.stats.frees);
+    assert_int_equal(0, cache.total_full_slabs);
+    assert_int_equal(1, cache.total_partial_slabs);
+    assert_int_equal(2, cache.total_free_slabs);
+    __validate_cache_lists(&cache);
+
+    // Everything freed can be allocated again.
+    assert_int_equal(num_objs, slab_alloc_bulk(&cache, objects, num_objs));
+    __validate_cache_lists(&cache);
+}
+
+
+typedef struct {
+    u64_t magic;
+    void *buffer;
+} ctor_obj_t;
+
+#define CTOR_MAGIC 0xC0FFEE
+
+static size_t __ctor_calls = 0;
+
+static void __test_ctor(void *obj) {
+    ((ctor_obj_t *)obj)->magic = CTOR_MAGIC;
+    ((ctor_obj_t *)obj)->buffer = obj;
+    ++__ctor_calls;
+}
+
+
+void test_kmem_cache_ctor(void **state) {
+    kmem_cache_t *cache = kmem_cache_create("test_ctor", sizeof(ctor_obj_t), _Alignof(ctor_obj_t), __test_ctor);
+
+    assert_non_null(cache);
+    assert_string_equal("test_ctor", cache->name);
+    assert_int_equal(KMEM_CACHE_ID, cache->cache_id);
+    assert_int_equal(sizeof(ctor_obj_t), cache->free_offset);
+
+    // The whole slab is constructed when it's created, and never again.
+    ctor_obj_t *obj = slab_alloc(cache);
+    assert_int_equal(cache->objs_per_slab, __ctor_calls);
+    assert_int_equal(CTOR_MAGIC, obj->magic);
+
+    slab_free(cache, obj);
+    ctor_obj_t *objects[cache->objs_per_slab];
+
+    for (u16_t i = 0; i < cache->objs_per_slab; ++i) {
+        objects[i] = slab_alloc(cache);
+
+        // Free objects keep their constructed state.
+        assert_int_equal(CTOR_MAGIC, objects[i]->magic);
+        assert_ptr_equal(objects[i], objects[i]->buffer);
+    }
+
+    assert_int_equal(cache->objs_per_slab, __ctor_calls);
+    __validate_cache_lists(cache);
+
+    // A cache with a constructor is never merged.
+    assert_ptr_not_equal(cache, kmem_cache_create("test_ctor2", sizeof(ctor_obj_t), _Alignof(ctor_obj_t), __test_ctor));
+}
+
+
+void test_kmem_cache_merge(void **state) {
+    kmem_cache_t *cache = kmem_cache_create("test_merge", 40, 8, NULL);
+    assert_non_null(cache);
+    assert_int_equal(0, cache->aliases);
+
+    // Same object layout, so the same cache.
+    assert_ptr_equal(cache, kmem_cache_create("test_merge2", 36, 8, NULL));
+    assert_int_equal(1, cache->aliases);
+    assert_string_equal("test_merge", cache->name);
+
+    // Stricter alignment needs a cache of its own, and objects are aligned despite the slab header.
+    kmem_cache_t *aligned = kmem_cache_create("test_aligned", 40, 64, NULL);
+    assert_ptr_not_equal(cache, aligned);
+    assert_int_equal(64, aligned->obj_cell_size);
+
+    for (u16_t i = 0; i < 2 * aligned->objs_per_slab; ++i) {
+        assert_aligned(slab_alloc(aligned), 64);
+    }
+
+    __validate_cache_lists(aligned);
+
+    // Alignments are rounded up to a power of 2 of at least 8 bytes.
+    assert_ptr_equal(cache, kmem_cache_create("test_align0", 40, 0, NULL));
+
+    kmem_cache_t *odd = kmem_cache_create("test_align24", 20, 24, NULL);
+    assert_int_equal(32, odd->obj_align);
+    assert_int_equal(32, odd->obj_cell_size);
+}
+
+
+void test_slab_colouring(void **state) {
+    kmem_cache_t cache;
+    slab_cache_init(&cache, COLOUR_OBJ_SIZE, 8, 0, 0, 0);
+
+    assert_int_equal(SLAB_COLOUR_ALIGN, cache.colour_align);
+    assert_int_equal((cache.slab_overhead - sizeof(slab_header_t)) / SLAB_COLOUR_ALIGN + 1, cache.colour_count);
+
+    void *heads[COLOUR_SLABS];
+    build_chase_ring(&cache, heads);
+
+    for (u16_t i = 0; i < COLOUR_SLABS; ++i) {
+        slab_t *slab = slab_of(heads[i]);
+        u16_t colour = (i % cache.colour_count) * SLAB_COLOUR_ALIGN;
+
+        // Colours cycle from slab to slab, and every object still fits in its slab.
+        assert_int_equal(colour, slab->header.colour);
+        assert_ptr_equal(slab->__slab_data + colour, heads[i]);
+        assert_true((u8_t *)heads[i] + cache.objs_per_slab * cache.obj_cell_size <= (u8_t *)slab + SLAB_BYTES(cache.slab_order));
+    }
+
+    __validate_cache_lists(&cache);
+}
+
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_slab_cache_init),
         cmocka_unit_test(test_slab_alloc),
         cmocka_unit_test(test_slab_free),
+        cmocka_unit_test(test_off_slab),
+        cmocka_unit_test(test_slab_shrink),
+        cmocka_unit_test(test_slab_reap),
+        cmocka_unit_test(test_slab_atomic),
+        cmocka_unit_test(test_slab_bulk),
+        cmocka_unit_test(test_kmem_cache_ctor),
+        cmocka_unit_test(test_kmem_cache_merge),
+        cmocka_unit_test(test_slab_colouring),
     };
 
     cmocka_run_group_tests(tests, suite_setup, suite_teardown);
@@ -0,0 +1,98 @@
+#include <suite.h>
+#include <cmocka.h>
+#include <memory.h>
+
+#include <mm/bitmap.h>
+
+static void test_sbmp_init(void **state) {
+    summary_bitmap_t sbmp;
+
+    // 8001 bits is 126 leaf words, 2 words in the first summary level and 1 word in the second.
+    assert_int_equal(126 + 2 + 1, sbmp_size_words(8001));
+    assert_int_equal(1 + 1, sbmp_size_words(64));
+
+    u64_t *buffer = (u64_t*)malloc(sbmp_size_words(8001) * sizeof(u64_t));
+    assert_int_equal(0, sbmp_init(&sbmp, buffer, 8001));
+
+    assert_int_equal(2, sbmp.num_levels);
+    assert_int_equal(126, sbmp.summary[0].size_bits);
+    assert_int_equal(2, sbmp.summary[1].size_bits);
+
+    assert_int_equal(0, sbmp_find_first_zero(&sbmp));
+    assert_int_equal(8000, sbmp_find_next_zero(&sbmp, 8000));
+    assert_int_equal(BMP_NOT_FOUND, sbmp_find_next_zero(&sbmp, 8001));
+
+    free(buffer);
+}
+
+// Bitmaps needing more than SBMP_MAX_LEVELS summary levels are rejected before anything is written.
+static void test_sbmp_init_too_large(void **state) {
+    summary_bitmap_t sbmp;
+    sbmp.num_levels = 0;
+
+    // The largest bitmap uses all 4 summary levels, the last of them a single word.
+    assert_int_equal((1ul << 24) + (1ul << 18) + (1ul << 12) + (1ul << 6) + 1, sbmp_size_words(SBMP_MAX_BITS));
+    assert_int_equal(-1, sbmp_init(&sbmp, NULL, SBMP_MAX_BITS + 1));
+    assert_int_equal(0, sbmp.num_levels);
+}
+
+static void test_sbmp_find_zero(void **state) {
+    summary_bitmap_t sbmp;
+
+    u64_t *buffer = (u64_t*)malloc(sbmp_size_words(8001) * sizeof(u64_t));
+    sbmp_init(&sbmp, buffer, 8001);
+
+    sbmp_set_range(&sbmp, 0, 8001);
+    assert_int_equal(BMP_NOT_FOUND, sbmp_find_first_zero(&sbmp));
+    assert_int_equal(0, sbmp.summary[1].base[0]);
+
+    sbmp_set_bit(&sbmp, 4097, 0);
+    sbmp_set_bit(&sbmp, 7000, 0);
+
+    assert_int_equal(0, sbmp_get_bit(&sbmp, 4097));
+    assert_int_equal(4097, sbmp_find_first_zero(&sbmp));
+    assert_int_equal(7000, sbmp_find_next_zero(&sbmp, 4098));
+    assert_int_equal(BMP_NOT_FOUND, sbmp_find_next_zero(&sbmp, 7001));
+
+    sbmp_set_bit(&sbmp, 4097, 1);
+    assert_int_equal(7000, sbmp_find_first_zero(&sbmp));
+
+    sbmp_clear_range(&sbmp, 100, 10);
+    assert_int_equal(100, sbmp_find_first_zero(&sbmp));
+    assert_int_equal(109, sbmp_find_next_zero(&sbmp, 109));
+    assert_int_equal(7000, sbmp_find_next_zero(&sbmp, 110));
+
+    free(buffer);
+}
+
+// A page bitmap for a 64GB machine. Finding the only free page goes through the summary levels.
+static void test_sbmp_large(void **state) {
+    summary_bitmap_t sbmp;
+    size_t num_pages = (64ul << 30) >> PAGE_ORDER;
+
+    u64_t *buffer = (u64_t*)malloc(sbmp_size_words(num_pages) * sizeof(u64_t));
+    sbmp_init(&sbmp, buffer, num_pages);
+
+    assert_int_equal(3, sbmp.num_levels);
+
+    sbmp_set_range(&sbmp, 0, num_pages);
+    sbmp_set_bit(&sbmp, num_pages - 3, 0);
+
+    assert_int_equal(num_pages - 3, sbmp_find_first_zero(&sbmp));
+
+    sbmp_set_bit(&sbmp, num_pages - 3, 1);
+    assert_int_equal(BMP_NOT_FOUND, sbmp_find_first_zero(&sbmp));
+
+    free(buffer);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_sbmp_init),
+        cmocka_unit_test(test_sbmp_init_too_large),
+        cmocka_unit_test(test_sbmp_find_zero),
+        cmocka_unit_test(test_sbmp_large),
+    };
+
+    return cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
@@ -0,0 +1,219 @@
+#include <suite.h>
+#include <cmocka.h>
+#include <assertions.h>
+#include <time.h>
+
+#include <mm.h>
+#include <mm/vm.h>
+#include <mm/tlsf.h>
+
+
+#define POOL_BYTES (1ul << 20)
+
+static size_t __vmallocs, __vfrees;
+
+virt_addr_t vmalloc(size_t pages, u8_t flags) {
+    ++__vmallocs;
+    return __test_physical_mem + 0x100000;
+}
+
+void vfree(virt_addr_t addr, size_t pages) {
+    assert_ptr_equal(__test_physical_mem + 0x100000, addr);
+    ++__vfrees;
+}
+
+
+// Every byte of the pool is either in use or in a free block, so a fully freed pool is a single free block again.
+static void __assert_empty(tlsf_t *tlsf, size_t pool_bytes) {
+    assert_int_equal(0, tlsf->used_bytes);
+    assert_int_equal(tlsf->allocs, tlsf->frees);
+
+    assert_int_equal(1, __builtin_popcount(tlsf->fl_bitmap));
+    u8_t fl = __builtin_ctz(tlsf->fl_bitmap);
+
+    assert_int_equal(1, __builtin_popcount(tlsf->sl_bitmap[fl]));
+    tlsf_block_t *block = tlsf->free[fl][__builtin_ctz(tlsf->sl_bitmap[fl])];
+
+    assert_null(block->next_free);
+    assert_int_equal(pool_bytes - 2 * TLSF_BLOCK_HEADER, block->size & ~1ul);
+}
+
+
+static void test_tlsf_init(void **state) {
+    tlsf_t tlsf;
+
+    assert_int_equal(-1, tlsf_init(&tlsf, __test_physical_mem, TLSF_BLOCK_HEADER));
+    assert_int_equal(0, tlsf_init(&tlsf, __test_physical_mem, POOL_BYTES));
+
+    // The whole pool is one free block.
+    size_t free_size = POOL_BYTES - 2 * TLSF_BLOCK_HEADER;
+    __assert_empty(&tlsf, POOL_BYTES);
+
+    assert_null(tlsf_alloc(&tlsf, free_size + 1));
+    assert_null(tlsf_alloc(&tlsf, 0));
+    assert_int_equal(1, tlsf.failures);
+
+    // Unaligned memory is trimmed to the alignment.
+    assert_int_equal(0, tlsf_init(&tlsf, __test_physical_mem + 3, POOL_BYTES));
+    void *ptr = tlsf_alloc(&tlsf, 1);
+    assert_aligned(ptr, TLSF_ALIGN);
+}
+
+
+static void test_tlsf_alloc_free(void **state) {
+    tlsf_t tlsf;
+    tlsf_init(&tlsf, __test_physical_mem, POOL_BYTES);
+
+    size_t sizes[] = { 1, 16, 17, 100, 500, 511, 512, 513, 1000, 4096, 5000, 65536 };
+    u8_t *ptrs[sizeof(sizes) / sizeof(size_t)];
+    size_t count = sizeof(sizes) / sizeof(size_t);
+
+    for (size_t i = 0; i < count; ++i) {
+        ptrs[i] = tlsf_alloc(&tlsf, sizes[i]);
+
+        assert_non_null(ptrs[i]);
+        assert_aligned(ptrs[i], TLSF_ALIGN);
+        assert_true(tlsf_size(ptrs[i]) >= sizes[i]);
+        assert_true(tlsf_size(ptrs[i]) < sizes[i] + 2 * TLSF_ALIGN + TLSF_BLOCK_HEADER);
+
+        memset(ptrs[i], i, sizes[i]);
+    }
+
+    // The allocations don't overlap.
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t byte = 0; byte < sizes[i]; ++byte) {
+            assert_int_equal(i, ptrs[i][byte]);
+        }
+    }
+
+    // Free every other allocation first so that the rest have to merge on both sides.
+    for (size_t i = 0; i < count; i += 2) {
+        tlsf_free(&tlsf, ptrs[i]);
+    }
+
+    for (size_t i = 1; i < count; i += 2) {
+        tlsf_free(&tlsf, ptrs[i]);
+    }
+
+    tlsf_free(&tlsf, NULL);
+    __assert_empty(&tlsf, POOL_BYTES);
+}
+
+
+static void test_tlsf_reuse(void **state) {
+    tlsf_t tlsf;
+    tlsf_init(&tlsf, __test_physical_mem, POOL_BYTES);
+
+    void *a = tlsf_alloc(&tlsf, 256);
+    void *b = tlsf_alloc(&tlsf, 256);
+    void *c = tlsf_alloc(&tlsf, 256);
+
+    // A freed block which isn't next to free memory is handed out again as is.
+    tlsf_free(&tlsf, b);
+    assert_ptr_equal(b, tlsf_alloc(&tlsf, 200));
+
+    // Freeing b then a merges them, leaving room for both in a's place.
+    tlsf_free(&tlsf, b);
+    tlsf_free(&tlsf, a);
+    assert_ptr_equal(a, tlsf_alloc(&tlsf, 512 + TLSF_BLOCK_HEADER));
+
+    tlsf_free(&tlsf, a);
+    tlsf_free(&tlsf, c);
+    __assert_empty(&tlsf, POOL_BYTES);
+}
+
+
+static void test_tlsf_exhaust(void **state) {
+    tlsf_t tlsf;
+    tlsf_init(&tlsf, __test_physical_mem, POOL_BYTES);
+
+    void *ptrs[POOL_BYTES / 1024];
+    size_t count = 0;
+
+    while ((ptrs[count] = tlsf_alloc(&tlsf, 1024 - TLSF_BLOCK_HEADER)) != NULL) {
+        ++count;
+    }
+
+    // Every block but the last one fits, the sentinel at the end of the pool takes its header.
+    assert_int_equal(POOL_BYTES / 1024 - 1, count);
+    assert_int_equal(1, tlsf.failures);
+
+    for (size_t i = 0; i < count; ++i) {
+        tlsf_free(&tlsf, ptrs[i]);
+    }
+
+    __assert_empty(&tlsf, POOL_BYTES);
+}
+
+
+#define RANDOM_SLOTS 256
+#define RANDOM_ROUNDS 20000
+
+static void test_tlsf_random(void **state) {
+    tlsf_t tlsf;
+    tlsf_init(&tlsf, __test_physical_mem, POOL_BYTES);
+
+    u8_t *ptrs[RANDOM_SLOTS] = { 0 };
+    size_t sizes[RANDOM_SLOTS] = { 0 };
+
+    srand(time(NULL));
+
+    for (u32_t round = 0; round < RANDOM_ROUNDS; ++round) {
+        size_t slot = rand() % RANDOM_SLOTS;
+
+        if (ptrs[slot] != NULL) {
+            // The allocation wasn't overwritten by its neighbours.
+            assert_int_equal((u8_t)slot, ptrs[slot][0]);
+            assert_int_equal((u8_t)slot, ptrs[slot][sizes[slot] - 1]);
+
+            tlsf_free(&tlsf, ptrs[slot]);
+            ptrs[slot] = NULL;
+            continue;
+        }
+
+        // Mostly small sizes with the odd large one.
+        sizes[slot] = rand() % 8 ? 1 + rand() % 512 : 1 + rand() % 16384;
+        ptrs[slot] = tlsf_alloc(&tlsf, sizes[slot]);
+
+        assert_non_null(ptrs[slot]);
+        memset(ptrs[slot], (u8_t)slot, sizes[slot]);
+    }
+
+    for (size_t slot = 0; slot < RANDOM_SLOTS; ++slot) {
+        tlsf_free(&tlsf, ptrs[slot]);
+    }
+
+    __assert_empty(&tlsf, POOL_BYTES);
+}
+
+
+static void test_tlsf_create(void **state) {
+    tlsf_t tlsf;
+
+    assert_int_equal(0, tlsf_create(&tlsf, 16));
+    assert_int_equal(1, __vmallocs);
+
+    void *ptr = tlsf_alloc(&tlsf, 1000);
+    assert_true((u8_t*)ptr >= __test_physical_mem + 0x100000);
+    assert_true((u8_t*)ptr < __test_physical_mem + 0x100000 + (16 << PAGE_ORDER));
+
+    tlsf_free(&tlsf, ptr);
+    tlsf_destroy(&tlsf);
+
+    assert_int_equal(1, __vfrees);
+    assert_null(tlsf.pool);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_tlsf_init),
+        cmocka_unit_test(test_tlsf_alloc_free),
+        cmocka_unit_test(test_tlsf_reuse),
+        cmocka_unit_test(test_tlsf_exhaust),
+        cmocka_unit_test(test_tlsf_random),
+        cmocka_unit_test(test_tlsf_create),
+    };
+
+    return cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
@@ -0,0 +1,147 @@
+#include <suite.h>
+#include <cmocka.h>
+
+#include <mm.h>
+#include <mm/vm.h>
+#include <mm/vmzone.h>
+#include <mm/slab.h>
+
+
+// The page tables walked by vm.c are the real ones, only their physical memory comes from this bump allocator.
+#define PHYS_POOL_BASE (PHYS_MEM_SIZE >> 1)
+
+static phys_addr_t __phys_next = PHYS_POOL_BASE;
+static size_t __phys_pages = 0;
+// Number of phys_alloc calls which succeed before it runs out of memory.
+static size_t __phys_allocs_left = (size_t)-1;
+
+phys_addr_t phys_alloc(size_t num_pages) {
+    if (__phys_allocs_left == 0) {
+        return NULL;
+    }
+
+    --__phys_allocs_left;
+
+    phys_addr_t block = __phys_next;
+    __phys_next += num_pages << PAGE_ORDER;
+    __phys_pages += num_pages;
+
+    return block;
+}
+
+void phys_free(phys_addr_t block_addr, size_t num_pages) {
+    __phys_pages -= num_pages;
+}
+
+// Every block of a batch counts as one phys_alloc call.
+size_t phys_alloc_bulk(u8_t order, phys_addr_t *blocks, size_t count) {
+    size_t allocated = 0;
+
+    while (allocated < count && __phys_allocs_left > 0) {
+        blocks[allocated++] = phys_alloc(1ul << order);
+    }
+
+    return allocated;
+}
+
+void phys_free_bulk(const phys_addr_t *blocks, size_t count, u8_t order) {
+    __phys_pages -= count << order;
+}
+
+
+static int setup_vm(void **state) {
+    vmzone_init();
+    return 0;
+}
+
+
+// Running out of physical memory for a block fails the allocation and leaves the block free.
+static void test_vm_alloc_block_oom(void **state) {
+    vmzone_t *zone = vmzone_info(VMZONE_KERNEL_SLAB);
+    virt_addr_t block = zone->cursor_addr;
+
+    // Enough for the three page tables down to the block but not for the block.
+    __phys_allocs_left = 3;
+    assert_null(vm_alloc_block_pages(VM_ALLOW_WRITE, VMZONE_KERNEL_SLAB, 4));
+    assert_ptr_equal(block, zone->cursor_addr);
+    assert_int_equal(3, __phys_pages);
+
+    // The page tables are kept, the next allocation only needs the block.
+    __phys_allocs_left = 1;
+    assert_ptr_equal(block, vm_alloc_block_pages(VM_ALLOW_WRITE, VMZONE_KERNEL_SLAB, 4));
+    assert_ptr_not_equal(block, zone->cursor_addr);
+    assert_int_equal(3 + 4, __phys_pages);
+
+    assert_int_equal(0, vm_free_block(block, VMZONE_KERNEL_SLAB));
+    assert_ptr_equal(block, zone->cursor_addr);
+    assert_int_equal(3, __phys_pages);
+
+    __phys_allocs_left = (size_t)-1;
+}
+
+
+// Page tables which were batched before the allocator ran out are given back instead of linking in page 0.
+static void test_vm_alloc_block_no_page_tables(void **state) {
+    // Nothing has been mapped in the stack zone yet, so a block needs three new page tables.
+    vmzone_t *zone = vmzone_info(VMZONE_KERNEL_STACK);
+    virt_addr_t block = zone->cursor_addr;
+    size_t pages = __phys_pages;
+
+    __phys_allocs_left = 2;
+    assert_null(vm_alloc_block_pages(VM_ALLOW_WRITE, VMZONE_KERNEL_STACK, 2));
+    assert_ptr_equal(block, zone->cursor_addr);
+    assert_int_equal(pages, __phys_pages);
+
+    // None of the tables were linked in, so they're all allocated again.
+    __phys_allocs_left = (size_t)-1;
+    assert_ptr_equal(block, vm_alloc_block_pages(VM_ALLOW_WRITE, VMZONE_KERNEL_STACK, 2));
+    assert_int_equal(pages + 3 + 2, __phys_pages);
+
+    assert_int_equal(0, vm_free_block(block, VMZONE_KERNEL_STACK));
+    assert_int_equal(pages + 3, __phys_pages);
+}
+
+
+// vmalloc_direct gives back the physical block it mapped so far when a page table can't be allocated.
+static void test_vmalloc_direct_no_page_tables(void **state) {
+    virt_addr_t base = vmzone_info(VMZONE_KERNEL_VMALLOC)->start_address;
+    size_t pages = __phys_pages;
+
+    // The slab zone shares its PDPT, so the block needs a page directory and a page table. Only one of them is there.
+    __phys_allocs_left = 2;
+    assert_null(vmalloc_direct(4, VM_ALLOW_WRITE, base));
+    assert_int_equal(pages, __phys_pages);
+
+    __phys_allocs_left = (size_t)-1;
+    assert_ptr_equal(base, vmalloc_direct(4, VM_ALLOW_WRITE, base));
+    assert_int_equal(pages + 4 + 2, __phys_pages);
+
+    vfree_direct(base, 4);
+    assert_int_equal(pages + 2, __phys_pages);
+}
+
+
+// A slab which can't be backed fails the allocation instead of handing out unbacked memory.
+static void test_slab_alloc_oom(void **state) {
+    kmem_cache_t cache;
+    slab_cache_init(&cache, 64, 8, 0, 0, 0);
+
+    __phys_allocs_left = 0;
+    assert_null(slab_alloc(&cache));
+    assert_int_equal(1, cache.stats.failures);
+    assert_int_equal(0, cache.stats.grows);
+
+    __phys_allocs_left = (size_t)-1;
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup(test_vm_alloc_block_oom, setup_vm),
+        cmocka_unit_test(test_vm_alloc_block_no_page_tables),
+        cmocka_unit_test(test_vmalloc_direct_no_page_tables),
+        cmocka_unit_test(test_slab_alloc_oom),
+    };
+
+    return cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
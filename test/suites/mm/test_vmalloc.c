@@ -0,0 +1,179 @@
+#include <suite.h>
+#include <cmocka.h>
+
+#include <mm.h>
+#include <mm/vm.h>
+#include <mm/vmzone.h>
+
+
+#define GRANULE_PAGES (1ul << VMALLOC_GRANULE_ORDER)
+#define GRANULE_BYTES (GRANULE_PAGES << PAGE_ORDER)
+#define ZONE_GRANULES (((size_t)VMZONE_VMALLOC_GB << 30) / GRANULE_BYTES)
+
+// Only the page mapping is mocked, vmalloc's bookkeeping of the zone is the real one.
+static size_t __mapped_pages = 0;
+static size_t __direct_calls = 0;
+// Number of vmalloc_direct calls which succeed before it runs out of memory.
+static size_t __direct_calls_left = (size_t)-1;
+static virt_addr_t __last_unmapped;
+
+virt_addr_t vmalloc_direct(u8_t pages, u8_t flags, virt_addr_t base_address) {
+    ++__direct_calls;
+
+    if (__direct_calls_left == 0) {
+        return NULL;
+    }
+
+    --__direct_calls_left;
+    __mapped_pages += pages;
+    return base_address;
+}
+
+void vfree_direct(virt_addr_t base_address, size_t pages) {
+    __mapped_pages -= pages;
+    __last_unmapped = base_address;
+}
+
+
+static u8_t *__zone_base() {
+    return vmzone_info(VMZONE_KERNEL_VMALLOC)->start_address;
+}
+
+static int setup_vmalloc(void **state) {
+    vmzone_init();
+    return 0;
+}
+
+
+// Allocations are granule aligned and go in the first hole large enough for them.
+static void test_vmalloc_first_fit(void **state) {
+    u8_t *base = __zone_base();
+
+    u8_t *a = vmalloc(1, VM_ALLOW_WRITE);
+    u8_t *b = vmalloc(GRANULE_PAGES + 1, VM_ALLOW_WRITE);
+    u8_t *c = vmalloc(GRANULE_PAGES, VM_ALLOW_WRITE);
+
+    assert_ptr_equal(base, a);
+    assert_ptr_equal(base + GRANULE_BYTES, b);
+    assert_ptr_equal(base + 3 * GRANULE_BYTES, c);
+    assert_int_equal(2 * GRANULE_PAGES + 2, __mapped_pages);
+
+    // Freeing b leaves a 2 granule hole, too small for 3 granules but a fit for 2.
+    vfree(b, GRANULE_PAGES + 1);
+
+    u8_t *d = vmalloc(2 * GRANULE_PAGES + 1, VM_ALLOW_WRITE);
+    assert_ptr_equal(base + 4 * GRANULE_BYTES, d);
+
+    u8_t *e = vmalloc(2 * GRANULE_PAGES, VM_ALLOW_WRITE);
+    assert_ptr_equal(base + GRANULE_BYTES, e);
+
+    vfree(a, 1);
+    vfree(c, GRANULE_PAGES);
+    vfree(d, 2 * GRANULE_PAGES + 1);
+    vfree(e, 2 * GRANULE_PAGES);
+    assert_int_equal(0, __mapped_pages);
+}
+
+
+// Once the zone is full allocations fail without mapping anything.
+static void test_vmalloc_exhaustion(void **state) {
+    u8_t *base = __zone_base();
+    size_t zone_pages = ZONE_GRANULES * GRANULE_PAGES;
+
+    assert_null(vmalloc(zone_pages + 1, VM_ALLOW_WRITE));
+
+    // Leave only the last granule free.
+    u8_t *most = vmalloc(zone_pages - GRANULE_PAGES, VM_ALLOW_WRITE);
+    assert_ptr_equal(base, most);
+
+    size_t calls = __direct_calls;
+    assert_null(vmalloc(GRANULE_PAGES + 1, VM_ALLOW_WRITE));
+    assert_int_equal(calls, __direct_calls);
+
+    u8_t *last = vmalloc(GRANULE_PAGES, VM_ALLOW_WRITE);
+    assert_ptr_equal(base + (zone_pages << PAGE_ORDER) - GRANULE_BYTES, last);
+    assert_null(vmalloc(1, VM_ALLOW_WRITE));
+
+    vfree(most, zone_pages - GRANULE_PAGES);
+    vfree(last, GRANULE_PAGES);
+    assert_int_equal(0, __mapped_pages);
+
+    assert_ptr_equal(base, vmalloc(1, VM_ALLOW_WRITE));
+    vfree(base, 1);
+}
+
+
+// An allocation grows into the rest of its last granule, and into the following granules only if they're free.
+static void test_vmalloc_grow(void **state) {
+    u8_t *base = __zone_base();
+
+    u8_t *a = vmalloc(1, VM_ALLOW_WRITE);
+    u8_t *b = vmalloc(GRANULE_PAGES, VM_ALLOW_WRITE);
+    assert_ptr_equal(base + GRANULE_BYTES, b);
+
+    assert_int_equal(0, vmalloc_grow(a, 1, GRANULE_PAGES, VM_ALLOW_WRITE));
+    assert_int_equal(2 * GRANULE_PAGES, __mapped_pages);
+
+    // The next granule belongs to b.
+    size_t calls = __direct_calls;
+    assert_int_equal(-1, vmalloc_grow(a, GRANULE_PAGES, GRANULE_PAGES + 1, VM_ALLOW_WRITE));
+    assert_int_equal(calls, __direct_calls);
+    assert_int_equal(2 * GRANULE_PAGES, __mapped_pages);
+
+    // Nor can it grow past the end of the zone.
+    u8_t *tail = base + (ZONE_GRANULES - 1) * GRANULE_BYTES;
+    assert_int_equal(-1, vmalloc_grow(tail, 1, GRANULE_PAGES + 1, VM_ALLOW_WRITE));
+
+    vfree(b, GRANULE_PAGES);
+    assert_int_equal(0, vmalloc_grow(a, GRANULE_PAGES, GRANULE_PAGES + 1, VM_ALLOW_WRITE));
+
+    // The granule a grew into is taken.
+    u8_t *c = vmalloc(1, VM_ALLOW_WRITE);
+    assert_ptr_equal(base + 2 * GRANULE_BYTES, c);
+
+    vfree(a, GRANULE_PAGES + 1);
+    vfree(c, 1);
+    assert_int_equal(0, __mapped_pages);
+}
+
+
+// A failure part way through mapping unmaps what was mapped and leaves the granules free.
+static void test_vmalloc_unwind(void **state) {
+    u8_t *base = __zone_base();
+
+    // The pages are mapped 128 at a time, the third step fails.
+    __direct_calls_left = 2;
+    assert_null(vmalloc(300, VM_ALLOW_WRITE));
+    assert_int_equal(0, __mapped_pages);
+    assert_ptr_equal(base, __last_unmapped);
+
+    __direct_calls_left = (size_t)-1;
+    u8_t *a = vmalloc(1, VM_ALLOW_WRITE);
+    assert_ptr_equal(base, a);
+
+    // Growing only unmaps the pages it added.
+    __direct_calls_left = 1;
+    assert_int_equal(-1, vmalloc_grow(a, 1, 300, VM_ALLOW_WRITE));
+    assert_int_equal(1, __mapped_pages);
+    assert_ptr_equal(a + PAGE_SIZE, __last_unmapped);
+
+    __direct_calls_left = (size_t)-1;
+    u8_t *b = vmalloc(1, VM_ALLOW_WRITE);
+    assert_ptr_equal(base + GRANULE_BYTES, b);
+
+    vfree(a, 1);
+    vfree(b, 1);
+    assert_int_equal(0, __mapped_pages);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup(test_vmalloc_first_fit, setup_vmalloc),
+        cmocka_unit_test(test_vmalloc_exhaustion),
+        cmocka_unit_test(test_vmalloc_grow),
+        cmocka_unit_test(test_vmalloc_unwind),
+    };
+
+    return cmocka_run_group_tests(tests, suite_setup, suite_teardown);
+}
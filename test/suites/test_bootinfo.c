@@ -1,4 +1,5 @@
 #include <suite.h>
+#include <setup/setup_bootinfo.h>
 #include <mm/boot_mmap.h>
 #include <utility/bootinfo.h>
 #include <cmocka.h>
@@ -45,11 +46,37 @@ static void test_reserve_region(void **state) {
 }
 
 
+static void test_is_block_usable(void **state) {
+    physmem_region_t *region = load_physmem_regions();
+
+    // Earlier tests may have reserved memory, only the free part of each region is usable.
+    const phys_addr_t low_start = region->free_start;
+    const phys_addr_t high_start = region->next_region->free_start;
+
+    // The first page and anything outside of physical memory is never usable.
+    assert_int_equal(0, is_block_usable(0, PAGE_SIZE));
+    assert_int_equal(0, is_block_usable(low_start - PAGE_SIZE, PAGE_SIZE));
+    assert_int_equal(0, is_block_usable(PHYS_MEM_SIZE, PAGE_SIZE));
+    assert_int_equal(0, is_block_usable(PHYS_MEM_SIZE - PAGE_SIZE, 2 * PAGE_SIZE));
+
+    assert_int_equal(1, is_block_usable(low_start, PAGE_SIZE));
+    assert_int_equal(1, is_block_usable(MEMHOLE_BEGIN - PAGE_SIZE, PAGE_SIZE));
+    assert_int_equal(1, is_block_usable(high_start, PHYS_MEM_SIZE - high_start));
+
+    // Blocks overlapping the memory hole or reserved memory are unusable.
+    assert_int_equal(0, is_block_usable(MEMHOLE_BEGIN - PAGE_SIZE, 2 * PAGE_SIZE));
+    assert_int_equal(0, is_block_usable(MEMHOLE_BEGIN, PAGE_SIZE));
+    assert_int_equal(0, is_block_usable(high_start - PAGE_SIZE, 2 * PAGE_SIZE));
+    assert_int_equal(0, is_block_usable(low_start, PHYS_MEM_SIZE - low_start));
+}
+
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_boot_tag_by_type),
         cmocka_unit_test(test_load_physmem_regions),
         cmocka_unit_test(test_reserve_region),
+        cmocka_unit_test(test_is_block_usable),
     };
 
     return cmocka_run_group_tests(tests, suite_setup, suite_teardown);